@@ -0,0 +1,95 @@
+#include "particle.hpp"
+using namespace std;
+
+static const size_t ATTR_TILE = 64; // work-group size of accelerate, also attractors per local-memory tile
+
+static cl_mem attrmem = nullptr;        // device copy of attractors
+static size_t capacity = 0;             // attractors attrmem can hold
+static size_t dirtylo = 0, dirtyhi = 0; // range changed since the last upload
+
+// Grow the range that has to be uploaded
+static void touch(size_t lo, size_t hi)
+{
+    if (dirtylo == dirtyhi)
+    {
+        dirtylo = lo;
+        dirtyhi = hi;
+        return;
+    }
+    dirtylo = min(dirtylo, lo);
+    dirtyhi = max(dirtyhi, hi);
+}
+
+void attradd(const Attractor &a)
+{
+    sim.attractors.push_back(a);
+    touch(sim.attractors.size() - 1, sim.attractors.size());
+    sim.mouse.n = sim.attractors.size();
+}
+
+void attrclear()
+{
+    sim.attractors.clear();
+    dirtylo = dirtyhi = 0;
+    sim.mouse.n = 0;
+}
+
+// Follow the particles when zooming
+void attrscale(float f)
+{
+    for (auto &a : sim.attractors)
+        for (int c = 0; c < 3; c++)
+            a.pos[c] *= f;
+    touch(0, sim.attractors.size());
+}
+
+// Copy what changed to the device, reallocating when the buffer is too small
+static void attrupload()
+{
+    if (!attrmem || sim.attractors.size() > capacity)
+    {
+        if (attrmem)
+            clReleaseMemObject(attrmem);
+        capacity = max(capacity * 2, max(sim.attractors.size(), ATTR_TILE));
+        attrmem = clCreateBuffer(context, CL_MEM_READ_ONLY, capacity * sizeof(Attractor), NULL, &ret);
+        if (ret != CL_SUCCESS)
+        {
+            cout << RED << "Failed to create attractor buffer: " << ret << endl;
+            exit(1);
+        }
+        touch(0, sim.attractors.size());
+    }
+    if (dirtylo < dirtyhi)
+        clEnqueueWriteBuffer(command_queue, attrmem, CL_FALSE, dirtylo * sizeof(Attractor),
+                             (dirtyhi - dirtylo) * sizeof(Attractor), &sim.attractors[dirtylo], 0, NULL, NULL);
+    dirtylo = dirtyhi = 0;
+}
+
+// Enqueue a kernel that calls attraction() over n items, with the mouse, the attractors and
+// the local tile as arguments first to first + 2. The global size is padded to whole work
+// groups because every work item takes part in loading the tiles, the kernels skip the padding.
+void attrlaunch(cl_kernel k, cl_uint first, size_t n)
+{
+    attrupload();
+    size_t local = ATTR_TILE;
+    size_t global = (n + ATTR_TILE - 1) / ATTR_TILE * ATTR_TILE;
+    clSetKernelArg(k, first, sizeof(Mass), &sim.mouse);
+    clSetKernelArg(k, first + 1, sizeof(cl_mem), &attrmem);
+    clSetKernelArg(k, first + 2, ATTR_TILE * sizeof(Attractor), NULL);
+    ret = clEnqueueNDRangeKernel(command_queue, k, 1, nullptr, &global, &local, 0, nullptr, traceev("attractors"));
+}
+
+void attraccelerate()
+{
+    cl_int np = sim.n;
+    clSetKernelArg(sim.ker_acc, 4, sizeof(cl_int), &np);
+    attrlaunch(sim.ker_acc, 1, sim.n);
+}
+
+void attrend()
+{
+    if (attrmem)
+        clReleaseMemObject(attrmem);
+    attrmem = nullptr;
+    capacity = 0;
+}
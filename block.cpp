@@ -0,0 +1,104 @@
+#include "particle.hpp"
+using namespace std;
+
+static cl_kernel ker_classify, ker_compact, ker_block;
+static cl_mem cls, counts, cursor, list;
+
+static cl_kernel blockkernel(const char *name)
+{
+    cl_kernel k = clCreateKernel(program, name, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create " << name << " kernel: " << ret << endl;
+        exit(1);
+    }
+    return k;
+}
+
+void blockinit()
+{
+    if (opts.backend == BK_CPU)
+        return;
+    cl_int np = sim.n, levels = opts.blocklevels;
+    cls = clCreateBuffer(context, CL_MEM_READ_WRITE, sim.n * sizeof(int), NULL, &ret);
+    list = clCreateBuffer(context, CL_MEM_READ_WRITE, sim.n * sizeof(int), NULL, &ret);
+    counts = clCreateBuffer(context, CL_MEM_READ_WRITE, (levels + 1) * sizeof(int), NULL, &ret);
+    cursor = clCreateBuffer(context, CL_MEM_READ_WRITE, (levels + 1) * sizeof(int), NULL, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create block timestep buffers: " << ret << endl;
+        exit(1);
+    }
+
+    ker_classify = blockkernel("classify");
+    ker_compact = blockkernel("compact");
+    ker_block = blockkernel("blockstep");
+
+    clSetKernelArg(ker_classify, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_classify, 4, sizeof(cl_int), &np);
+    clSetKernelArg(ker_classify, 5, sizeof(cl_int), &levels);
+    clSetKernelArg(ker_classify, 6, sizeof(cl_mem), &cls);
+    clSetKernelArg(ker_classify, 7, sizeof(cl_mem), &counts);
+    cl_mem params = paramsbuffer();
+    clSetKernelArg(ker_classify, 8, sizeof(cl_mem), &params);
+
+    clSetKernelArg(ker_compact, 0, sizeof(cl_mem), &cls);
+    clSetKernelArg(ker_compact, 1, sizeof(cl_mem), &cursor);
+    clSetKernelArg(ker_compact, 2, sizeof(cl_mem), &list);
+
+    clSetKernelArg(ker_block, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_block, 5, sizeof(cl_mem), &list);
+    clSetKernelArg(ker_block, 6, sizeof(cl_mem), &cls);
+    clSetKernelArg(ker_block, 10, sizeof(cl_mem), &params);
+}
+
+// Advance every particle by the base step dt in substeps of its own class. Class k is due
+// every 2^(top - k) finest substeps, so at substep s the due classes are top - ctz(s) and
+// finer, which the finest-first lists hold as a prefix. Slow particles are touched once.
+void blockstep()
+{
+    int levels = opts.blocklevels;
+    vector<int> n(levels + 1, 0), offset(levels + 1), prefix(levels + 1);
+    clEnqueueWriteBuffer(command_queue, counts, CL_FALSE, 0, n.size() * sizeof(int), n.data(), 0, NULL, NULL);
+    attrlaunch(ker_classify, 1, sim.n);
+    clEnqueueReadBuffer(command_queue, counts, CL_TRUE, 0, n.size() * sizeof(int), n.data(), 0, NULL, NULL);
+
+    int top = 0;
+    for (int k = levels, s = 0; k >= 0; k--)
+    {
+        offset[k] = s;
+        s += n[k];
+        prefix[k] = s;
+        if (n[k] && !top)
+            top = k;
+    }
+    size_t np = sim.n;
+    cl_uint step = nstep;
+    cl_ulong seed = opts.seed;
+    cl_int mixed = opts.mixed;
+    clSetKernelArg(ker_block, 7, sizeof(cl_uint), &step);
+    clSetKernelArg(ker_block, 8, sizeof(cl_ulong), &seed);
+    clSetKernelArg(ker_block, 9, sizeof(cl_int), &mixed);
+    clEnqueueWriteBuffer(command_queue, cursor, CL_FALSE, 0, offset.size() * sizeof(int), offset.data(), 0, NULL,
+                         NULL);
+    clEnqueueNDRangeKernel(command_queue, ker_compact, 1, NULL, &np, NULL, 0, NULL, NULL);
+
+    for (int s = 0; s < 1 << top; s++)
+    {
+        int due = s ? top - __builtin_ctz(s) : 0;
+        cl_int nactive = prefix[due];
+        clSetKernelArg(ker_block, 4, sizeof(cl_int), &nactive);
+        attrlaunch(ker_block, 1, nactive);
+    }
+}
+
+void blockend()
+{
+    if (opts.backend == BK_CPU)
+        return;
+    clReleaseKernel(ker_classify);
+    clReleaseKernel(ker_compact);
+    clReleaseKernel(ker_block);
+    for (cl_mem mem : {cls, counts, cursor, list})
+        clReleaseMemObject(mem);
+}
@@ -0,0 +1,65 @@
+// Domain boundaries, shared by kernel.cl (prepended after rng.h) and the host like rng.h.
+// The domain is the box [-box, box) on every axis.
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#ifdef __OPENCL_VERSION__
+#define bd_floor floor
+#define bd_rint rint
+#else
+#define bd_floor floorf
+#define bd_rint rintf
+#endif
+
+// Values of opts.boundary and Mass::boundary
+#define BD_NONE 0     // unbounded
+#define BD_PERIODIC 1 // leaving through a face enters through the opposite one
+#define BD_REFLECT 2  // the faces are walls that mirror the velocity
+#define BD_RECYCLE 3  // particles leaving the box are emitted again at the mouse, at rest
+
+// Shortest periodic image of a separation along one axis
+RNG_INLINE float bd_image(int mode, float box, float d)
+{
+    return mode == BD_PERIODIC ? d - 2 * box * bd_rint(d / (2 * box)) : d;
+}
+
+// Bring a particle that has just moved back into the box. Recycled particles are jittered
+// around emit by a draw keyed on their index and the step, like gen.
+RNG_INLINE void bd_apply(int mode, float box, float *pos, float *vel, rng_u32 i, rng_u32 step, rng_u64 seed,
+                         const float *emit)
+{
+    if (mode == BD_PERIODIC)
+    {
+        for (int c = 0; c < 3; c++)
+            pos[c] -= 2 * box * bd_floor((pos[c] + box) / (2 * box));
+    }
+    else if (mode == BD_REFLECT)
+    {
+        // Mirror once, a particle that went more than a box past the wall stops on it
+        for (int c = 0; c < 3; c++)
+        {
+            if (pos[c] > box || pos[c] < -box)
+            {
+                pos[c] = (pos[c] > 0 ? 2 * box : -2 * box) - pos[c];
+                pos[c] = pos[c] > box ? box : pos[c] < -box ? -box : pos[c];
+                vel[c] = -vel[c];
+            }
+        }
+    }
+    else if (mode == BD_RECYCLE)
+    {
+        if (pos[0] > box || pos[0] < -box || pos[1] > box || pos[1] < -box || pos[2] > box || pos[2] < -box ||
+            pos[0] != pos[0] || pos[1] != pos[1] || pos[2] != pos[2])
+        {
+            float u[4];
+            rng_uniform(i, 3, step, seed, u);
+            for (int c = 0; c < 3; c++)
+            {
+                pos[c] = emit[c] + (u[c] - 0.5f) * 0.01f;
+                vel[c] = 0;
+            }
+        }
+    }
+}
+
+#endif
@@ -4,18 +4,10 @@ using namespace std;
 
 cl_int ret;            // return value
 cl_uint uret;          // unsigned return value
-cl_mem memobj;         // memory object
-cl_kernel ker_init;    // initialize kernel
-cl_kernel ker_acc;     // accelerate kernel
-cl_kernel ker_move;    // move kernel
-cl_kernel ker_gen;     // generate kernel
-cl_kernel ker_zoomout; // zoom out kernel
-cl_kernel ker_zoomin;  // zoom in kernel
 cl_program program;
 cl_command_queue command_queue;
 cl_context context;
 
-size_t global_item_size;
 size_t local_item_size = 250;
 cl_platform_id platform_id;
 cl_device_id device_id;
@@ -164,76 +156,77 @@ static void init_particles()
     try
     {
         // Create kernels with error checking
-        ker_acc = clCreateKernel(program, "accelerate", &ret);
+        sim.ker_acc = clCreateKernel(program, "accelerate", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create accelerate kernel");
 
-        ker_move = clCreateKernel(program, "move", &ret);
+        sim.ker_move = clCreateKernel(program, "move", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create move kernel");
 
-        ker_gen = clCreateKernel(program, "gen", &ret);
+        sim.ker_gen = clCreateKernel(program, "gen", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create gen kernel");
 
-        ker_zoomout = clCreateKernel(program, "zoomout", &ret);
+        sim.ker_zoomout = clCreateKernel(program, "zoomout", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create zoomout kernel");
 
-        ker_zoomin = clCreateKernel(program, "zoomin", &ret);
+        sim.ker_zoomin = clCreateKernel(program, "zoomin", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create zoomin kernel");
 
-        if (circle)
-            ker_init = clCreateKernel(program, "init2", &ret);
-        else
-            ker_init = clCreateKernel(program, "init", &ret);
+        sim.ker_init = clCreateKernel(program, "init", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create init kernel");
 
         // Set kernel arguments with error checking
-        ret = clSetKernelArg(ker_acc, 0, sizeof(cl_mem), &memobj);
+        ret = clSetKernelArg(sim.ker_acc, 0, sizeof(cl_mem), &sim.particles);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to set accelerate kernel arg");
 
-        ret = clSetKernelArg(ker_move, 0, sizeof(cl_mem), &memobj);
+        ret = clSetKernelArg(sim.ker_move, 0, sizeof(cl_mem), &sim.particles);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to set move kernel arg");
 
-        ret = clSetKernelArg(ker_gen, 0, sizeof(cl_mem), &memobj);
+        ret = clSetKernelArg(sim.ker_gen, 0, sizeof(cl_mem), &sim.particles);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to set gen kernel arg");
 
-        ret = clSetKernelArg(ker_zoomout, 0, sizeof(cl_mem), &memobj);
+        ret = clSetKernelArg(sim.ker_zoomout, 0, sizeof(cl_mem), &sim.particles);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to set zoomout kernel arg");
 
-        ret = clSetKernelArg(ker_zoomin, 0, sizeof(cl_mem), &memobj);
+        ret = clSetKernelArg(sim.ker_zoomin, 0, sizeof(cl_mem), &sim.particles);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to set zoomin kernel arg");
 
-        ret = clSetKernelArg(ker_init, 0, sizeof(cl_mem), &memobj);
+        cl_int shape = opts.shape;
+        cl_ulong seed = opts.seed;
+        ret = clSetKernelArg(sim.ker_init, 0, sizeof(cl_mem), &sim.particles);
+        ret |= clSetKernelArg(sim.ker_init, 1, sizeof(cl_int), &shape);
+        ret |= clSetKernelArg(sim.ker_init, 2, sizeof(cl_ulong), &seed);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to set init kernel arg");
 
         // Print debug info
-        cout << YELLO << "Memory object handle: " << memobj << endl;
+        cout << YELLO << "Memory object handle: " << sim.particles << endl;
         cout << YELLO << "Program handle: " << program << endl;
         cout << YELLO << "Command queue handle: " << command_queue << endl;
 
         // Acquire GL objects before using them
-        ret = clEnqueueAcquireGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
+        ret = clEnqueueAcquireGLObjects(command_queue, 1, &sim.particles, 0, NULL, NULL);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to acquire GL objects");
 
         // Initialize particles
-        ret = clEnqueueNDRangeKernel(command_queue, ker_init, 1, NULL, &global_item_size, &local_item_size, 0, NULL,
+        ret = clEnqueueNDRangeKernel(command_queue, sim.ker_init, 1, NULL, &sim.global, &local_item_size, 0, NULL,
                                      NULL);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to enqueue init kernel");
 
         // Release GL objects after using them
-        ret = clEnqueueReleaseGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
+        ret = clEnqueueReleaseGLObjects(command_queue, 1, &sim.particles, 0, NULL, NULL);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to release GL objects");
 
@@ -251,32 +244,106 @@ static void init_particles()
 
 void clReset()
 {
-    ret = clEnqueueAcquireGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
+    TraceScope scope("reset");
+    clacquire("reset");
+    ret = clSetKernelArg(sim.ker_init, 0, sizeof(cl_mem), (void *)&sim.particles);
+    ret = clEnqueueNDRangeKernel(command_queue, sim.ker_init, 1, NULL, &sim.global, &local_item_size, 0, NULL,
+                                 traceev("init"));
+    clrelease("reset");
+
+    clFinish(command_queue);
+
+    sim.mouse.z = 0;
+    g_bufs.trans[12] = 0;
+    g_bufs.trans[14] = -1.5;
+}
+
+// Hand the shared buffer to OpenCL, a no-op when the buffer is not shared with GL
+void clacquire(const char *where)
+{
+    if (!glshared())
+        return;
+    ret = clEnqueueAcquireGLObjects(command_queue, 1, &sim.particles, 0, NULL, traceev("acquire GL"));
     if (ret != CL_SUCCESS)
     {
-        cout << RED << "Failed to acquire GL objects in reset: " << ret << endl;
+        cout << RED << "Failed to acquire GL objects in " << where << ": " << ret << endl;
         exit(1);
     }
+}
 
-    ret = clSetKernelArg(ker_init, 0, sizeof(cl_mem), (void *)&memobj);
-    ret = clEnqueueNDRangeKernel(command_queue, ker_init, 1, NULL, &global_item_size, &local_item_size, 0, NULL, NULL);
-
-    ret = clEnqueueReleaseGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
+// Hand the shared buffer back to OpenGL
+void clrelease(const char *where)
+{
+    if (!glshared())
+        return;
+    ret = clEnqueueReleaseGLObjects(command_queue, 1, &sim.particles, 0, NULL, traceev("release GL"));
     if (ret != CL_SUCCESS)
     {
-        cout << RED << "Failed to release GL objects in reset: " << ret << endl;
+        cout << RED << "Failed to release GL objects in " << where << ": " << ret << endl;
         exit(1);
     }
+}
 
-    clFinish(command_queue);
+// Context without GL sharing for headless runs, any platform and device will do
+static void getheadlesscontext()
+{
+    cl_uint num_platforms = 0;
+    cl_int ret = clGetPlatformIDs(0, nullptr, &num_platforms);
+    if (ret != CL_SUCCESS || num_platforms == 0)
+    {
+        cout << RED << "Failed to get OpenCL platforms" << endl;
+        exit(1);
+    }
+    std::vector<cl_platform_id> platforms(num_platforms);
+    clGetPlatformIDs(num_platforms, platforms.data(), nullptr);
 
-    mouse.z = 0;
-    g_bufs.trans[12] = 0;
-    g_bufs.trans[14] = -1.5;
+    // Prefer a GPU, fall back to whatever the first platform offers. The ranks of a --ranks
+    // run take turns over the devices of the platform.
+    bool found = false;
+    for (cl_device_type type : {(cl_device_type)CL_DEVICE_TYPE_GPU, (cl_device_type)CL_DEVICE_TYPE_ALL})
+    {
+        for (const auto &platform : platforms)
+        {
+            cl_uint count = 0;
+            if (clGetDeviceIDs(platform, type, 0, nullptr, &count) == CL_SUCCESS && count)
+            {
+                std::vector<cl_device_id> devices(count);
+                clGetDeviceIDs(platform, type, count, devices.data(), nullptr);
+                device_id = devices[opts.rank % count];
+                platform_id = platform;
+                found = true;
+                break;
+            }
+        }
+        if (found)
+            break;
+    }
+    if (!found)
+    {
+        cout << RED << "No OpenCL device found" << endl;
+        exit(1);
+    }
+
+    char name[256];
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(name), name, nullptr);
+    cout << YELLO << "OpenCL Device: " << name << endl;
+
+    cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platform_id, 0};
+    context = clCreateContext(properties, 1, &device_id, nullptr, nullptr, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create OpenCL context" << endl;
+        exit(1);
+    }
 }
 
 void getcontext()
 {
+    if (opts.headless)
+    {
+        getheadlesscontext();
+        return;
+    }
     try
     {
         // Load required libraries
@@ -334,23 +401,26 @@ void getcontext()
             exit(1);
         }
 
-        // Get OpenGL context and display
-        Display *display = glXGetCurrentDisplay();
-        GLXContext glxContext = glXGetCurrentContext();
-        if (!display || !glxContext)
+        // Get OpenGL context and display, from EGL when rendering offscreen
+        cl_context_properties glcontext = (cl_context_properties)glXGetCurrentContext();
+        cl_context_properties displaykind = CL_GLX_DISPLAY_KHR;
+        cl_context_properties display = (cl_context_properties)glXGetCurrentDisplay();
+        if (opts.offscreen)
+        {
+            glcontext = (cl_context_properties)eglcontext;
+            displaykind = CL_EGL_DISPLAY_KHR;
+            display = (cl_context_properties)egldisplay;
+        }
+        if (!display || !glcontext)
         {
             cout << RED << "No valid OpenGL context or display found" << endl;
             exit(1);
         }
 
         // Create OpenCL context with GL interop
-        cl_context_properties properties[] = {CL_GL_CONTEXT_KHR,
-                                              (cl_context_properties)glxContext,
-                                              CL_GLX_DISPLAY_KHR,
-                                              (cl_context_properties)display,
-                                              CL_CONTEXT_PLATFORM,
-                                              (cl_context_properties)platform_id,
-                                              0};
+        cl_context_properties properties[] = {
+            CL_GL_CONTEXT_KHR, glcontext, displaykind, display, CL_CONTEXT_PLATFORM, (cl_context_properties)platform_id,
+            0};
 
         context = clCreateContext(properties, 1, &device_id, nullptr, nullptr, &ret);
         if (ret != CL_SUCCESS)
@@ -366,34 +436,21 @@ void getcontext()
     }
 }
 
-void clinit()
+// Command queue and program, shared by every simulation on the device
+void clprogram()
 {
-    char buf[20];
-
-    global_item_size = N;
-
     // Create command queue
-    command_queue = clCreateCommandQueueWithProperties(context, device_id, nullptr, &ret);
+    command_queue = clCreateCommandQueueWithProperties(context, device_id, traceprops(), &ret);
     if (ret != CL_SUCCESS)
     {
         cout << RED << "Failed to create command queue: " << ret << endl;
         exit(1);
     }
+    tracequeue(command_queue, "kernels");
 
-    // Ensure GL is done
-    glFinish();
-    glFlush();
-
-    // Create shared buffer
-    memobj = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, g_bufs.vbo, &ret);
-    if (ret != CL_SUCCESS)
-    {
-        cout << RED << "Failed to create shared buffer: " << ret << endl;
-        exit(1);
-    }
-
-    // Create and build program
-    std::string kernel_source = filetostr("kernel.cl");
+    // Create and build program, the headers shared with the host go in front of the kernels
+    std::string kernel_source =
+        filetostr("rng.h") + filetostr("bounds.h") + filetostr("drift.h") + filetostr("kernel.cl");
     const char *kernel_str = kernel_source.c_str();
     size_t kernel_size = kernel_source.length();
 
@@ -414,61 +471,99 @@ void clinit()
         cout << RED << "Build error: " << build_log.data() << endl;
         exit(1);
     }
+}
+
+void clprogramend()
+{
+    paramsend();
+    ret = clReleaseProgram(program);
+    ret = clReleaseCommandQueue(command_queue);
+    ret = clReleaseContext(context);
+}
+
+void clinit()
+{
+    char buf[20];
+
+    sim.global = sim.n;
+    clprogram();
+
+    if (!glshared())
+    {
+        // Plain device buffer, zeroed so that every byte of the state is defined
+        std::vector<Particle> zeros(sim.n);
+        sim.particles = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sim.n * sizeof(Particle),
+                                       zeros.data(), &ret);
+    }
+    else
+    {
+        // Ensure GL is done
+        glFinish();
+        glFlush();
+
+        // Create shared buffer
+        sim.particles = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, g_bufs.vbo, &ret);
+    }
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create shared buffer: " << ret << endl;
+        exit(1);
+    }
 
     // Initialize particles before creating kernels
     try
     {
         // Create kernels
-        ker_acc = clCreateKernel(program, "accelerate", &ret);
+        sim.ker_acc = clCreateKernel(program, "accelerate", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create accelerate kernel");
 
-        ker_move = clCreateKernel(program, "move", &ret);
+        sim.ker_move = clCreateKernel(program, "move", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create move kernel");
 
-        ker_gen = clCreateKernel(program, "gen", &ret);
+        sim.ker_gen = clCreateKernel(program, "gen", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create gen kernel");
 
-        ker_zoomout = clCreateKernel(program, "zoomout", &ret);
+        sim.ker_zoomout = clCreateKernel(program, "zoomout", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create zoomout kernel");
 
-        ker_zoomin = clCreateKernel(program, "zoomin", &ret);
+        sim.ker_zoomin = clCreateKernel(program, "zoomin", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create zoomin kernel");
 
-        if (circle)
-            ker_init = clCreateKernel(program, "init2", &ret);
-        else
-            ker_init = clCreateKernel(program, "init", &ret);
+        sim.ker_init = clCreateKernel(program, "init", &ret);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to create init kernel");
 
         // Set kernel arguments
-        ret = clSetKernelArg(ker_acc, 0, sizeof(cl_mem), &memobj);
-        ret |= clSetKernelArg(ker_move, 0, sizeof(cl_mem), &memobj);
-        ret |= clSetKernelArg(ker_gen, 0, sizeof(cl_mem), &memobj);
-        ret |= clSetKernelArg(ker_zoomout, 0, sizeof(cl_mem), &memobj);
-        ret |= clSetKernelArg(ker_zoomin, 0, sizeof(cl_mem), &memobj);
-        ret |= clSetKernelArg(ker_init, 0, sizeof(cl_mem), &memobj);
+        ret = clSetKernelArg(sim.ker_acc, 0, sizeof(cl_mem), &sim.particles);
+        ret |= clSetKernelArg(sim.ker_move, 0, sizeof(cl_mem), &sim.particles);
+        ret |= clSetKernelArg(sim.ker_gen, 0, sizeof(cl_mem), &sim.particles);
+        ret |= clSetKernelArg(sim.ker_zoomout, 0, sizeof(cl_mem), &sim.particles);
+        ret |= clSetKernelArg(sim.ker_zoomin, 0, sizeof(cl_mem), &sim.particles);
+        cl_mem params = paramsbuffer();
+        ret |= clSetKernelArg(sim.ker_acc, 5, sizeof(cl_mem), &params);
+        ret |= clSetKernelArg(sim.ker_move, 5, sizeof(cl_mem), &params);
+        ret |= clSetKernelArg(sim.ker_zoomout, 1, sizeof(cl_mem), &params);
+        ret |= clSetKernelArg(sim.ker_zoomin, 1, sizeof(cl_mem), &params);
+        cl_int shape = opts.shape;
+        cl_ulong seed = opts.seed;
+        ret |= clSetKernelArg(sim.ker_init, 0, sizeof(cl_mem), &sim.particles);
+        ret |= clSetKernelArg(sim.ker_init, 1, sizeof(cl_int), &shape);
+        ret |= clSetKernelArg(sim.ker_init, 2, sizeof(cl_ulong), &seed);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to set kernel arguments");
 
         // Initialize particles
-        ret = clEnqueueAcquireGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
-        if (ret != CL_SUCCESS)
-            throw std::runtime_error("Failed to acquire GL objects");
-
-        ret = clEnqueueNDRangeKernel(command_queue, ker_init, 1, NULL, &global_item_size, &local_item_size, 0, NULL,
+        clacquire("clinit");
+        ret = clEnqueueNDRangeKernel(command_queue, sim.ker_init, 1, NULL, &sim.global, &local_item_size, 0, NULL,
                                      NULL);
         if (ret != CL_SUCCESS)
             throw std::runtime_error("Failed to execute init kernel");
-
-        ret = clEnqueueReleaseGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
-        if (ret != CL_SUCCESS)
-            throw std::runtime_error("Failed to release GL objects");
+        clrelease("clinit");
 
         ret = clFinish(command_queue);
         if (ret != CL_SUCCESS)
@@ -484,21 +579,20 @@ void clinit()
 void clend()
 {
     ret = clFlush(command_queue);
-    ret = clEnqueueAcquireGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
-    ret = clEnqueueReleaseGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
+    clacquire("clend");
+    clrelease("clend");
     clFinish(command_queue);
 
-    ret = clReleaseKernel(ker_init);
-    ret = clReleaseKernel(ker_acc);
-    ret = clReleaseKernel(ker_move);
-    ret = clReleaseKernel(ker_gen);
-    ret = clReleaseKernel(ker_zoomout);
-    ret = clReleaseKernel(ker_zoomin);
+    attrend();
+    ret = clReleaseKernel(sim.ker_init);
+    ret = clReleaseKernel(sim.ker_acc);
+    ret = clReleaseKernel(sim.ker_move);
+    ret = clReleaseKernel(sim.ker_gen);
+    ret = clReleaseKernel(sim.ker_zoomout);
+    ret = clReleaseKernel(sim.ker_zoomin);
 
-    ret = clReleaseProgram(program);
-    ret = clReleaseMemObject(memobj);
-    ret = clReleaseCommandQueue(command_queue);
-    ret = clReleaseContext(context);
+    ret = clReleaseMemObject(sim.particles);
+    clprogramend();
 }
 
 std::string getOpenCLErrorString(cl_int error)
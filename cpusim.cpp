@@ -0,0 +1,250 @@
+#include "particle.hpp"
+using namespace std;
+
+static vector<Particle> cpustate; // particle state of the CPU backend
+
+// Port of init, the distributions come from rng.h like on the device
+static void cpuinitone(Particle &p, int i)
+{
+    rng_initpos(opts.shape, i, opts.seed, p.pos);
+    p.pos[3] = 0;
+    p.vel[0] = p.vel[1] = p.vel[2] = p.vel[3] = 0;
+}
+
+void cpuinit()
+{
+    cpustate.resize(sim.n);
+    parallel(sim.n, [](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            cpuinitone(cpustate[i], i);
+    });
+}
+
+// Port of gen
+static void cpugen(Particle &p, int i, const Mass &m)
+{
+    if (i >= m.nPart && i < m.nPart + 100)
+    {
+        float u[4];
+        rng_uniform(i, 2, nstep, opts.seed, u);
+        p.pos[0] = m.x + (u[0] - 0.5f) * 0.01f;
+        p.pos[1] = m.y + (u[1] - 0.5f) * 0.01f;
+        p.pos[2] = m.z + (u[2] - 0.5f) * 0.01f;
+        p.pos[3] = 0;
+    }
+}
+
+// Port of boundary
+static void cpubound(Particle &p, int i, const Mass &m)
+{
+    const float emit[3] = {m.x, m.y, m.z};
+    const float old[3] = {p.pos[0], p.pos[1], p.pos[2]};
+    bd_apply(m.boundary, m.box, p.pos, p.vel, i, nstep, opts.seed, emit);
+    if (p.pos[0] != old[0] || p.pos[1] != old[1] || p.pos[2] != old[2])
+        p.pos[3] = 0;
+}
+
+// Port of drift
+static void cpudrift(Particle &p, float dt)
+{
+    rng_u32 w;
+    memcpy(&w, &p.pos[3], sizeof(w));
+    for (int c = 0; c < 3; c++)
+        p.pos[c] = dr_drift(p.pos[c], dt * p.vel[c], &w, c);
+    memcpy(&p.pos[3], &w, sizeof(w));
+}
+
+// Port of attraction, returns the squared distance to the closest attractor
+static float cpuattraction(const Particle &p, const Mass &m, float *acc)
+{
+    float dx = bd_image(m.boundary, m.box, m.x - p.pos[0]);
+    float dy = bd_image(m.boundary, m.box, m.y - p.pos[1]);
+    float dz = bd_image(m.boundary, m.box, m.z - p.pos[2]);
+    float r2 = dx * dx + dy * dy + dz * dz + 0.00001f;
+    float ir = 1.0f / sqrtf(r2);
+    float near = r2;
+    acc[0] = m.att * ir * dx;
+    acc[1] = m.att * ir * dy;
+    acc[2] = m.att * ir * dz;
+    for (const Attractor &a : sim.attractors)
+    {
+        dx = bd_image(m.boundary, m.box, a.pos[0] - p.pos[0]);
+        dy = bd_image(m.boundary, m.box, a.pos[1] - p.pos[1]);
+        dz = bd_image(m.boundary, m.box, a.pos[2] - p.pos[2]);
+        r2 = dx * dx + dy * dy + dz * dz + 0.00001f;
+        float f = m.att * a.strength / sqrtf(r2) * powf(r2, -0.5f * a.falloff);
+        acc[0] += f * dx;
+        acc[1] += f * dy;
+        acc[2] += f * dz;
+        near = min(near, r2);
+    }
+    return near;
+}
+
+// Port of accelerate
+static void cpuaccelerate(Particle &p, const Mass &m)
+{
+    float a[3];
+    cpuattraction(p, m, a);
+    p.vel[0] += sim.params.dt * a[0];
+    p.vel[1] += sim.params.dt * a[1];
+    p.vel[2] += sim.params.dt * a[2];
+}
+
+// Block timesteps for one particle: the class from classify, then its 2^class substeps.
+// Particles do not interact here, so each one can run its substeps back to back.
+static void cpublock(Particle &p, int i, const Mass &m)
+{
+    float a[3];
+    float r = sqrtf(cpuattraction(p, m, a));
+    float amag = sqrtf(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+    float v = sqrtf(p.vel[0] * p.vel[0] + p.vel[1] * p.vel[1] + p.vel[2] * p.vel[2]);
+    float dt = 0.25f * min(sqrtf(r / max(amag, 1e-12f)), r / max(v, 1e-12f));
+    int k = min(max((int)ceilf(log2f(sim.params.dt / dt)), 0), opts.blocklevels);
+    dt = sim.params.dt / (1 << k);
+    for (int s = 0; s < 1 << k; s++)
+    {
+        if (s)
+            cpuattraction(p, m, a);
+        for (int c = 0; c < 3; c++)
+            p.vel[c] += dt * a[c];
+        if (opts.mixed)
+            cpudrift(p, dt);
+        else
+            for (int c = 0; c < 3; c++)
+                p.pos[c] += dt * p.vel[c];
+        if (m.boundary)
+            cpubound(p, i, m);
+    }
+}
+
+// Port of move
+static void cpumove(Particle &p, int i, const Mass &m)
+{
+    if (opts.mixed)
+        cpudrift(p, sim.params.dt);
+    else
+    {
+        p.pos[0] += sim.params.dt * p.vel[0];
+        p.pos[1] += sim.params.dt * p.vel[1];
+        p.pos[2] += sim.params.dt * p.vel[2];
+    }
+    if (m.boundary)
+        cpubound(p, i, m);
+}
+
+// gen, accelerate and move in one pass. The new state is also streamed into out when given,
+// which is how the positions reach a mapped GL buffer without a separate copy. SPH needs
+// every velocity before any particle moves, so it splits the pass in two.
+void cpustep(Particle *out)
+{
+    const Mass m = sim.mouse;
+    const bool gen = newParticles, acc = !explode, fused = !opts.sph;
+    parallel(sim.n, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            Particle &p = cpustate[i];
+            if (gen)
+                cpugen(p, i, m);
+            if (acc && opts.blocklevels)
+                cpublock(p, i, m);
+            else if (acc)
+                cpuaccelerate(p, m);
+            if (!fused)
+                continue;
+            if (!acc || !opts.blocklevels)
+                cpumove(p, i, m);
+            if (out)
+                out[i] = p;
+        }
+    });
+    if (fused)
+        return;
+
+    sphcpu(cpustate.data());
+    parallel(sim.n, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            cpumove(cpustate[i], i, m);
+            if (out)
+                out[i] = cpustate[i];
+        }
+    });
+}
+
+// Port of zoomout and zoomin, with the factors the kernels read
+void cpuzoom(bool out)
+{
+    float f = out ? sim.params.zoomout : sim.params.zoomin;
+    parallel(sim.n, [f](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                cpustate[i].pos[c] *= f;
+                cpustate[i].vel[c] *= f;
+            }
+            cpustate[i].pos[3] = 0;
+        }
+    });
+}
+
+// Port of stats. The 16-byte rows load as four-wide vectors, and every thread reduces its
+// range into its own partial before the partials are merged.
+void cpustats(Stats &s)
+{
+    typedef float v4 __attribute__((vector_size(16)));
+    size_t nthreads = parallelthreads();
+    vector<Stats> partial(nthreads);
+    parallel(sim.n, [&](size_t t, size_t begin, size_t end) {
+        v4 lo = {INFINITY, INFINITY, INFINITY, INFINITY}, hi = -lo, sum = {0, 0, 0, 0};
+        float vmax = 0;
+        for (size_t i = begin; i < end; i++)
+        {
+            v4 p = *(const v4 *)cpustate[i].pos, v = *(const v4 *)cpustate[i].vel;
+            v = v * v;
+            p[3] = 0;
+            lo = p < lo ? p : lo;
+            hi = p > hi ? p : hi;
+            p[3] = v[0] + v[1] + v[2];
+            sum += p;
+            vmax = max(vmax, p[3]);
+        }
+        memcpy(partial[t].lo, &lo, sizeof(lo));
+        memcpy(partial[t].hi, &hi, sizeof(hi));
+        memcpy(partial[t].sum, &sum, sizeof(sum));
+        partial[t].vmax[0] = vmax;
+    });
+    s = partial[0];
+    for (size_t t = 1; t < nthreads; t++)
+        for (int c = 0; c < 4; c++)
+        {
+            s.lo[c] = min(s.lo[c], partial[t].lo[c]);
+            s.hi[c] = max(s.hi[c], partial[t].hi[c]);
+            s.sum[c] += partial[t].sum[c];
+            s.vmax[c] = max(s.vmax[c], partial[t].vmax[c]);
+        }
+}
+
+void cpuread(Particle *dst)
+{
+    memcpy(dst, cpustate.data(), sim.n * sizeof(Particle));
+}
+
+Particle *cpudata()
+{
+    return cpustate.data();
+}
+
+// Take over another set of particles, sim.n follows
+void cpuassign(vector<Particle> &&ps)
+{
+    cpustate = move(ps);
+}
+
+// Keep the first n particles, or add room after them, sim.n follows
+Particle *cpuresize(size_t n)
+{
+    cpustate.resize(n);
+    return cpustate.data();
+}
@@ -0,0 +1,131 @@
+#include "particle.hpp"
+using namespace std;
+
+static const size_t CULL_LOCAL = 256; // work-group size of the count and write passes
+static const size_t SCAN_LOCAL = 256; // work-group size of the single-group scan
+
+static cl_kernel ker_count, ker_scan, ker_write;
+static GLuint ebo;                 // indices of the visible particles
+static GLuint dib;                 // DrawElementsIndirectCommand of the visible list
+static cl_mem list, args;          // the two GL buffers, shared with OpenCL
+static cl_mem groupcount;          // visible particles per work group
+static cl_mem groupstart;          // where each work group's indices start in the list
+static size_t global;              // particles padded to whole work groups
+
+static cl_kernel cullkernel(const char *name)
+{
+    cl_kernel k = clCreateKernel(program, name, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create " << name << " kernel: " << ret << endl;
+        exit(1);
+    }
+    return k;
+}
+
+static cl_mem cullshare(GLuint buffer)
+{
+    cl_mem mem = clCreateFromGLBuffer(context, CL_MEM_WRITE_ONLY, buffer, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to share a cull buffer: " << ret << endl;
+        exit(1);
+    }
+    return mem;
+}
+
+// The index and draw-argument buffers live in GL and are written by OpenCL, the draw reads
+// its count from the device so the host never learns how many particles are in view
+void cullinit()
+{
+    if (!GLEW_VERSION_4_0 && !GLEW_ARB_draw_indirect)
+    {
+        cout << RED << "--cull needs indirect drawing (OpenGL 4.0 or ARB_draw_indirect)" << endl;
+        exit(1);
+    }
+    cl_int np = sim.n, ngroup = (sim.n + CULL_LOCAL - 1) / CULL_LOCAL;
+    global = ngroup * CULL_LOCAL;
+
+    // count, instance count, first index, base vertex, base instance
+    GLuint command[5] = {0, 1, 0, 0, 0};
+    glBindVertexArray(g_bufs.vao);
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sim.n * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glGenBuffers(1, &dib);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, dib);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(command), command, GL_DYNAMIC_DRAW);
+    glFinish();
+    list = cullshare(ebo);
+    args = cullshare(dib);
+
+    groupcount = clCreateBuffer(context, CL_MEM_READ_WRITE, ngroup * sizeof(int), NULL, &ret);
+    groupstart = clCreateBuffer(context, CL_MEM_READ_WRITE, ngroup * sizeof(int), NULL, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create cull buffers: " << ret << endl;
+        exit(1);
+    }
+
+    ker_count = cullkernel("cullcount");
+    ker_scan = cullkernel("cullscan");
+    ker_write = cullkernel("cullwrite");
+
+    clSetKernelArg(ker_count, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_count, 1, sizeof(cl_int), &np);
+    clSetKernelArg(ker_count, 3, sizeof(cl_mem), &groupcount);
+
+    clSetKernelArg(ker_scan, 0, sizeof(cl_mem), &groupcount);
+    clSetKernelArg(ker_scan, 1, sizeof(cl_mem), &groupstart);
+    clSetKernelArg(ker_scan, 2, sizeof(cl_int), &ngroup);
+    clSetKernelArg(ker_scan, 3, sizeof(cl_mem), &args);
+    clSetKernelArg(ker_scan, 4, SCAN_LOCAL * sizeof(int), NULL);
+
+    clSetKernelArg(ker_write, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_write, 1, sizeof(cl_int), &np);
+    clSetKernelArg(ker_write, 3, sizeof(cl_mem), &groupstart);
+    clSetKernelArg(ker_write, 4, sizeof(cl_mem), &list);
+    clSetKernelArg(ker_write, 5, CULL_LOCAL * sizeof(int), NULL);
+}
+
+// List the particles in view of mat, the matrix render() draws with, and draw them as points
+void culldraw(const float *mat)
+{
+    TraceScope scope("cull");
+    size_t local = CULL_LOCAL, scan = SCAN_LOCAL;
+    cl_float16 m;
+    memcpy(&m, mat, sizeof(m));
+    clSetKernelArg(ker_count, 2, sizeof(cl_float16), &m);
+    clSetKernelArg(ker_write, 2, sizeof(cl_float16), &m);
+
+    cl_mem shared[2] = {list, args};
+    glFinish();
+    ret = clEnqueueAcquireGLObjects(command_queue, 2, shared, 0, NULL, NULL);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to acquire the cull buffers: " << ret << endl;
+        exit(1);
+    }
+    clacquire("cull");
+    clEnqueueNDRangeKernel(command_queue, ker_count, 1, NULL, &global, &local, 0, NULL, traceev("cullcount"));
+    clEnqueueNDRangeKernel(command_queue, ker_scan, 1, NULL, &scan, &scan, 0, NULL, traceev("cullscan"));
+    clEnqueueNDRangeKernel(command_queue, ker_write, 1, NULL, &global, &local, 0, NULL, traceev("cullwrite"));
+    clrelease("cull");
+    clEnqueueReleaseGLObjects(command_queue, 2, shared, 0, NULL, NULL);
+    clFinish(command_queue);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, dib);
+    glDrawElementsIndirect(GL_POINTS, GL_UNSIGNED_INT, 0);
+}
+
+void cullend()
+{
+    clReleaseKernel(ker_count);
+    clReleaseKernel(ker_scan);
+    clReleaseKernel(ker_write);
+    for (cl_mem mem : {list, args, groupcount, groupstart})
+        clReleaseMemObject(mem);
+    glDeleteBuffers(1, &ebo);
+    glDeleteBuffers(1, &dib);
+}
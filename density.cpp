@@ -0,0 +1,105 @@
+#include "particle.hpp"
+using namespace std;
+
+static GLuint accum;   // particles drawn into the density texture
+static GLuint tonemap; // full-screen pass from density to colour
+static GLuint fbo;     // framebuffer around the density texture
+static GLuint tex;     // RG32F: particle count, summed distance to the mouse
+static GLuint empty;   // vertex array for the attribute-less full-screen triangle
+
+// Uniform locations
+static GLint amat, amx, amy, aweight, ascale, aoffset, thsv, tbl, texp, tdensity;
+
+void densityinit()
+{
+    accum = getprogram("particle.vs", "density.fs");
+    tonemap = getprogram("tonemap.vs", "tonemap.fs");
+    amat = glGetUniformLocation(accum, "p");
+    amx = glGetUniformLocation(accum, "mx");
+    amy = glGetUniformLocation(accum, "my");
+    aweight = glGetUniformLocation(accum, "weight");
+    ascale = glGetUniformLocation(accum, "scale");
+    aoffset = glGetUniformLocation(accum, "offset");
+    thsv = glGetUniformLocation(tonemap, "hsv");
+    tbl = glGetUniformLocation(tonemap, "bl");
+    texp = glGetUniformLocation(tonemap, "exposure");
+    tdensity = glGetUniformLocation(tonemap, "density");
+
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, W, H, 0, GL_RG, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    GLint previous;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << RED << "Density framebuffer is incomplete" << endl;
+        exit(1);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, previous);
+    glGenVertexArrays(1, &empty);
+}
+
+// Accumulate the particles into the density texture, then tone map it into the current framebuffer
+void densityrender(const float *mat)
+{
+    GLint target;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glClearColor(0, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glUseProgram(accum);
+    glUniformMatrix4fv(amat, 1, GL_FALSE, mat);
+    glUniform1f(amx, sim.mouse.x);
+    glUniform1f(amy, sim.mouse.y);
+    quantuniforms(ascale, aoffset);
+    glBindVertexArray(g_bufs.vao);
+    if (opts.lod)
+    {
+        int k = lodcount();
+        glUniform1f(aweight, (float)sim.n / k);
+        loddraw(k, false);
+    }
+    else
+    {
+        glUniform1f(aweight, 1.0f);
+        glDrawArrays(GL_POINTS, 0, sim.n);
+    }
+    glDisable(GL_BLEND);
+
+    // The particles are drawn with GL_POINT polygon mode, the full-screen triangle must be filled
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glUseProgram(tonemap);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glUniform1i(tdensity, 0);
+    glUniform3f(thsv, hsv[0], hsv[1], hsv[2]);
+    glUniform1f(tbl, g_bufs.bl);
+    glUniform1f(texp, opts.exposure);
+    glBindVertexArray(empty);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
+
+    // Leave the particle program current for the default path
+    glUseProgram(g_bufs.shaders);
+}
+
+void densityend()
+{
+    glDeleteProgram(accum);
+    glDeleteProgram(tonemap);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &tex);
+    glDeleteVertexArrays(1, &empty);
+}
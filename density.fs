@@ -0,0 +1,13 @@
+#version 400 core
+
+in float d;
+
+out vec4 Color;
+
+uniform float weight; // particles each drawn point stands for
+
+// Additively blended: red counts the particles on a pixel, green sums their distance to the mouse
+void main()
+{
+	Color = vec4(weight, weight * d, 0.0, 0.0);
+}
@@ -0,0 +1,516 @@
+#include "particle.hpp"
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace std;
+
+static const int BALANCE = 100;           // steps between moving the cuts to where the particles are
+static const size_t SAMPLES = 4096;       // positions per rank the cuts are placed from
+static const size_t RINGBYTES = 1 << 16;  // shared-memory channel size between two ranks
+
+// Moves bytes between the ranks of a --ranks run. exchange is collective: every rank calls it
+// the same number of times, sends out[r] to each rank r and returns once in[r] holds what r
+// sent back, so it also keeps the ranks in step. A transport only has to provide non-blocking
+// byte channels to every other rank.
+class Transport
+{
+  public:
+    virtual ~Transport() = default;
+    // Keep what this rank uses after the fork
+    virtual void attach()
+    {
+    }
+    void exchange(const vector<string> &out, vector<string> &in);
+
+  protected:
+    // Move what fits on the channel to or from rank r, returns the bytes moved
+    virtual size_t put(int r, const char *data, size_t bytes) = 0;
+    virtual size_t get(int r, char *data, size_t bytes) = 0;
+    // Nothing could move, give the other ranks a moment
+    virtual void idle() = 0;
+};
+
+// Channels in one shared anonymous mapping made before the fork, a single-producer ring for
+// every ordered pair of ranks
+class ShmTransport : public Transport
+{
+  public:
+    explicit ShmTransport(int n) : n(n)
+    {
+        size = (size_t)n * n * (sizeof(Ring) + RINGBYTES);
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            cout << RED << "Failed to map " << size << " bytes for the rank channels" << endl;
+            exit(1);
+        }
+        rings = (Ring *)p;
+        bytes = (char *)p + (size_t)n * n * sizeof(Ring);
+    }
+    ~ShmTransport()
+    {
+        munmap(rings, size);
+    }
+
+  protected:
+    size_t put(int r, const char *data, size_t k) override
+    {
+        Ring &q = rings[opts.rank * n + r];
+        char *buf = bytes + (opts.rank * n + r) * RINGBYTES;
+        uint64_t tail = q.tail.load(memory_order_relaxed);
+        k = min(k, RINGBYTES - (size_t)(tail - q.head.load(memory_order_acquire)));
+        size_t at = tail % RINGBYTES, first = min(k, RINGBYTES - at);
+        memcpy(buf + at, data, first);
+        memcpy(buf, data + first, k - first);
+        q.tail.store(tail + k, memory_order_release);
+        return k;
+    }
+
+    size_t get(int r, char *data, size_t k) override
+    {
+        Ring &q = rings[r * n + opts.rank];
+        const char *buf = bytes + (r * n + opts.rank) * RINGBYTES;
+        uint64_t head = q.head.load(memory_order_relaxed);
+        k = min(k, (size_t)(q.tail.load(memory_order_acquire) - head));
+        size_t at = head % RINGBYTES, first = min(k, RINGBYTES - at);
+        memcpy(data, buf + at, first);
+        memcpy(data + first, buf, k - first);
+        q.head.store(head + k, memory_order_release);
+        return k;
+    }
+
+    void idle() override;
+
+  private:
+    // Counters of a channel, the mapping starts zeroed so every channel starts empty
+    struct Ring
+    {
+        alignas(64) atomic<uint64_t> tail; // bytes written, by the sender
+        alignas(64) atomic<uint64_t> head; // bytes read, by the receiver
+    };
+    int n;
+    size_t size;
+    Ring *rings;
+    char *bytes;
+};
+
+// Channels over Unix socket pairs made before the fork. The stream is the same as over shared
+// memory, so TCP connections between nodes can take their place.
+class SocketTransport : public Transport
+{
+  public:
+    explicit SocketTransport(int n) : fds(n, vector<int>(n, -1))
+    {
+        for (int i = 0; i < n; i++)
+            for (int j = i + 1; j < n; j++)
+            {
+                int pair[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+                {
+                    cout << RED << "Failed to create the rank sockets" << endl;
+                    exit(1);
+                }
+                fds[i][j] = pair[0];
+                fds[j][i] = pair[1];
+            }
+    }
+    ~SocketTransport()
+    {
+        for (auto &row : fds)
+            for (int fd : row)
+                if (fd >= 0)
+                    close(fd);
+    }
+
+    void attach() override
+    {
+        for (size_t i = 0; i < fds.size(); i++)
+            for (size_t j = 0; j < fds.size(); j++)
+                if (i != (size_t)opts.rank && fds[i][j] >= 0)
+                {
+                    close(fds[i][j]);
+                    fds[i][j] = -1;
+                }
+    }
+
+  protected:
+    size_t put(int r, const char *data, size_t k) override
+    {
+        ssize_t sent = send(fds[opts.rank][r], data, k, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            gone(r);
+        return sent < 0 ? 0 : sent;
+    }
+
+    size_t get(int r, char *data, size_t k) override
+    {
+        ssize_t got = recv(fds[opts.rank][r], data, k, MSG_DONTWAIT);
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            gone(r);
+        return got < 0 ? 0 : got;
+    }
+
+    void idle() override
+    {
+        vector<pollfd> wait;
+        for (int fd : fds[opts.rank])
+            if (fd >= 0)
+                wait.push_back({fd, POLLIN, 0});
+        poll(wait.data(), wait.size(), 1);
+    }
+
+  private:
+    void gone(int r)
+    {
+        cout << RED << "Rank " << r << " has gone" << endl;
+        exit(1);
+    }
+
+    vector<vector<int>> fds; // fds[i][j] is rank i's end of the pair with rank j
+};
+
+static Transport *transport = nullptr; // channels to the other ranks
+static vector<pid_t> children;         // the other ranks, rank 0 only
+static vector<float> cuts;             // x where slab r ends and slab r + 1 begins
+static int total = 0;                  // particles over all ranks
+
+// Rank 0 notices a rank that failed, the others die with rank 0. A rank may finish its part
+// of the last exchange and exit before rank 0 is done with it.
+void ShmTransport::idle()
+{
+    int status;
+    pid_t pid = opts.rank ? 0 : waitpid(-1, &status, WNOHANG);
+    if (pid > 0 && WIFEXITED(status) && !WEXITSTATUS(status))
+        children.erase(find(children.begin(), children.end(), pid));
+    else if (pid > 0)
+    {
+        cout << RED << "A rank failed before the end of the run" << endl;
+        for (pid_t child : children)
+            kill(child, SIGTERM);
+        exit(1);
+    }
+    sched_yield();
+}
+
+// Every message goes out with its length in front, the channels interleave sending and
+// receiving so two ranks with a lot to trade cannot block each other
+void Transport::exchange(const vector<string> &out, vector<string> &in)
+{
+    int n = opts.ranks;
+    vector<string> send(n);
+    vector<size_t> sent(n, 0), want(n, sizeof(uint64_t));
+    vector<bool> sized(n, false);
+    int pending = 0;
+    in.assign(n, string());
+    for (int r = 0; r < n; r++)
+        if (r != opts.rank)
+        {
+            uint64_t len = out[r].size();
+            send[r].assign((const char *)&len, sizeof(len));
+            send[r] += out[r];
+            pending += 2;
+        }
+    in[opts.rank] = out[opts.rank];
+
+    char buf[1 << 16];
+    while (pending)
+    {
+        bool moved = false;
+        for (int r = 0; r < n; r++)
+        {
+            if (r == opts.rank)
+                continue;
+            if (sent[r] < send[r].size())
+            {
+                size_t k = put(r, send[r].data() + sent[r], send[r].size() - sent[r]);
+                sent[r] += k;
+                moved |= k > 0;
+                pending -= sent[r] == send[r].size();
+            }
+            if (in[r].size() < want[r])
+            {
+                // Never past this message, the next exchange may already be on the way
+                size_t k = get(r, buf, min(sizeof(buf), want[r] - in[r].size()));
+                in[r].append(buf, k);
+                moved |= k > 0;
+                if (!sized[r] && in[r].size() == sizeof(uint64_t))
+                {
+                    uint64_t len;
+                    memcpy(&len, in[r].data(), sizeof(len));
+                    want[r] += len;
+                    sized[r] = true;
+                }
+                if (sized[r] && in[r].size() == want[r])
+                {
+                    in[r].erase(0, sizeof(uint64_t));
+                    want[r] = 0;
+                    pending--;
+                }
+            }
+        }
+        if (!moved)
+            idle();
+    }
+}
+
+// Start the other ranks as copies of this process. They run headless like rank 0, which
+// alone records input and reports the run.
+void domainfork()
+{
+    if (opts.ranksockets)
+        transport = new SocketTransport(opts.ranks);
+    else
+        transport = new ShmTransport(opts.ranks);
+    total = sim.n;
+    cout.flush();
+    for (int r = 1; r < opts.ranks; r++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            cout << RED << "Failed to start rank " << r << endl;
+            exit(1);
+        }
+        if (pid == 0)
+        {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            opts.rank = r;
+            opts.record.clear();
+            if (!opts.trace.empty())
+                opts.trace += "." + to_string(r);
+            children.clear();
+            break;
+        }
+        children.push_back(pid);
+    }
+    transport->attach();
+}
+
+static int slab(float x)
+{
+    return upper_bound(cuts.begin(), cuts.end(), x) - cuts.begin();
+}
+
+// Evenly spaced x positions of n particles, each standing for its share of them
+static vector<pair<float, double>> sample(const Particle *ps, size_t n)
+{
+    size_t k = min(n, SAMPLES);
+    vector<pair<float, double>> xs(k);
+    for (size_t i = 0; i < k; i++)
+        xs[i] = {ps[i * n / k].pos[0], (double)n / k};
+    return xs;
+}
+
+// Cuts that split the weighted positions into equal shares
+static void placecuts(vector<pair<float, double>> &xs)
+{
+    sort(xs.begin(), xs.end());
+    double sum = 0, below = 0;
+    for (auto &x : xs)
+        sum += x.second;
+    cuts.assign(opts.ranks - 1, 0);
+    size_t i = 0;
+    for (int r = 1; r < opts.ranks; r++)
+    {
+        while (i + 1 < xs.size() && below + xs[i].second <= sum * r / opts.ranks)
+            below += xs[i++].second;
+        cuts[r - 1] = xs.empty() ? 0 : xs[i].first;
+    }
+}
+
+static Particle *hostdata()
+{
+    return opts.chunk ? oocdata() : cpudata();
+}
+
+static void hostassign(vector<Particle> &&ps)
+{
+    sim.n = ps.size();
+    if (opts.chunk)
+        oocassign(move(ps));
+    else
+        cpuassign(move(ps));
+}
+
+static Particle *hostresize(size_t n)
+{
+    sim.n = n;
+    return opts.chunk ? oocresize(n) : cpuresize(n);
+}
+
+// Place the cuts from a strided sample of the initial positions, the same on every rank, then
+// make only the particles of this rank's slab in one pass over the indices. Also how a reset
+// starts over.
+void domaininit()
+{
+    size_t k = min((size_t)total, SAMPLES * opts.ranks);
+    vector<pair<float, double>> xs(k);
+    for (size_t i = 0; i < k; i++)
+    {
+        float pos[4];
+        rng_initpos(opts.shape, i * total / k, opts.seed, pos);
+        xs[i] = {pos[0], (double)total / k};
+    }
+    placecuts(xs);
+
+    // Every thread keeps its range in index order, so the slab is in index order too
+    vector<vector<Particle>> part(parallelthreads());
+    parallel(total, [&](size_t t, size_t begin, size_t end) {
+        Particle p{};
+        for (size_t i = begin; i < end; i++)
+        {
+            rng_initpos(opts.shape, i, opts.seed, p.pos);
+            if (slab(p.pos[0]) == opts.rank)
+                part[t].push_back(p);
+        }
+    });
+    size_t n = 0;
+    for (auto &ps : part)
+        n += ps.size();
+    vector<Particle> mine = move(part[0]);
+    mine.reserve(n);
+    for (size_t t = 1; t < part.size(); t++)
+    {
+        mine.insert(mine.end(), part[t].begin(), part[t].end());
+        vector<Particle>().swap(part[t]);
+    }
+    hostassign(move(mine));
+    // Emission picks particles by index, only rank 0 keeps its emitting range within reach
+    if (opts.rank)
+        sim.mouse.nPart = INT_MIN / 2;
+    cout << YELLO << "Rank " << opts.rank << ": " << sim.n << " of " << total << " particles" << endl;
+}
+
+// Rank 0 takes the input for the run, the others apply its batch in place of theirs so every
+// rank sees the same events at the same step
+void domaininput(vector<Event> &batch)
+{
+    vector<string> out(opts.ranks), in;
+    if (!opts.rank)
+        for (int r = 1; r < opts.ranks; r++)
+            out[r].assign((const char *)batch.data(), batch.size() * sizeof(Event));
+    transport->exchange(out, in);
+    if (opts.rank)
+    {
+        batch.resize(in[0].size() / sizeof(Event));
+        memcpy(batch.data(), in[0].data(), in[0].size());
+    }
+}
+
+// Gather samples of every slab on rank 0 and hand out cuts that even the counts out again
+static void domainbalance()
+{
+    vector<pair<float, double>> xs = sample(hostdata(), sim.n);
+    vector<string> out(opts.ranks), in;
+    if (opts.rank)
+        out[0].assign((const char *)xs.data(), xs.size() * sizeof(xs[0]));
+    transport->exchange(out, in);
+
+    vector<string> placed(opts.ranks);
+    if (!opts.rank)
+    {
+        for (int r = 1; r < opts.ranks; r++)
+        {
+            const pair<float, double> *p = (const pair<float, double> *)in[r].data();
+            xs.insert(xs.end(), p, p + in[r].size() / sizeof(xs[0]));
+        }
+        placecuts(xs);
+        for (int r = 1; r < opts.ranks; r++)
+            placed[r].assign((const char *)cuts.data(), cuts.size() * sizeof(float));
+    }
+    transport->exchange(placed, in);
+    if (opts.rank)
+        memcpy(cuts.data(), in[0].data(), cuts.size() * sizeof(float));
+}
+
+// After every step, send the particles that left this rank's slab to the ranks whose slab
+// they are in now. Only the attractors and the mouse act on a particle, so nothing else has
+// to cross between slabs.
+void domainstep()
+{
+    TraceScope scope("migrate");
+    if (nstep % BALANCE == BALANCE - 1)
+        domainbalance();
+
+    // Every thread packs the particles that stay to the front of its range and the others into
+    // its own messages, then the ranges close up behind each other
+    Particle *ps = hostdata();
+    size_t nt = parallelthreads();
+    vector<vector<string>> leave(nt, vector<string>(opts.ranks));
+    vector<size_t> from(nt), kept(nt);
+    parallel(sim.n, [&](size_t t, size_t begin, size_t end) {
+        size_t k = begin;
+        for (size_t i = begin; i < end; i++)
+        {
+            int r = slab(ps[i].pos[0]);
+            if (r != opts.rank)
+                leave[t][r].append((const char *)&ps[i], sizeof(Particle));
+            else
+                ps[k++] = ps[i];
+        }
+        from[t] = begin;
+        kept[t] = k - begin;
+    });
+    size_t n = 0;
+    for (size_t t = 0; t < nt; t++)
+    {
+        if (from[t] != n)
+            memmove(ps + n, ps + from[t], kept[t] * sizeof(Particle));
+        n += kept[t];
+    }
+
+    vector<string> out(opts.ranks), in;
+    for (int r = 0; r < opts.ranks; r++)
+        for (size_t t = 0; t < nt; t++)
+            out[r] += leave[t][r];
+    transport->exchange(out, in);
+
+    size_t arriving = 0;
+    for (const string &s : in)
+        arriving += s.size() / sizeof(Particle);
+    if (n == (size_t)sim.n && !arriving)
+        return;
+    ps = hostresize(n + arriving);
+    for (const string &s : in)
+    {
+        memcpy(ps + n, s.data(), s.size());
+        n += s.size() / sizeof(Particle);
+    }
+}
+
+// Report where the particles ended up, then wait for the other ranks to finish
+void domainend()
+{
+    vector<string> out(opts.ranks), in;
+    if (opts.rank)
+        out[0] = to_string(sim.n);
+    transport->exchange(out, in);
+    if (!opts.rank)
+    {
+        long sum = sim.n;
+        cout << YELLO << "Rank 0 ended with " << sim.n << " particles" << endl;
+        for (int r = 1; r < opts.ranks; r++)
+        {
+            cout << YELLO << "Rank " << r << " ended with " << in[r] << " particles" << endl;
+            sum += atol(in[r].c_str());
+        }
+        if (sum != total)
+            cout << RED << "The ranks hold " << sum << " particles, the run started with " << total << endl;
+        for (pid_t pid : children)
+        {
+            int status;
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+                cout << RED << "Rank process " << pid << " failed" << endl;
+        }
+    }
+    delete transport;
+    transport = nullptr;
+}
@@ -0,0 +1,56 @@
+// Mixed-precision drift, shared by kernel.cl (prepended after bounds.h) and the host like rng.h.
+//
+// With --mixed-precision every coordinate carries 10 more bits in the w padding of the
+// position row: x is hi + k / 1024 * ulp(hi) for the float hi and a signed 10-bit k, field c
+// of the bits of w. Readers that only want floats keep using hi. The drift adds the step to
+// hi with an exact two-sum, so the rounding error goes to k instead of being lost, and since
+// it is nothing but correctly rounded adds and power-of-two scalings the result is the same
+// bits on every IEEE backend, as long as no compiler fuses them into an fma: contraction is off
+// for this file on the device and for the host build with -ffp-contract=off in the Makefile.
+#ifndef DRIFT_H
+#define DRIFT_H
+
+#ifdef __OPENCL_VERSION__
+#pragma OPENCL FP_CONTRACT OFF
+#define dr_ilogb ilogb
+#define dr_ldexp ldexp
+#define dr_rint rint
+#else
+#define dr_ilogb ilogbf
+#define dr_ldexp ldexpf
+#define dr_rint rintf
+#endif
+
+// Exponent of the last place of x is this minus 23, subnormals and zero share the smallest
+RNG_INLINE int dr_exp(float x)
+{
+    int e = dr_ilogb(x);
+    return e < -126 ? -126 : e > 127 ? 127 : e;
+}
+
+// x + d for coordinate c of a position row, the extra bits are read from and written to w
+RNG_INLINE float dr_drift(float hi, float d, rng_u32 *w, int c)
+{
+    int k = (int)(*w << (22 - 10 * c)) >> 22;
+    float lo = dr_ldexp((float)k, dr_exp(hi) - 33);
+
+    // s + e is hi + d exactly, then t + f is s + e + lo up to a rounding of the tiny e + lo
+    float s = hi + d;
+    float b = s - hi;
+    float e = (hi - (s - b)) + (d - b) + lo;
+    float t = s + e;
+    b = t - s;
+    float f = (s - (t - b)) + (e - b);
+
+    k = (int)dr_rint(dr_ldexp(f, 33 - dr_exp(t)));
+    k = k < -512 ? -512 : k > 511 ? 511 : k;
+    *w = (*w & ~(0x3FFu << (10 * c))) | ((rng_u32)k & 0x3FFu) << (10 * c);
+    return t;
+}
+
+// Back to the default for the kernels that follow
+#ifdef __OPENCL_VERSION__
+#pragma OPENCL FP_CONTRACT ON
+#endif
+
+#endif
@@ -0,0 +1,196 @@
+#include "particle.hpp"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+using namespace std;
+
+// One line of the spec file
+struct Member
+{
+    int n;                         // particles
+    Instance inst;                 // parameters, first and count filled in when packing
+    vector<Attractor> attractors;  // its own gravity points
+};
+
+static vector<Member> members;
+
+// One instance per line, for example
+//     particles 2000 seed 7 att 0.05 init disk mouse 0 0 0 attractor 0.3 0 0 1 0 repeat 100
+// "repeat k" adds k copies with seeds seed, seed + 1, ... and '#' starts a comment.
+void ensembleload(const string &path)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        cout << RED << "Failed to open ensemble spec " << path << endl;
+        exit(1);
+    }
+    string line;
+    for (int lineno = 1; getline(file, line); lineno++)
+    {
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        Member m{1000, Instance{}, {}};
+        m.inst.att = 0.05f;
+        int repeat = 1;
+        string word;
+        bool any = false;
+        while (words >> word)
+        {
+            any = true;
+            if (word == "particles")
+                words >> m.n;
+            else if (word == "seed")
+                words >> m.inst.seed;
+            else if (word == "att")
+                words >> m.inst.att;
+            else if (word == "init" && words >> word)
+            {
+                const char *shapes[] = {"cube", "disk", "plummer", "shells"};
+                m.inst.shape = -1;
+                for (int s = 0; s < 4; s++)
+                    if (word == shapes[s])
+                        m.inst.shape = s;
+                if (m.inst.shape < 0)
+                    words.setstate(ios::failbit);
+            }
+            else if (word == "mouse")
+                words >> m.inst.x >> m.inst.y >> m.inst.z;
+            else if (word == "attractor")
+            {
+                Attractor a{{0, 0, 0}};
+                words >> a.pos[0] >> a.pos[1] >> a.pos[2] >> a.strength >> a.falloff;
+                m.attractors.push_back(a);
+            }
+            else if (word == "repeat")
+                words >> repeat;
+            else
+                words.setstate(ios::failbit);
+            if (!words)
+            {
+                cout << RED << path << ":" << lineno << ": bad ensemble spec near \"" << word << "\"" << endl;
+                exit(1);
+            }
+        }
+        if (!any)
+            continue;
+        if (m.n < 1 || repeat < 1)
+        {
+            cout << RED << path << ":" << lineno << ": particles and repeat must be positive" << endl;
+            exit(1);
+        }
+        for (int r = 0; r < repeat; r++, m.inst.seed++)
+            members.push_back(m);
+    }
+    if (members.empty())
+    {
+        cout << RED << "Ensemble spec " << path << " has no instances" << endl;
+        exit(1);
+    }
+}
+
+static cl_mem ensemblebuffer(size_t size, void *data)
+{
+    cl_mem mem = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, data, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create ensemble buffer: " << ret << endl;
+        exit(1);
+    }
+    return mem;
+}
+
+// Pack every instance into one particle buffer and step them all with one launch per step,
+// then print a summary line per instance
+void ensemblerun()
+{
+    // Packed layout: instance k owns particles offsets[k] .. offsets[k + 1] - 1
+    SimulationContext ens;
+    vector<int> offsets{0};
+    vector<Instance> table;
+    vector<Attractor> attrs;
+    for (Member &m : members)
+    {
+        m.inst.first = attrs.size();
+        m.inst.count = m.attractors.size();
+        attrs.insert(attrs.end(), m.attractors.begin(), m.attractors.end());
+        table.push_back(m.inst);
+        offsets.push_back(offsets.back() + m.n);
+    }
+    ens.n = offsets.back();
+    ens.global = ens.n;
+    if (attrs.empty())
+        attrs.resize(1, Attractor{{0, 0, 0}});
+    cl_int ninst = members.size();
+    cout << YELLO << "Ensemble: " << ninst << " instances, " << ens.n << " particles" << endl;
+
+    clprogram();
+    vector<Particle> state(ens.n);
+    ens.particles = ensemblebuffer(ens.n * sizeof(Particle), state.data());
+    cl_mem doffsets = ensemblebuffer(offsets.size() * sizeof(int), offsets.data());
+    cl_mem dtable = ensemblebuffer(table.size() * sizeof(Instance), table.data());
+    cl_mem dattrs = ensemblebuffer(attrs.size() * sizeof(Attractor), attrs.data());
+
+    ens.ker_init = clCreateKernel(program, "ensembleinit", &ret);
+    ens.ker_acc = clCreateKernel(program, "ensemblestep", &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create ensemble kernels: " << ret << endl;
+        exit(1);
+    }
+    clSetKernelArg(ens.ker_init, 0, sizeof(cl_mem), &ens.particles);
+    clSetKernelArg(ens.ker_init, 1, sizeof(cl_mem), &doffsets);
+    clSetKernelArg(ens.ker_init, 2, sizeof(cl_mem), &dtable);
+    clSetKernelArg(ens.ker_init, 3, sizeof(cl_int), &ninst);
+    clSetKernelArg(ens.ker_acc, 0, sizeof(cl_mem), &ens.particles);
+    clSetKernelArg(ens.ker_acc, 1, sizeof(cl_mem), &doffsets);
+    clSetKernelArg(ens.ker_acc, 2, sizeof(cl_mem), &dtable);
+    clSetKernelArg(ens.ker_acc, 3, sizeof(cl_mem), &dattrs);
+    clSetKernelArg(ens.ker_acc, 4, sizeof(cl_int), &ninst);
+
+    long steps = opts.steps ? opts.steps : 1000;
+    auto start = chrono::steady_clock::now();
+    clEnqueueNDRangeKernel(command_queue, ens.ker_init, 1, NULL, &ens.global, NULL, 0, NULL, NULL);
+    for (long s = 0; s < steps; s++)
+        ret = clEnqueueNDRangeKernel(command_queue, ens.ker_acc, 1, NULL, &ens.global, NULL, 0, NULL, NULL);
+    clEnqueueReadBuffer(command_queue, ens.particles, CL_TRUE, 0, ens.n * sizeof(Particle), state.data(), 0, NULL,
+                        NULL);
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << GREEN << steps << " steps of " << ninst << " instances in " << secs << " s ("
+         << steps * ninst / secs << " instance steps/s)" << endl;
+
+    // Centroid, rms distance from it, mean speed and a hash of the final state of each instance
+    ofstream file;
+    if (!opts.out.empty())
+        file.open(opts.out);
+    ostream &out = opts.out.empty() ? cout : file;
+    out << "# instance seed att particles cx cy cz rms speed hash" << endl;
+    for (int k = 0; k < ninst; k++)
+    {
+        double c[3] = {0, 0, 0}, r2 = 0, speed = 0;
+        uint64_t h = 14695981039346656037ull;
+        int n = offsets[k + 1] - offsets[k];
+        const Particle *ps = &state[offsets[k]];
+        for (int i = 0; i < n; i++)
+            for (int d = 0; d < 3; d++)
+                c[d] += ps[i].pos[d] / n;
+        for (int i = 0; i < n; i++)
+        {
+            const float *p = ps[i].pos, *v = ps[i].vel;
+            for (int d = 0; d < 3; d++)
+                r2 += (p[d] - c[d]) * (p[d] - c[d]) / n;
+            speed += sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]) / n;
+        }
+        const unsigned char *bytes = (const unsigned char *)ps;
+        for (size_t i = 0; i < n * sizeof(Particle); i++)
+            h = (h ^ bytes[i]) * 1099511628211ull;
+        out << k << " " << table[k].seed << " " << table[k].att << " " << n << " " << c[0] << " " << c[1] << " "
+            << c[2] << " " << sqrt(r2) << " " << speed << " " << hex << h << dec << endl;
+    }
+
+    clReleaseKernel(ens.ker_init);
+    clReleaseKernel(ens.ker_acc);
+    for (cl_mem mem : {ens.particles, doffsets, dtable, dattrs})
+        clReleaseMemObject(mem);
+    clprogramend();
+}
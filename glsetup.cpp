@@ -3,7 +3,6 @@
 
 float hsv[3] = {0, .6, 1.0};
 Buffers g_bufs;
-Mass mouse;
 
 using namespace std;
 
@@ -13,13 +12,14 @@ void button(GLFWwindow *window, int button, int action, int mods);
 void scroll(GLFWwindow *window, double x, double y);
 void keys(GLFWwindow *window, int key, int scan, int action, int mods);
 
-void getshader(Buffers *g_bufs)
+// Compile and link a vertex and fragment shader pair from files
+GLuint getprogram(const std::string &vs, const std::string &fs)
 {
     t_uint vertexshader;
     t_uint fragmentshader;
     // Get shader source as strings
-    std::string vsrc_str = filetostr("particle.vs");
-    std::string fsrc_str = filetostr("particle.fs");
+    std::string vsrc_str = filetostr(vs);
+    std::string fsrc_str = filetostr(fs);
     // Get C-style string pointers
     const GLchar *vsrc = vsrc_str.c_str();
     const GLchar *fsrc = fsrc_str.c_str();
@@ -34,7 +34,7 @@ void getshader(Buffers *g_bufs)
     if (!success)
     {
         glGetShaderInfoLog(vertexshader, 512, NULL, infoLog);
-        cout << RED << "Vertex shader compilation failed:\n" << infoLog << endl;
+        cout << RED << "Vertex shader compilation failed (" << vs << "):\n" << infoLog << endl;
     }
 
     fragmentshader = glCreateShader(GL_FRAGMENT_SHADER);
@@ -45,48 +45,40 @@ void getshader(Buffers *g_bufs)
     if (!success)
     {
         glGetShaderInfoLog(fragmentshader, 512, NULL, infoLog);
-        cout << RED << "Fragment shader compilation failed:\n" << infoLog << endl;
+        cout << RED << "Fragment shader compilation failed (" << fs << "):\n" << infoLog << endl;
     }
 
-    g_bufs->shaders = glCreateProgram();
-    glAttachShader(g_bufs->shaders, vertexshader);
-    glAttachShader(g_bufs->shaders, fragmentshader);
-    glLinkProgram(g_bufs->shaders);
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexshader);
+    glAttachShader(program, fragmentshader);
+    glLinkProgram(program);
 
-    glGetProgramiv(g_bufs->shaders, GL_LINK_STATUS, &success);
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
     if (!success)
     {
-        glGetProgramInfoLog(g_bufs->shaders, 512, NULL, infoLog);
+        glGetProgramInfoLog(program, 512, NULL, infoLog);
         cout << RED << "Shader program linking failed:\n" << infoLog << endl;
     }
 
     glDeleteShader(vertexshader);
     glDeleteShader(fragmentshader);
+    return program;
+}
+
+void getshader(Buffers *g_bufs)
+{
+    g_bufs->shaders = getprogram("particle.vs", "particle.fs");
 
     // Use glGetUniformLocation for uniforms
     g_bufs->mat = glGetUniformLocation(g_bufs->shaders, "p");
     g_bufs->mx = glGetUniformLocation(g_bufs->shaders, "mx");
     g_bufs->my = glGetUniformLocation(g_bufs->shaders, "my");
     g_bufs->hsv = glGetUniformLocation(g_bufs->shaders, "hsv");
+    g_bufs->scale = glGetUniformLocation(g_bufs->shaders, "scale");
+    g_bufs->offset = glGetUniformLocation(g_bufs->shaders, "offset");
 
-    // Fix pointer access with ->
-    glGenBuffers(1, &g_bufs->vbo);
-    glGenVertexArrays(1, &g_bufs->vao);
-    glBindVertexArray(g_bufs->vao);
-    glBindBuffer(GL_ARRAY_BUFFER, g_bufs->vbo);
-    glBufferData(GL_ARRAY_BUFFER, N * sizeof(Particle), NULL, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Particle), NULL);
-    glEnableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
     glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
 
-    // Forward declare these functions at the top of the file
-    glfwSetCursorPosCallback(window, cursor);
-    glfwSetMouseButtonCallback(window, button);
-    glfwSetScrollCallback(window, scroll);
-    glfwSetKeyCallback(window, keys);
-
     // Fix pointer access with ->
     g_bufs->bl = 0.0f;
     g_bufs->pt = 1;
@@ -102,133 +94,33 @@ void getshader(Buffers *g_bufs)
 
 void cursor(GLFWwindow *window, double x, double y)
 {
-    mouse.x = (float)x * 2 / W - 1.0;
-    mouse.y = -((float)y * 2 / H - 1.0);
+    inputpush(Event{nstep, EV_CURSOR, x, y, 0, 0});
 }
 
 void button(GLFWwindow *window, int button, int action, int mods)
 {
-    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && mouse.n < 5)
-    {
-        mouse.m[2 * mouse.n] = mouse.x;
-        mouse.m[2 * mouse.n + 1] = mouse.y;
-        mouse.n++;
-    }
+    inputpush(Event{nstep, EV_BUTTON, 0, 0, button, action});
 }
 
 void scroll(GLFWwindow *window, double x, double y)
 {
-    if (x > 0)
-        mouse.att += 0.001;
-    if (x < 0)
-        mouse.att -= (mouse.att >= 0.002 ? 0.001 : 0);
-
-    if (y != 0)
-    {
-        // Acquire GL objects before using them
-        ret = clEnqueueAcquireGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
-        if (ret != CL_SUCCESS)
-        {
-            cout << RED << "Failed to acquire GL objects in scroll: " << ret << endl;
-            exit(1);
-        }
-
-        if (y > 0)
-        {
-            ret = clEnqueueNDRangeKernel(command_queue, ker_zoomout, 1, NULL, &global_item_size, &local_item_size, 0,
-                                         NULL, NULL);
-            for (int i = 0; i < mouse.n; i++)
-            {
-                mouse.m[2 * i] *= 0.9;
-                mouse.m[2 * i + 1] *= 0.9;
-            }
-        }
-        if (y < 0)
-        {
-            ret = clEnqueueNDRangeKernel(command_queue, ker_zoomin, 1, NULL, &global_item_size, &local_item_size, 0,
-                                         NULL, NULL);
-            for (int i = 0; i < mouse.n; i++)
-            {
-                mouse.m[2 * i] /= 0.9;
-                mouse.m[2 * i + 1] /= 0.9;
-            }
-        }
-
-        // Release GL objects after using them
-        ret = clEnqueueReleaseGLObjects(command_queue, 1, &memobj, 0, NULL, NULL);
-        if (ret != CL_SUCCESS)
-        {
-            cout << RED << "Failed to release GL objects in scroll: " << ret << endl;
-            exit(1);
-        }
-
-        clFinish(command_queue);
-        loop();
-    }
+    inputpush(Event{nstep, EV_SCROLL, x, y, 0, 0});
 }
 
 void keys(GLFWwindow *window, int key, int scan, int action, int mods)
 {
     (void)scan;
     (void)mods;
-    if (key == GLFW_KEY_SPACE && action == GLFW_PRESS)
-        go = !go;
-    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
-    if (key == GLFW_KEY_E && action == GLFW_PRESS)
-        explode = !explode;
-    if (key == GLFW_KEY_C && action == GLFW_PRESS)
-        mouse.n = 0;
-    if (key == GLFW_KEY_F && action == GLFW_PRESS)
-        freezehue = !freezehue;
-    if (key == GLFW_KEY_N && action == GLFW_PRESS)
-        newParticles = !newParticles;
-    if (key == GLFW_KEY_ENTER && action == GLFW_PRESS)
-        clReset();
-}
-
-void keyholds(GLFWwindow *window)
-{
-    if (glfwGetKey(window, GLFW_KEY_X) == GLFW_PRESS)
-        g_bufs.bl = (g_bufs.bl + 0.01 > 1 ? 1 : g_bufs.bl + 0.01);
-    if (glfwGetKey(window, GLFW_KEY_Z) == GLFW_PRESS)
-        g_bufs.bl = (g_bufs.bl - 0.01 < 0 ? 0 : g_bufs.bl - 0.01);
-    if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS)
-        hsv[1] = (hsv[1] + 0.01 > 1 ? 1 : hsv[1] + 0.01);
-    if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS)
-        hsv[1] = (hsv[1] - 0.01 < 0 ? 0 : hsv[1] - 0.01);
-    if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS)
-        hsv[2] = (hsv[2] + 0.01 > 1 ? 1 : hsv[2] + 0.01);
-    if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS)
-        hsv[2] = (hsv[2] - 0.01 < 0 ? 0 : hsv[2] - 0.01);
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        g_bufs.trans[14] += 0.02;
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        g_bufs.trans[14] -= 0.02;
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-    {
-        mouse.z += 0.02;
-        g_bufs.trans[12] += 0.02;
-    }
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-    {
-        mouse.z -= 0.02;
-        g_bufs.trans[12] -= 0.02;
-    }
-    if (glfwGetKey(window, GLFW_KEY_EQUAL) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_MINUS) == GLFW_PRESS)
-    {
-        g_bufs.pt += glfwGetKey(window, GLFW_KEY_EQUAL) == GLFW_PRESS ? 0.02 : -0.02;
-        glPointSize(g_bufs.pt);
-    }
+    inputpush(Event{nstep, EV_KEY, 0, 0, key, action});
 }
 
 void glinit()
 {
-    mouse.x = 0;
-    mouse.y = 0;
-    mouse.z = 0;
-    mouse.n = 0;
-    mouse.att = 0.05;
+    sim.mouse.x = 0;
+    sim.mouse.y = 0;
+    sim.mouse.z = 0;
+    sim.mouse.n = 0;
+    sim.mouse.att = 0.05;
 
     if (!glfwInit())
     {
@@ -287,6 +179,26 @@ void glinit()
         exit(1);
     }
 
+    glbuffers();
+
+    // Set up other GL state
+    glfwSetCursorPosCallback(window, cursor);
+    glfwSetMouseButtonCallback(window, button);
+    glfwSetScrollCallback(window, scroll);
+    glfwSetKeyCallback(window, keys);
+}
+
+// 90 degree projection for a W x H target, also what the software rasterizer draws with
+void glprojection()
+{
+    g_bufs.p[0] = 1.0 / tan(90 / 2 * PI / 180);
+    g_bufs.p[5] = g_bufs.p[0];
+    g_bufs.p[0] *= (float)H / W; // keep the aspect ratio for non-square targets
+}
+
+// Buffers, shaders and OpenCL context, shared by the window and offscreen paths
+void glbuffers()
+{
     // Create and bind VAO first
     glGenVertexArrays(1, &g_bufs.vao);
     glBindVertexArray(g_bufs.vao);
@@ -295,13 +207,26 @@ void glinit()
     glGenBuffers(1, &g_bufs.vbo);
     glBindBuffer(GL_ARRAY_BUFFER, g_bufs.vbo);
 
-    // Initialize buffer with zeros
-    const size_t buffer_size = N * sizeof(Particle);
-    std::vector<float> zeros(buffer_size / sizeof(float), 0.0f);
-    glBufferData(GL_ARRAY_BUFFER, buffer_size, zeros.data(), GL_DYNAMIC_DRAW);
+    // Initialize buffer with zeros, or map it for the whole run when the backend writes into it
+    if (opts.transfer == TR_MAPPED)
+        transferinit();
+    else if (opts.quantize)
+    {
+        std::vector<QParticle> zeros(sim.n);
+        glBufferData(GL_ARRAY_BUFFER, sim.n * sizeof(QParticle), zeros.data(), GL_DYNAMIC_DRAW);
+    }
+    else
+    {
+        const size_t buffer_size = sim.n * sizeof(Particle);
+        std::vector<float> zeros(buffer_size / sizeof(float), 0.0f);
+        glBufferData(GL_ARRAY_BUFFER, buffer_size, zeros.data(), GL_DYNAMIC_DRAW);
+    }
 
     // Set up vertex attributes for position only
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Particle), (void *)0);
+    if (opts.quantize)
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(QParticle), (void *)0);
+    else
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Particle), (void *)0);
     glEnableVertexAttribArray(0);
 
     // Keep VAO bound but unbind VBO
@@ -312,15 +237,12 @@ void glinit()
     glFlush();
 
     // Now initialize OpenCL
-    getcontext();
+    if (opts.backend == BK_CL)
+        getcontext();
     getshader(&g_bufs);
 
     // Set up other GL state
     glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
-    glfwSetCursorPosCallback(window, cursor);
-    glfwSetMouseButtonCallback(window, button);
-    glfwSetScrollCallback(window, scroll);
-    glfwSetKeyCallback(window, keys);
 
     // Fix pointer access with ->
     g_bufs.bl = 0.0f; // set the blur to 0
@@ -329,14 +251,22 @@ void glinit()
     g_bufs.camx[15] = 1;
     g_bufs.camx[10] = 1;
     g_bufs.camx[15] = 1;
-    g_bufs.p[0] = 1.0 / tan(90 / 2 * PI / 180); // set the projection to 90 degrees
-    g_bufs.p[5] = g_bufs.p[0];
+    glprojection();
     glPointSize(g_bufs.pt);
     glUseProgram(g_bufs.shaders);
+    if (opts.lod)
+        lodinit();
+    if (opts.density)
+        densityinit();
 }
 
 void glend()
 {
+    transferend();
+    if (opts.density)
+        densityend();
+    if (opts.lod)
+        lodend();
     glDeleteVertexArrays(1, &g_bufs.vao);
     glDeleteBuffers(1, &g_bufs.vbo);
     glDeleteProgram(g_bufs.shaders);
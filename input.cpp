@@ -0,0 +1,366 @@
+#include "particle.hpp"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+using namespace std;
+
+long nstep = 0; // number of simulation steps run so far
+
+// Keys polled every frame, bit i of the hold mask is holdkeys[i]
+static const int holdkeys[] = {GLFW_KEY_X,  GLFW_KEY_Z, GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_UP,    GLFW_KEY_DOWN,
+                               GLFW_KEY_W,  GLFW_KEY_S, GLFW_KEY_D,    GLFW_KEY_A,     GLFW_KEY_EQUAL, GLFW_KEY_MINUS,
+                               0};
+
+static int holds = 0;             // currently held keys
+static ofstream logfile;          // input log being recorded
+static vector<Event> events;      // input log being replayed
+static size_t nextevent = 0;      // next event to replay
+static ofstream hashfile;         // per-step hashes being written
+static vector<uint64_t> expected; // per-step hashes to verify against
+static long mismatches = 0;       // number of steps that failed verification
+
+// Input waiting for inputapply, a bounded ring any thread pushes to and only the frame loop
+// pops from. A cell is free for the push of lap L while its seq is 2L and holds an event for
+// the pop of lap L while it is 2L + 1, so the zeroed ring starts out empty.
+struct Cell
+{
+    atomic<size_t> seq; // 2 * lap, + 1 while it holds an event
+    Event e;
+};
+static const size_t NQUEUE = 1024;
+static Cell queue[NQUEUE];
+static atomic<size_t> tail{0};  // next push ticket
+static size_t head = 0;         // next pop, frame loop only
+static atomic<long> dropped{0}; // events pushed while the queue was full
+
+static bool held(int key)
+{
+    for (int i = 0; holdkeys[i]; i++)
+        if (holdkeys[i] == key)
+            return holds & (1 << i);
+    return false;
+}
+
+// Queue an event for the next inputapply, safe from any thread. Fails only when the frame
+// loop has fallen a whole queue behind.
+bool inputpush(const Event &e)
+{
+    size_t t = tail.load(memory_order_relaxed);
+    while (true)
+    {
+        Cell &c = queue[t % NQUEUE];
+        size_t lap = 2 * (t / NQUEUE);
+        size_t seq = c.seq.load(memory_order_acquire);
+        if (seq == lap)
+        {
+            if (tail.compare_exchange_weak(t, t + 1, memory_order_relaxed))
+            {
+                c.e = e;
+                c.seq.store(lap + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (seq < lap)
+        {
+            // Still holds the event of the previous lap
+            if (!dropped++)
+                cout << ORANGE << "Input queue full, dropping events" << endl;
+            return false;
+        }
+        else
+            t = tail.load(memory_order_relaxed);
+    }
+}
+
+static bool inputpop(Event &e)
+{
+    Cell &c = queue[head % NQUEUE];
+    size_t lap = 2 * (head / NQUEUE);
+    if (c.seq.load(memory_order_acquire) != lap + 1)
+        return false;
+    e = c.e;
+    c.seq.store(lap + 2, memory_order_release);
+    head++;
+    return true;
+}
+
+// Fold b into a when applying it right after a changes nothing else: the cursor and the held
+// keys only keep their last value, scrolls in the same direction add up
+static bool merge(Event &a, const Event &b)
+{
+    if (a.type != b.type)
+        return false;
+    if (a.type == EV_CURSOR)
+    {
+        a.x = b.x;
+        a.y = b.y;
+        return true;
+    }
+    if (a.type == EV_HOLD)
+    {
+        a.key = b.key;
+        return true;
+    }
+    if (a.type == EV_SCROLL && a.x * b.x >= 0 && a.y * b.y >= 0)
+    {
+        a.x += b.x;
+        a.y += b.y;
+        return true;
+    }
+    return false;
+}
+
+// Apply everything queued since the last frame, merged unless replayed, then the held keys.
+// The only place input changes the simulation, once per frame just before the step.
+void inputapply()
+{
+    TraceScope scope("input");
+    vector<Event> batch;
+    Event e;
+    while (inputpop(e))
+    {
+        // A replay applies the events as they were logged: older logs hold every fractional
+        // touchpad scroll on its own, each zooming one tick, and merging them would zoom fewer
+        e.step = nstep;
+        if (batch.empty() || !opts.replay.empty() || !merge(batch.back(), e))
+            batch.push_back(e);
+    }
+    if (opts.ranks)
+        domaininput(batch);
+    for (const Event &b : batch)
+        input(b);
+    applyholds();
+}
+
+// Change the simulation for one event. Window and stream callbacks only queue events, so the
+// zoom and every other change land between two steps, never inside a frame.
+static void applyevent(const Event &e)
+{
+    if (e.type == EV_CURSOR)
+    {
+        sim.mouse.x = (float)e.x * 2 / W - 1.0;
+        sim.mouse.y = -((float)e.y * 2 / H - 1.0);
+    }
+    else if (e.type == EV_BUTTON)
+    {
+        if (e.key == GLFW_MOUSE_BUTTON_LEFT && e.action == GLFW_PRESS)
+            attradd(Attractor{{sim.mouse.x, sim.mouse.y, sim.mouse.z}});
+    }
+    else if (e.type == EV_SCROLL)
+    {
+        // Every started unit of a merged delta counts as a wheel tick
+        for (int i = 0; i < ceil(fabs(e.x)); i++)
+        {
+            if (e.x > 0)
+                sim.mouse.att += 0.001;
+            if (e.x < 0)
+                sim.mouse.att -= (sim.mouse.att >= 0.002 ? 0.001 : 0);
+        }
+
+        int ticks = ceil(fabs(e.y));
+        if (ticks)
+        {
+            simzoom(e.y > 0, ticks);
+            for (int i = 0; i < ticks; i++)
+                attrscale(e.y > 0 ? sim.params.zoomout : sim.params.zoomin);
+        }
+    }
+    else if (e.type == EV_KEY && e.action == GLFW_PRESS)
+    {
+        if (e.key == GLFW_KEY_SPACE)
+            go = !go;
+        if (e.key == GLFW_KEY_ESCAPE && window)
+            glfwSetWindowShouldClose(window, true);
+        if (e.key == GLFW_KEY_E)
+            explode = !explode;
+        if (e.key == GLFW_KEY_C)
+            attrclear();
+        if (e.key == GLFW_KEY_F)
+            freezehue = !freezehue;
+        if (e.key == GLFW_KEY_N)
+            newParticles = !newParticles;
+        if (e.key == GLFW_KEY_ENTER)
+            simreset();
+    }
+    else if (e.type == EV_HOLD)
+        holds = e.key;
+}
+
+// Record the event if a log is open, then apply it
+void input(const Event &e)
+{
+    if (logfile.is_open())
+    {
+        logfile.precision(17);
+        logfile << e.step << " " << e.type << " " << e.x << " " << e.y << " " << e.key << " " << e.action << "\n";
+    }
+    applyevent(e);
+}
+
+// Poll the held keys and queue the mask when it changes
+void keyholds(GLFWwindow *window)
+{
+    int mask = 0;
+    for (int i = 0; holdkeys[i]; i++)
+        if (glfwGetKey(window, holdkeys[i]) == GLFW_PRESS)
+            mask |= 1 << i;
+    if (mask != holds)
+        inputpush(Event{nstep, EV_HOLD, 0, 0, mask, 0});
+}
+
+void applyholds()
+{
+    if (held(GLFW_KEY_X))
+        g_bufs.bl = (g_bufs.bl + 0.01 > 1 ? 1 : g_bufs.bl + 0.01);
+    if (held(GLFW_KEY_Z))
+        g_bufs.bl = (g_bufs.bl - 0.01 < 0 ? 0 : g_bufs.bl - 0.01);
+    if (held(GLFW_KEY_LEFT))
+        hsv[1] = (hsv[1] + 0.01 > 1 ? 1 : hsv[1] + 0.01);
+    if (held(GLFW_KEY_RIGHT))
+        hsv[1] = (hsv[1] - 0.01 < 0 ? 0 : hsv[1] - 0.01);
+    if (held(GLFW_KEY_UP))
+        hsv[2] = (hsv[2] + 0.01 > 1 ? 1 : hsv[2] + 0.01);
+    if (held(GLFW_KEY_DOWN))
+        hsv[2] = (hsv[2] - 0.01 < 0 ? 0 : hsv[2] - 0.01);
+    if (held(GLFW_KEY_W))
+        g_bufs.trans[14] += 0.02;
+    if (held(GLFW_KEY_S))
+        g_bufs.trans[14] -= 0.02;
+    if (held(GLFW_KEY_D))
+    {
+        sim.mouse.z += 0.02;
+        g_bufs.trans[12] += 0.02;
+    }
+    if (held(GLFW_KEY_A))
+    {
+        sim.mouse.z -= 0.02;
+        g_bufs.trans[12] -= 0.02;
+    }
+    if (held(GLFW_KEY_EQUAL) || held(GLFW_KEY_MINUS))
+    {
+        g_bufs.pt += held(GLFW_KEY_EQUAL) ? 0.02 : -0.02;
+        if (!opts.headless)
+            glPointSize(g_bufs.pt);
+    }
+}
+
+// Open an input log, the header holds everything needed to rebuild the initial state
+void recordopen(const std::string &path)
+{
+    logfile.open(path);
+    if (!logfile.is_open())
+    {
+        cout << RED << "Failed to open input log: " << path << endl;
+        exit(1);
+    }
+    logfile << "particles " << sim.n << " init " << opts.shape << " seed " << opts.seed << "\n";
+}
+
+void replayload(const std::string &path)
+{
+    ifstream file(path);
+    string line, word;
+    if (!file.is_open() || !getline(file, line))
+    {
+        cout << RED << "Failed to read input log: " << path << endl;
+        exit(1);
+    }
+
+    // Older logs have "circle 0|1" in place of the shape
+    istringstream header(line);
+    while (header >> word)
+    {
+        int circle;
+        if (word == "particles")
+            header >> sim.n;
+        else if (word == "init")
+            header >> opts.shape;
+        else if (word == "circle" && header >> circle)
+            opts.shape = circle ? SH_DISK : SH_CUBE;
+        else if (word == "seed")
+            header >> opts.seed;
+    }
+    while (getline(file, line))
+    {
+        Event e;
+        istringstream in(line);
+        if (in >> e.step >> e.type >> e.x >> e.y >> e.key >> e.action)
+            events.push_back(e);
+    }
+    cout << YELLO << "Replaying " << events.size() << " events over " << replaylength() << " steps" << endl;
+}
+
+// Queue every logged event due before the current step, a full queue takes the rest next step
+void replayfeed()
+{
+    while (nextevent < events.size() && events[nextevent].step <= nstep && inputpush(events[nextevent]))
+        nextevent++;
+}
+
+long replaylength()
+{
+    return events.empty() ? 0 : events.back().step + 1;
+}
+
+// Run the simulation without a window as fast as the device allows
+void replayrun()
+{
+    long steps = opts.steps ? opts.steps : replaylength();
+    if (!steps)
+        steps = 1000;
+
+    auto start = chrono::steady_clock::now();
+    while (nstep < steps)
+    {
+        replayfeed();
+        inputapply();
+        step();
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << GREEN << steps << " steps in " << secs << " s (" << steps / secs << " steps/s)" << endl;
+    if (!opts.verify.empty())
+    {
+        if (mismatches)
+            cout << RED << mismatches << " steps did not match " << opts.verify << endl;
+        else
+            cout << GREEN << "All " << expected.size() << " hashes match " << opts.verify << endl;
+    }
+}
+
+// FNV-1a over the particle buffer after the step, written out and/or checked
+void checkstate()
+{
+    if (opts.hashes.empty() && opts.verify.empty())
+        return;
+
+    if (!hashfile.is_open() && !opts.hashes.empty())
+        hashfile.open(opts.hashes);
+    if (expected.empty() && !opts.verify.empty())
+    {
+        ifstream file(opts.verify);
+        long s;
+        uint64_t h;
+        while (file >> s >> hex >> h >> dec)
+            expected.push_back(h);
+    }
+
+    static vector<Particle> state;
+    state.resize(sim.n);
+    simread(state.data());
+
+    uint64_t h = 14695981039346656037ull;
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(state.data());
+    for (size_t i = 0; i < sim.n * sizeof(Particle); i++)
+        h = (h ^ bytes[i]) * 1099511628211ull;
+
+    long s = nstep - 1;
+    if (hashfile.is_open())
+        hashfile << s << " " << hex << h << dec << "\n";
+    if (s < (long)expected.size() && expected[s] != h)
+    {
+        if (!mismatches)
+            cout << RED << "State diverged at step " << s << endl;
+        mismatches++;
+    }
+}
@@ -1,125 +1,759 @@
+// rng.h, bounds.h and drift.h are prepended to this file when the program is built
+
+// Must match Particle in particle.hpp: two 16-byte rows, 32 bytes per particle
 typedef struct s_p
 {
     float x;
     float y;
     float z;
+    float w;
     float vx;
     float vy;
     float vz;
+    float vw;
 } t_p;
 
+// Must match Mass in particle.hpp
 typedef struct s_mass
 {
     float x;
     float y;
     float z;
     int n;
-    float m[10];
     float att;
     int nPart;
+    int boundary;
+    float box;
 } t_mass;
 
-__kernel void accelerate(__global t_p *ps, const t_mass mouse)
+// Must match Attractor in particle.hpp
+typedef struct s_attr
 {
-    int i = get_global_id(0);
+    float x;
+    float y;
+    float z;
+    float strength;
+    float falloff;
+    float pad[3];
+} t_attr;
+
+// Must match SimParams in particle.hpp, rewritten by the host when a scenario changes them
+typedef struct s_params
+{
+    float dt;
+    float zoomout;
+    float zoomin;
+    float pad;
+} t_params;
+
+// Bring particle i back into the domain after it has moved, see bounds.h. A particle put
+// somewhere else loses the extra bits of its position.
+void boundary(__global t_p *p, const t_mass mouse, uint i, uint step, ulong seed)
+{
+    float pos[3] = {p->x, p->y, p->z};
+    float vel[3] = {p->vx, p->vy, p->vz};
+    float emit[3] = {mouse.x, mouse.y, mouse.z};
+    bd_apply(mouse.boundary, mouse.box, pos, vel, i, step, seed, emit);
+    if (pos[0] != p->x || pos[1] != p->y || pos[2] != p->z)
+        p->w = 0;
+    p->x = pos[0];
+    p->y = pos[1];
+    p->z = pos[2];
+    p->vx = vel[0];
+    p->vy = vel[1];
+    p->vz = vel[2];
+}
 
-    float dx = mouse.x - ps[i].x;
-    float dy = mouse.y - ps[i].y;
-    float dz = mouse.z - ps[i].z;
-    float ir = 1.0 / (dx * dx + dy * dy + dz * dz + 0.00001);
-    ir = sqrt(ir);
+// Mixed-precision drift by dt, see drift.h
+void drift(__global t_p *p, float dt)
+{
+    uint w = as_uint(p->w);
+    p->x = dr_drift(p->x, dt * p->vx, &w, 0);
+    p->y = dr_drift(p->y, dt * p->vy, &w, 1);
+    p->z = dr_drift(p->z, dt * p->vz, &w, 2);
+    p->w = as_float(w);
+}
+
+// Pull of the mouse and the attractors on a point, near gets the squared distance to the closest.
+// Separations are the shortest periodic images when the domain wraps.
+// Every work item of the group must call it, since they all help load the attractor tiles.
+float3 attraction(float px, float py, float pz, const t_mass mouse, __global const t_attr *attrs,
+                  __local t_attr *tile, float *near)
+{
+    int l = get_local_id(0);
+    int nl = get_local_size(0);
+
+    float dx = bd_image(mouse.boundary, mouse.box, mouse.x - px);
+    float dy = bd_image(mouse.boundary, mouse.box, mouse.y - py);
+    float dz = bd_image(mouse.boundary, mouse.box, mouse.z - pz);
+    float r2 = dx * dx + dy * dy + dz * dz + 0.00001f;
+    float ir = sqrt(1.0f / r2);
     float ax = mouse.att * ir * dx;
     float ay = mouse.att * ir * dy;
     float az = mouse.att * ir * dz;
-    for (int j = 0; j < mouse.n; j++)
+    *near = r2;
+
+    // Each work item loads one attractor of the tile, then all of them read the whole tile
+    for (int base = 0; base < mouse.n; base += nl)
     {
-        dx = mouse.m[2 * j] - ps[i].x;
-        dy = mouse.m[2 * j + 1] - ps[i].y;
-        dz = mouse.z - ps[i].z;
-        ir = 1.0 / (dx * dx + dy * dy + dz * dz + 0.00001);
-        ir = sqrt(ir);
-        ax += mouse.att * ir * dx;
-        ay += mouse.att * ir * dy;
-        az += mouse.att * ir * dz;
+        if (base + l < mouse.n)
+            tile[l] = attrs[base + l];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int m = min(nl, mouse.n - base);
+        for (int j = 0; j < m; j++)
+        {
+            dx = bd_image(mouse.boundary, mouse.box, tile[j].x - px);
+            dy = bd_image(mouse.boundary, mouse.box, tile[j].y - py);
+            dz = bd_image(mouse.boundary, mouse.box, tile[j].z - pz);
+            r2 = dx * dx + dy * dy + dz * dz + 0.00001f;
+            float f = mouse.att * tile[j].strength * rsqrt(r2) * pow(r2, -0.5f * tile[j].falloff);
+            ax += f * dx;
+            ay += f * dy;
+            az += f * dz;
+            *near = min(*near, r2);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    ps[i].vx += 0.2 * ax;
-    ps[i].vy += 0.2 * ay;
-    ps[i].vz += 0.2 * az;
+    return (float3)(ax, ay, az);
 }
 
-__kernel void move(__global t_p *ps)
+// The global size is padded to whole work groups, items past np only help load tiles
+__kernel void accelerate(__global t_p *ps, const t_mass mouse, __global const t_attr *attrs, __local t_attr *tile,
+                         const int np, __constant t_params *params)
 {
     int i = get_global_id(0);
+    int j = min(i, np - 1);
 
-    ps[i].x += 0.2 * ps[i].vx;
-    ps[i].y += 0.2 * ps[i].vy;
-    ps[i].z += 0.2 * ps[i].vz;
+    float near;
+    float3 a = attraction(ps[j].x, ps[j].y, ps[j].z, mouse, attrs, tile, &near);
+    if (i >= np)
+        return;
+    ps[i].vx += params->dt * a.x;
+    ps[i].vy += params->dt * a.y;
+    ps[i].vz += params->dt * a.z;
+}
+
+// Block timesteps: pick the power-of-two class of every particle, its step is dt / 2^class.
+// The step has to resolve both the free-fall time sqrt(r / a) and the crossing time r / v
+// of the nearest attractor.
+__kernel void classify(__global const t_p *ps, const t_mass mouse, __global const t_attr *attrs,
+                       __local t_attr *tile, const int np, const int levels, __global int *cls,
+                       __global int *counts, __constant t_params *params)
+{
+    int i = get_global_id(0);
+    int j = min(i, np - 1);
+
+    float near;
+    float3 a = attraction(ps[j].x, ps[j].y, ps[j].z, mouse, attrs, tile, &near);
+    if (i >= np)
+        return;
+    float r = sqrt(near);
+    float v = length((float3)(ps[i].vx, ps[i].vy, ps[i].vz));
+    float dt = 0.25f * min(sqrt(r / max(length(a), 1e-12f)), r / max(v, 1e-12f));
+    int k = clamp((int)ceil(log2(params->dt / dt)), 0, levels);
+    cls[i] = k;
+    atomic_inc(&counts[k]);
+}
+
+// Scatter particle indices into per-class lists, cursor holds the finest-first class offsets
+__kernel void compact(__global const int *cls, __global int *cursor, __global int *list)
+{
+    int i = get_global_id(0);
+
+    list[atomic_inc(&cursor[cls[i]])] = i;
+}
+
+// Kick and drift the first nactive listed particles by their own step. The lists are
+// ordered finest class first, so the particles due at a substep are always a prefix.
+__kernel void blockstep(__global t_p *ps, const t_mass mouse, __global const t_attr *attrs, __local t_attr *tile,
+                        const int nactive, __global const int *list, __global const int *cls, const uint step,
+                        const ulong seed, const int mixed, __constant t_params *params)
+{
+    int k = get_global_id(0);
+    int i = list[min(k, nactive - 1)];
+
+    float near;
+    float3 a = attraction(ps[i].x, ps[i].y, ps[i].z, mouse, attrs, tile, &near);
+    if (k >= nactive)
+        return;
+    float dt = params->dt / (1 << cls[i]);
+    ps[i].vx += dt * a.x;
+    ps[i].vy += dt * a.y;
+    ps[i].vz += dt * a.z;
+    if (mixed)
+        drift(&ps[i], dt);
+    else
+    {
+        ps[i].x += dt * ps[i].vx;
+        ps[i].y += dt * ps[i].vy;
+        ps[i].z += dt * ps[i].vz;
+    }
+    if (mouse.boundary)
+        boundary(&ps[i], mouse, i, step, seed);
 }
 
-__kernel void gen(__global t_p *ps, const t_mass mouse)
+// Drift, then keep the particle in the domain. mouse is only read for the boundary.
+__kernel void move(__global t_p *ps, const t_mass mouse, const uint step, const ulong seed, const int mixed,
+                   __constant t_params *params)
+{
+    int i = get_global_id(0);
+
+    if (mixed)
+        drift(&ps[i], params->dt);
+    else
+    {
+        ps[i].x += params->dt * ps[i].vx;
+        ps[i].y += params->dt * ps[i].vy;
+        ps[i].z += params->dt * ps[i].vz;
+    }
+    if (mouse.boundary)
+        boundary(&ps[i], mouse, i, step, seed);
+}
+
+// Emit particles at the mouse, jittered by a draw keyed on the step so every burst differs
+__kernel void gen(__global t_p *ps, const t_mass mouse, const uint step, const ulong seed)
 {
     int i = get_global_id(0);
 
     if (i >= mouse.nPart && i < mouse.nPart + 100)
     {
-        float offset = (float)(i - mouse.nPart) / 10000.0f;
-        ps[i].x = mouse.x + offset;
-        ps[i].y = mouse.y + offset;
-        ps[i].z = mouse.z + offset;
+        float u[4];
+        rng_uniform(i, 2, step, seed, u);
+        ps[i].x = mouse.x + (u[0] - 0.5f) * 0.01f;
+        ps[i].y = mouse.y + (u[1] - 0.5f) * 0.01f;
+        ps[i].z = mouse.z + (u[2] - 0.5f) * 0.01f;
+        ps[i].w = 0;
     }
 }
 
-__kernel void zoomout(__global t_p *ps)
+// The zooms drop the extra bits of mixed-precision positions
+__kernel void zoomout(__global t_p *ps, __constant t_params *params)
 {
     int i = get_global_id(0);
 
-    ps[i].x *= 0.9;
-    ps[i].y *= 0.9;
-    ps[i].z *= 0.9;
-    ps[i].vx *= 0.9;
-    ps[i].vy *= 0.9;
-    ps[i].vz *= 0.9;
+    ps[i].x *= params->zoomout;
+    ps[i].y *= params->zoomout;
+    ps[i].z *= params->zoomout;
+    ps[i].vx *= params->zoomout;
+    ps[i].vy *= params->zoomout;
+    ps[i].vz *= params->zoomout;
+    ps[i].w = 0;
 }
 
-__kernel void zoomin(__global t_p *ps)
+__kernel void zoomin(__global t_p *ps, __constant t_params *params)
 {
     int i = get_global_id(0);
 
-    ps[i].x *= 1.1;
-    ps[i].y *= 1.1;
-    ps[i].z *= 1.1;
-    ps[i].vx *= 1.1;
-    ps[i].vy *= 1.1;
-    ps[i].vz *= 1.1;
+    ps[i].x *= params->zoomin;
+    ps[i].y *= params->zoomin;
+    ps[i].z *= params->zoomin;
+    ps[i].vx *= params->zoomin;
+    ps[i].vy *= params->zoomin;
+    ps[i].vz *= params->zoomin;
+    ps[i].w = 0;
 }
 
-__kernel void init(__global t_p *ps)
+// Initial positions from rng.h, the same for a given shape and seed on every device
+__kernel void init(__global t_p *ps, const int shape, const ulong seed)
 {
     int i = get_global_id(0);
 
-    int n = i * i % (91 * 7703);
-    ps[i].x = (n % 200000 - 100000) / 300000.0f;
-    n = n * n % (91 * 7703);
-    ps[i].y = (n % 200000 - 100000) / 300000.0f;
-    n = n * n % (91 * 7703);
-    ps[i].z = (n % 200000 - 100000) / 300000.0f;
+    float pos[3];
+    rng_initpos(shape, i, seed, pos);
+    ps[i].x = pos[0];
+    ps[i].y = pos[1];
+    ps[i].z = pos[2];
+    ps[i].w = 0;
     ps[i].vx = 0;
     ps[i].vy = 0;
     ps[i].vz = 0;
+    ps[i].vw = 0;
+}
+
+// Whole-system diagnostics, must match Stats in particle.hpp
+typedef struct s_stats
+{
+    float4 lo;   // bounding box corner
+    float4 hi;   // opposite corner
+    float4 sum;  // summed positions, w the summed squared speed
+    float4 vmax; // x the largest squared speed
+} t_stats;
+
+t_stats statsempty()
+{
+    t_stats s;
+    s.lo = (float4)(INFINITY);
+    s.hi = (float4)(-INFINITY);
+    s.sum = (float4)(0);
+    s.vmax = (float4)(0);
+    return s;
 }
 
-__kernel void init2(__global t_p *ps)
+t_stats statsmerge(t_stats a, t_stats b)
+{
+    a.lo = fmin(a.lo, b.lo);
+    a.hi = fmax(a.hi, b.hi);
+    a.sum += b.sum;
+    a.vmax = fmax(a.vmax, b.vmax);
+    return a;
+}
+
+// Tree reduction of one value per work item, the group's total ends in loc[0]
+t_stats statsgroup(t_stats s, __local t_stats *loc)
+{
+    int l = get_local_id(0);
+    loc[l] = s;
+    for (int k = get_local_size(0) / 2; k > 0; k >>= 1)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (l < k)
+            loc[l] = statsmerge(loc[l], loc[l + k]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return loc[0];
+}
+
+// First pass, one partial result per work group. The groups stride over the buffer so
+// their number, and the work of the final pass, stays fixed.
+__kernel void stats(__global const t_p *ps, const int np, __global t_stats *partial, __local t_stats *loc)
+{
+    t_stats s = statsempty();
+    for (int i = get_global_id(0); i < np; i += get_global_size(0))
+    {
+        float4 p = (float4)(ps[i].x, ps[i].y, ps[i].z, 0);
+        float v2 = ps[i].vx * ps[i].vx + ps[i].vy * ps[i].vy + ps[i].vz * ps[i].vz;
+        s.lo = fmin(s.lo, p);
+        s.hi = fmax(s.hi, p);
+        s.sum += (float4)(p.xyz, v2);
+        s.vmax.x = fmax(s.vmax.x, v2);
+    }
+    s = statsgroup(s, loc);
+    if (get_local_id(0) == 0)
+        partial[get_group_id(0)] = s;
+}
+
+// Final pass, one work group merging the partial results
+__kernel void statsfinal(__global const t_stats *partial, const int ngroups, __global t_stats *result,
+                         __local t_stats *loc)
+{
+    t_stats s = statsempty();
+    for (int g = get_local_id(0); g < ngroups; g += get_local_size(0))
+        s = statsmerge(s, partial[g]);
+    s = statsgroup(s, loc);
+    if (get_local_id(0) == 0)
+        result[0] = s;
+}
+
+// Positions as 16-bit fractions of the bounding box from the stats passes, drawn as
+// normalized shorts and decoded in particle.vs with lo + q * extent
+__kernel void quantize(__global const t_p *ps, const int np, __global const t_stats *stats, __global ushort4 *q)
 {
     int i = get_global_id(0);
-    int n = i * i % (91 * 7703);
-    float r = sqrt((float)(n % 4000000)) / 2000.0;
-    n = n * n % (91 * 7703);
-    float theta = n % 100000 * 2 * 3.1415926 / 100000.0f;
-    n = n * n % (91 * 7703);
-    ps[i].x = r * cos(theta);
-    ps[i].y = r * sin(theta);
-    ps[i].z = (n % 200000 - 100000) / 300000.0f;
+    if (i >= np)
+        return;
+    float4 lo = stats[0].lo;
+    float4 extent = fmax(stats[0].hi - lo, (float4)(1e-6f));
+    float4 p = (float4)(ps[i].x, ps[i].y, ps[i].z, 0);
+    q[i] = convert_ushort4_sat_rte((p - lo) / extent * 65535.0f);
+}
+
+// Whether particle i of np is inside the view frustum of m, the column-major matrix particle.vs
+// draws with. Points are clipped by their centre, and positions that blew up are never in view.
+bool cullvisible(__global const t_p *ps, int i, int np, const float16 m)
+{
+    if (i >= np)
+        return false;
+    float4 c = ps[i].x * m.s0123 + ps[i].y * m.s4567 + ps[i].z * m.s89ab + m.scdef;
+    return c.w > 0 && fabs(c.x) <= c.w && fabs(c.y) <= c.w && fabs(c.z) <= c.w;
+}
+
+// Visible particles of every work group
+__kernel void cullcount(__global const t_p *ps, const int np, const float16 m, __global int *groupcount)
+{
+    __local int n;
+
+    if (get_local_id(0) == 0)
+        n = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (cullvisible(ps, get_global_id(0), np, m))
+        atomic_inc(&n);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (get_local_id(0) == 0)
+        groupcount[get_group_id(0)] = n;
+}
+
+// One work group, prefixes the group counts like sphscan. The total goes straight into the
+// count of the indirect draw arguments, so the host never reads it.
+__kernel void cullscan(__global const int *groupcount, __global int *groupstart, const int ngroup,
+                       __global uint *args, __local int *sums)
+{
+    int l = get_local_id(0);
+    int nl = get_local_size(0);
+    int lo = (int)((long)ngroup * l / nl);
+    int hi = (int)((long)ngroup * (l + 1) / nl);
+
+    int s = 0;
+    for (int g = lo; g < hi; g++)
+        s += groupcount[g];
+    sums[l] = s;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (l == 0)
+    {
+        int a = 0;
+        for (int k = 0; k < nl; k++)
+        {
+            int t = sums[k];
+            sums[k] = a;
+            a += t;
+        }
+        args[0] = a;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    s = sums[l];
+    for (int g = lo; g < hi; g++)
+    {
+        groupstart[g] = s;
+        s += groupcount[g];
+    }
+}
+
+// Indices of the visible particles in particle order, every group from its start. Opaque
+// points overdraw in list order, so keeping it keeps the picture from flickering.
+__kernel void cullwrite(__global const t_p *ps, const int np, const float16 m, __global const int *groupstart,
+                        __global uint *list, __local int *offset)
+{
+    int i = get_global_id(0);
+    int l = get_local_id(0);
+    int nl = get_local_size(0);
+
+    int v = cullvisible(ps, i, np, m);
+    offset[l] = v;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (l == 0)
+    {
+        int a = 0;
+        for (int k = 0; k < nl; k++)
+        {
+            int t = offset[k];
+            offset[k] = a;
+            a += t;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (v)
+        list[groupstart[get_group_id(0)] + offset[l]] = i;
+}
+
+// SPH constants, must match SphParams in particle.hpp
+typedef struct s_sph
+{
+    float h;         // smoothing length
+    float h2;        // h squared
+    float mass;      // particle mass
+    float rho0;      // rest density
+    float stiffness; // pressure per unit of density above rest
+    float viscosity; // viscosity coefficient
+    float poly6;     // density kernel normalisation
+    float spiky;     // pressure gradient normalisation
+    float visclap;   // viscosity laplacian normalisation
+    float cell;      // grid cell edge, at least h
+    float lo;        // grid origin on every axis
+    int g;           // cells per axis
+} t_sph;
+
+// Grid cell of a position, clamped so particles outside the grid land in the border cells
+int sphcellof(float x, float y, float z, const t_sph sph)
+{
+    int cx = clamp((int)floor((x - sph.lo) / sph.cell), 0, sph.g - 1);
+    int cy = clamp((int)floor((y - sph.lo) / sph.cell), 0, sph.g - 1);
+    int cz = clamp((int)floor((z - sph.lo) / sph.cell), 0, sph.g - 1);
+    return (cz * sph.g + cy) * sph.g + cx;
+}
+
+__kernel void sphcount(__global const t_p *ps, __global int *cellof, __global int *count, const t_sph sph)
+{
+    int i = get_global_id(0);
+
+    int c = sphcellof(ps[i].x, ps[i].y, ps[i].z, sph);
+    cellof[i] = c;
+    atomic_inc(&count[c]);
+}
+
+// One work group. Every item scans a contiguous run of cells, the per-item totals are
+// prefixed in local memory, then each item writes cell starts and the list of occupied cells.
+__kernel void sphscan(__global const int *count, __global int *start, __global int *cursor, __global int *occupied,
+                      __global int *noccupied, const int ncell, __local int *sums, __local int *cells)
+{
+    int l = get_local_id(0);
+    int nl = get_local_size(0);
+    int lo = (int)((long)ncell * l / nl);
+    int hi = (int)((long)ncell * (l + 1) / nl);
+
+    int s = 0, o = 0;
+    for (int c = lo; c < hi; c++)
+    {
+        s += count[c];
+        o += count[c] > 0;
+    }
+    sums[l] = s;
+    cells[l] = o;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (l == 0)
+    {
+        int a = 0, b = 0;
+        for (int k = 0; k < nl; k++)
+        {
+            int t = sums[k];
+            sums[k] = a;
+            a += t;
+            t = cells[k];
+            cells[k] = b;
+            b += t;
+        }
+        *noccupied = b;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    s = sums[l];
+    o = cells[l];
+    for (int c = lo; c < hi; c++)
+    {
+        start[c] = s;
+        cursor[c] = s;
+        if (count[c] > 0)
+            occupied[o++] = c;
+        s += count[c];
+    }
+}
+
+// Copy particles into cell order so the neighbour passes read contiguous memory
+__kernel void sphscatter(__global const t_p *ps, __global const int *cellof, __global int *cursor,
+                         __global t_p *sorted, __global int *perm)
+{
+    int i = get_global_id(0);
+
+    int k = atomic_inc(&cursor[cellof[i]]);
+    sorted[k] = ps[i];
+    perm[k] = i;
+}
+
+// One work group per occupied cell. The group walks the 27 neighbour cells together, staging
+// each in local memory, so a neighbour is read from global memory once per cell, not once per particle.
+__kernel void sphdensity(__global const t_p *sorted, __global const int *start, __global const int *count,
+                         __global const int *occupied, __global float *density, const t_sph sph,
+                         __local float4 *cache)
+{
+    int l = get_local_id(0);
+    int nl = get_local_size(0);
+    int cell = occupied[get_group_id(0)];
+    int cx = cell % sph.g, cy = cell / sph.g % sph.g, cz = cell / (sph.g * sph.g);
+    int s = start[cell], n = count[cell];
+
+    for (int ob = 0; ob < n; ob += nl)
+    {
+        int k = s + ob + l;
+        bool own = ob + l < n;
+        float px = 0, py = 0, pz = 0;
+        if (own)
+        {
+            px = sorted[k].x;
+            py = sorted[k].y;
+            pz = sorted[k].z;
+        }
+        float rho = 0;
+        for (int dz = -1; dz <= 1; dz++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    int nx = cx + dx, ny = cy + dy, nz = cz + dz;
+                    if (nx < 0 || ny < 0 || nz < 0 || nx >= sph.g || ny >= sph.g || nz >= sph.g)
+                        continue;
+                    int nc = (nz * sph.g + ny) * sph.g + nx;
+                    int ns = start[nc], nn = count[nc];
+                    for (int nb = 0; nb < nn; nb += nl)
+                    {
+                        if (nb + l < nn)
+                            cache[l] = (float4)(sorted[ns + nb + l].x, sorted[ns + nb + l].y, sorted[ns + nb + l].z, 0);
+                        barrier(CLK_LOCAL_MEM_FENCE);
+                        int m = min(nl, nn - nb);
+                        for (int j = 0; j < m && own; j++)
+                        {
+                            float rx = px - cache[j].x, ry = py - cache[j].y, rz = pz - cache[j].z;
+                            float d = sph.h2 - (rx * rx + ry * ry + rz * rz);
+                            if (d > 0)
+                                rho += d * d * d;
+                        }
+                        barrier(CLK_LOCAL_MEM_FENCE);
+                    }
+                }
+        if (own)
+            density[k] = sph.mass * sph.poly6 * rho;
+    }
+}
+
+// Pressure and viscosity, same grouping as sphdensity. Integrates the velocity of the
+// original particle, move then integrates the position as usual.
+__kernel void sphforce(__global t_p *ps, __global const t_p *sorted, __global const int *start,
+                       __global const int *count, __global const int *occupied, __global const int *perm,
+                       __global const float *density, const t_sph sph, __local float4 *cachep,
+                       __local float4 *cachev, __constant t_params *params)
+{
+    int l = get_local_id(0);
+    int nl = get_local_size(0);
+    int cell = occupied[get_group_id(0)];
+    int cx = cell % sph.g, cy = cell / sph.g % sph.g, cz = cell / (sph.g * sph.g);
+    int s = start[cell], n = count[cell];
+
+    for (int ob = 0; ob < n; ob += nl)
+    {
+        int k = s + ob + l;
+        bool own = ob + l < n;
+        float4 p = 0, v = 0;
+        float pi = 0;
+        if (own)
+        {
+            p = (float4)(sorted[k].x, sorted[k].y, sorted[k].z, density[k]);
+            v = (float4)(sorted[k].vx, sorted[k].vy, sorted[k].vz, 0);
+            pi = max(sph.stiffness * (p.w - sph.rho0), 0.0f) / (p.w * p.w);
+        }
+        float ax = 0, ay = 0, az = 0;
+        for (int dz = -1; dz <= 1; dz++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    int nx = cx + dx, ny = cy + dy, nz = cz + dz;
+                    if (nx < 0 || ny < 0 || nz < 0 || nx >= sph.g || ny >= sph.g || nz >= sph.g)
+                        continue;
+                    int nc = (nz * sph.g + ny) * sph.g + nx;
+                    int ns = start[nc], nn = count[nc];
+                    for (int nb = 0; nb < nn; nb += nl)
+                    {
+                        if (nb + l < nn)
+                        {
+                            int q = ns + nb + l;
+                            cachep[l] = (float4)(sorted[q].x, sorted[q].y, sorted[q].z, density[q]);
+                            cachev[l] = (float4)(sorted[q].vx, sorted[q].vy, sorted[q].vz, 0);
+                        }
+                        barrier(CLK_LOCAL_MEM_FENCE);
+                        int m = min(nl, nn - nb);
+                        for (int j = 0; j < m && own; j++)
+                        {
+                            float rx = p.x - cachep[j].x, ry = p.y - cachep[j].y, rz = p.z - cachep[j].z;
+                            float r2 = rx * rx + ry * ry + rz * rz;
+                            if (r2 >= sph.h2 || r2 < 1e-12f)
+                                continue;
+                            float r = sqrt(r2);
+                            float rhoj = cachep[j].w;
+                            float pj = max(sph.stiffness * (rhoj - sph.rho0), 0.0f) / (rhoj * rhoj);
+                            float fp = sph.mass * (pi + pj) * sph.spiky * (sph.h - r) * (sph.h - r) / r;
+                            float fv = sph.viscosity * sph.mass * sph.visclap * (sph.h - r) / rhoj;
+                            ax += fp * rx + fv * (cachev[j].x - v.x);
+                            ay += fp * ry + fv * (cachev[j].y - v.y);
+                            az += fp * rz + fv * (cachev[j].z - v.z);
+                        }
+                        barrier(CLK_LOCAL_MEM_FENCE);
+                    }
+                }
+        if (own)
+        {
+            int i = perm[k];
+            ps[i].vx += params->dt * ax;
+            ps[i].vy += params->dt * ay;
+            ps[i].vz += params->dt * az;
+        }
+    }
+}
+
+// One instance of an ensemble, must match Instance in particle.hpp
+typedef struct s_inst
+{
+    float x;     // mouse mass position
+    float y;
+    float z;
+    float att;   // attraction
+    int first;   // first attractor in the shared attractor array
+    int count;   // number of attractors
+    int shape;   // initial distribution, SH_* in rng.h
+    int seed;    // seed of the initial distribution
+} t_inst;
+
+// Instance owning packed particle i, offsets holds ninst + 1 instance starts
+int instanceof(int i, __global const int *offsets, int ninst)
+{
+    int lo = 0, hi = ninst;
+    while (hi - lo > 1)
+    {
+        int mid = (lo + hi) / 2;
+        if (offsets[mid] <= i)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// init per instance, with the instance's own shape and seed
+__kernel void ensembleinit(__global t_p *ps, __global const int *offsets, __global const t_inst *inst,
+                           const int ninst)
+{
+    int i = get_global_id(0);
+    int k = instanceof(i, offsets, ninst);
+
+    float pos[3];
+    rng_initpos(inst[k].shape, i - offsets[k], (uint)inst[k].seed, pos);
+    ps[i].x = pos[0];
+    ps[i].y = pos[1];
+    ps[i].z = pos[2];
+    ps[i].w = 0;
     ps[i].vx = 0;
     ps[i].vy = 0;
     ps[i].vz = 0;
+    ps[i].vw = 0;
+}
+
+// accelerate and move for every instance in one launch, each particle looks up its
+// instance's mass and attractors in the parameter table
+__kernel void ensemblestep(__global t_p *ps, __global const int *offsets, __global const t_inst *inst,
+                           __global const t_attr *attrs, const int ninst)
+{
+    int i = get_global_id(0);
+    t_inst p = inst[instanceof(i, offsets, ninst)];
+
+    float dx = p.x - ps[i].x;
+    float dy = p.y - ps[i].y;
+    float dz = p.z - ps[i].z;
+    float ir = sqrt(1.0f / (dx * dx + dy * dy + dz * dz + 0.00001f));
+    float ax = p.att * ir * dx;
+    float ay = p.att * ir * dy;
+    float az = p.att * ir * dz;
+    for (int j = p.first; j < p.first + p.count; j++)
+    {
+        dx = attrs[j].x - ps[i].x;
+        dy = attrs[j].y - ps[i].y;
+        dz = attrs[j].z - ps[i].z;
+        float r2 = dx * dx + dy * dy + dz * dz + 0.00001f;
+        float f = p.att * attrs[j].strength * rsqrt(r2) * pow(r2, -0.5f * attrs[j].falloff);
+        ax += f * dx;
+        ay += f * dy;
+        az += f * dz;
+    }
+    ps[i].vx += 0.2 * ax;
+    ps[i].vy += 0.2 * ay;
+    ps[i].vz += 0.2 * az;
+    ps[i].x += 0.2 * ps[i].vx;
+    ps[i].y += 0.2 * ps[i].vy;
+    ps[i].z += 0.2 * ps[i].vz;
+}
+
+// Sizes of the structs shared with the host, checked against particle.hpp by --selftest
+__kernel void layout(__global int *out)
+{
+    out[0] = sizeof(t_p);
+    out[1] = sizeof(t_mass);
+    out[2] = sizeof(t_attr);
+    out[3] = sizeof(t_stats);
+    out[4] = sizeof(t_sph);
+    out[5] = sizeof(t_inst);
+    out[6] = sizeof(t_params);
 }
@@ -0,0 +1,77 @@
+#include "particle.hpp"
+#include <random>
+using namespace std;
+
+static GLuint ebo;       // particle indices ordered by rank
+static GLuint query;     // GPU time of the last level-of-detail draw
+static bool pending;     // a query result is outstanding
+static double drawn = 0; // particles drawn, adapted to the frame-time budget
+
+// A fixed permutation gives every particle a rank that never changes, so drawing
+// the first K indices always picks the same particles and nothing flickers
+void lodinit()
+{
+    vector<GLuint> order(sim.n);
+    for (int i = 0; i < sim.n; i++)
+        order[i] = i;
+    mt19937 rng(0x9e3779b9);
+    for (int i = sim.n - 1; i > 0; i--)
+        swap(order[i], order[uniform_int_distribution<int>(0, i)(rng)]);
+
+    glBindVertexArray(g_bufs.vao);
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sim.n * sizeof(GLuint), order.data(), GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glGenQueries(1, &query);
+    drawn = sim.n;
+}
+
+// Number of particles to draw: at most lodppp per pixel, and within the budget when one is set
+int lodcount()
+{
+    double cap = min((double)sim.n, (double)opts.lodppp * W * H);
+    if (opts.lodbudget > 0 && pending)
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            GLuint64 ns;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+            pending = false;
+            // Move part way towards the count that would just meet the budget
+            double ratio = opts.lodbudget * 1e6 / max((double)ns, 1.0);
+            drawn *= min(max(ratio, 0.5), 2.0) * 0.25 + 0.75;
+        }
+    }
+    drawn = min(max(drawn, min(1000.0, cap)), cap);
+    return (int)drawn;
+}
+
+// Draw the first k particles by rank. Blended modes weight each particle by N / k to keep
+// the brightness of the full set, opaque points grow instead to keep the covered area.
+void loddraw(int k, bool opaque)
+{
+    if (opaque)
+        glPointSize(g_bufs.pt * min(sqrtf((float)sim.n / k), 4.0f));
+
+    bool timing = opts.lodbudget > 0 && !pending;
+    if (timing)
+        glBeginQuery(GL_TIME_ELAPSED, query);
+    glDrawElements(GL_POINTS, k, GL_UNSIGNED_INT, 0);
+    if (timing)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        pending = true;
+    }
+
+    if (opaque)
+        glPointSize(g_bufs.pt);
+}
+
+void lodend()
+{
+    glDeleteBuffers(1, &ebo);
+    glDeleteQueries(1, &query);
+}
@@ -6,18 +6,18 @@
 #include <sstream>
 using namespace std;
 
-GLFWwindow *window;
+GLFWwindow *window = nullptr;
 
-const unsigned int W = 1400; // window width
-const unsigned int H = 1400; // window height
-int N = 1000;                // number of particles
+unsigned int W = 1400;       // window width
+unsigned int H = 1400;       // window height
+SimulationContext sim;       // the simulation
+Options opts;                // command-line options
 
 int db;                // debug
 bool freezehue = 0;    // freeze hue
 bool go = 1;           // if the particles are moving
 bool explode = 0;      // if the particles are exploding
 bool newParticles = 0; // if new particles are being created
-bool circle = 0;       // if the particles are in a circle
 
 int nbFrames = 0; // number of frames
 double lastTime;  // last time to update FPS
@@ -63,104 +63,309 @@ void getmatrix(float *mat)
 {
     float t[16];
 
-    g_bufs.camx[5] = cos(mouse.y * PI);
-    g_bufs.camx[6] = sin(mouse.y * PI);
-    g_bufs.camx[9] = -sin(mouse.y * PI);
-    g_bufs.camx[10] = cos(mouse.y * PI);
-    g_bufs.camz[0] = cos(mouse.x * PI);
-    g_bufs.camz[2] = sin(mouse.x * PI);
-    g_bufs.camz[8] = -sin(mouse.x * PI);
-    g_bufs.camz[10] = cos(mouse.x * PI);
+    g_bufs.camx[5] = cos(sim.mouse.y * PI);
+    g_bufs.camx[6] = sin(sim.mouse.y * PI);
+    g_bufs.camx[9] = -sin(sim.mouse.y * PI);
+    g_bufs.camx[10] = cos(sim.mouse.y * PI);
+    g_bufs.camz[0] = cos(sim.mouse.x * PI);
+    g_bufs.camz[2] = sin(sim.mouse.x * PI);
+    g_bufs.camz[8] = -sin(sim.mouse.x * PI);
+    g_bufs.camz[10] = cos(sim.mouse.x * PI);
 
     // Use data() to get pointer to array contents
     mult(g_bufs.camz.data(), g_bufs.camx.data(), t);
     memcpy(mat, t, 16 * sizeof(float));
 }
 
-void loop()
+// Advance the simulation by one step
+void step()
 {
-    static int nPart = 0;               // number of particles
-    char buf[20];                       // buffer for FPS
-    double currentTime = glfwGetTime(); // current time
-    nbFrames++;                         // number of frames
-    if (currentTime - lastTime >= 1.0)  // update FPS every second
-    {
-        sprintf(buf, "%d FPS\n", nbFrames);
-        glfwSetWindowTitle(window, buf);
-        nbFrames = 0;
-        lastTime += 1.0;
-    }
-    keyholds(window);
+    TraceScope scope("step");
+    if (!opts.scenario.empty())
+        scenariopoll();
     if (!freezehue)
         hsv[0] += 0.001;
     if (hsv[0] > 1)
         hsv[0] -= 1;
-    if (go)
+    if (go && opts.chunk)
+        oocstep();
+    else if (go && opts.backend == BK_CPU)
+    {
+        cpustep(opts.headless ? nullptr : transferbegin());
+        if (!opts.headless)
+            statslaunch();
+    }
+    else if (go)
     {
         // Ensure GL is done
-        glFinish();
-        glFlush();
-
-        // Acquire GL objects
-        ret = clEnqueueAcquireGLObjects(command_queue, 1, &memobj, 0, nullptr, nullptr);
-        if (ret != CL_SUCCESS)
+        if (glshared())
         {
-            cout << RED << "Failed to acquire GL objects: " << ret << endl;
-            exit(1);
+            TraceScope wait("glFinish");
+            glFinish();
+            glFlush();
         }
 
+        // Acquire GL objects
+        clacquire("loop");
+
         // Execute kernels
         if (newParticles)
         {
-            clSetKernelArg(ker_gen, 1, sizeof(Mass), &mouse);
-            ret = clEnqueueNDRangeKernel(command_queue, ker_gen, 1, nullptr, &global_item_size, nullptr, 0, nullptr,
-                                         nullptr);
+            cl_uint s = nstep;
+            cl_ulong seed = opts.seed;
+            clSetKernelArg(sim.ker_gen, 1, sizeof(Mass), &sim.mouse);
+            clSetKernelArg(sim.ker_gen, 2, sizeof(cl_uint), &s);
+            clSetKernelArg(sim.ker_gen, 3, sizeof(cl_ulong), &seed);
+            ret = clEnqueueNDRangeKernel(command_queue, sim.ker_gen, 1, nullptr, &sim.global, nullptr, 0, nullptr,
+                                         traceev("gen"));
         }
 
-        if (!explode)
+        if (!explode && opts.blocklevels)
+            blockstep();
+        else if (!explode)
+            attraccelerate();
+
+        if (opts.sph)
+            sphstep();
+
+        // Block steps move the particles themselves
+        if (explode || !opts.blocklevels)
         {
-            clSetKernelArg(ker_acc, 1, sizeof(Mass), &mouse);
-            ret = clEnqueueNDRangeKernel(command_queue, ker_acc, 1, nullptr, &global_item_size, nullptr, 0, nullptr,
-                                         nullptr);
+            cl_uint s = nstep;
+            cl_ulong seed = opts.seed;
+            cl_int mixed = opts.mixed;
+            clSetKernelArg(sim.ker_move, 1, sizeof(Mass), &sim.mouse);
+            clSetKernelArg(sim.ker_move, 2, sizeof(cl_uint), &s);
+            clSetKernelArg(sim.ker_move, 3, sizeof(cl_ulong), &seed);
+            clSetKernelArg(sim.ker_move, 4, sizeof(cl_int), &mixed);
+            ret = clEnqueueNDRangeKernel(command_queue, sim.ker_move, 1, nullptr, &sim.global, nullptr, 0, nullptr,
+                                         traceev("move"));
         }
 
-        ret = clEnqueueNDRangeKernel(command_queue, ker_move, 1, nullptr, &global_item_size, nullptr, 0, nullptr,
-                                     nullptr);
-
         // Ensure CL is done
         clFinish(command_queue);
 
         // Release GL objects
-        ret = clEnqueueReleaseGLObjects(command_queue, 1, &memobj, 0, nullptr, nullptr);
-        if (ret != CL_SUCCESS)
-        {
-            cout << RED << "Failed to release GL objects: " << ret << endl;
-            exit(1);
-        }
+        clrelease("loop");
 
         // Final sync
         clFinish(command_queue);
+        simpublish();
+    }
+    if (go && opts.ranks)
+        domainstep();
+    if (go && !opts.shm.empty())
+        shmpublish();
+    if (go && opts.serve)
+        streampublish();
+    nstep++;
+    checkstate();
+    if (tracing)
+        tracecollect(false);
+}
+
+void siminit()
+{
+    sim.mouse.boundary = opts.boundary;
+    sim.mouse.box = opts.box;
+    // A rank makes only its own slab, and the backend is sized to it
+    if (opts.ranks)
+        domaininit();
+    if (opts.chunk)
+        oocinit();
+    else if (opts.backend == BK_CPU && !opts.ranks)
+        cpuinit();
+    else if (opts.backend == BK_CL)
+        clinit();
+    if (opts.sph)
+        sphinit();
+    if (opts.blocklevels)
+        blockinit();
+    if (!opts.headless)
+        statsinit();
+    if (opts.quantize)
+        quantinit();
+    if (opts.cull)
+        cullinit();
+    if (!opts.shm.empty())
+        shminit();
+    if (opts.serve)
+        streaminit();
+    simpublish();
+}
+
+void simend()
+{
+    if (tracing)
+        tracecollect(true);
+    if (opts.sph)
+        sphend();
+    if (opts.blocklevels)
+        blockend();
+    if (opts.serve)
+        streamend();
+    if (!opts.shm.empty())
+        shmend();
+    if (opts.cull)
+        cullend();
+    if (opts.quantize)
+        quantend();
+    if (!opts.headless)
+        statsend();
+    if (opts.ranks)
+        domainend();
+    if (opts.chunk)
+        oocend();
+    else if (opts.backend == BK_CL)
+        clend();
+}
+
+// Zoom the particles out or in by ticks wheel ticks, scaling positions and velocities
+void simzoom(bool out, int ticks)
+{
+    TraceScope scope("zoom");
+    // The domain scales with the particles
+    float f = out ? sim.params.zoomout : sim.params.zoomin;
+    for (int i = 0; i < ticks; i++)
+        sim.mouse.box *= f;
+    for (int i = 0; i < ticks && (opts.chunk || opts.backend == BK_CPU); i++)
+    {
+        if (opts.chunk)
+            ooczoom(out);
+        else
+            cpuzoom(out);
+    }
+    if (!opts.chunk && opts.backend == BK_CL)
+    {
+        clacquire("scroll");
+        for (int i = 0; i < ticks; i++)
+            ret = clEnqueueNDRangeKernel(command_queue, out ? sim.ker_zoomout : sim.ker_zoomin, 1, NULL, &sim.global,
+                                         &local_item_size, 0, NULL, traceev("zoom"));
+        clrelease("scroll");
+        clFinish(command_queue);
     }
+    simpublish();
+}
+
+// Put the particles back in their initial shape and recentre the camera
+void simreset()
+{
+    sim.mouse.box = opts.box;
+    if (opts.backend == BK_CL && !opts.chunk)
+    {
+        clReset();
+        simpublish();
+        return;
+    }
+    if (opts.ranks)
+        domaininit();
+    else if (opts.chunk)
+        oocreset();
+    else
+        cpuinit();
+    simpublish();
+    sim.mouse.z = 0;
+    g_bufs.trans[12] = 0;
+    g_bufs.trans[14] = -1.5;
+}
+
+// Copy the particle state to host memory
+void simread(Particle *dst)
+{
+    if (opts.chunk)
+        oocread(dst);
+    else if (opts.backend == BK_CPU)
+        cpuread(dst);
+    else
+    {
+        clacquire("read");
+        clEnqueueReadBuffer(command_queue, sim.particles, CL_TRUE, 0, sim.n * sizeof(Particle), dst, 0, NULL, NULL);
+        clrelease("read");
+        clFinish(command_queue);
+    }
+}
+
+// Make the newest state drawable when the VBO is not shared with OpenCL. The CPU backend
+// normally streams into the mapped buffer from cpustep, this covers state changed elsewhere.
+// A quantized VBO is rewritten from the device buffer every time, after the stats passes.
+void simpublish()
+{
+    TraceScope scope("publish");
+    if (!opts.headless)
+        statslaunch();
+    if (opts.quantize)
+        quantpublish();
+    if (opts.headless || opts.transfer != TR_MAPPED)
+        return;
+    simread(transferbegin());
+}
+
+void loop()
+{
+    char buf[80];                       // buffer for FPS
+    double currentTime = glfwGetTime(); // current time
+    nbFrames++;                         // number of frames
+    if (currentTime - lastTime >= 1.0)  // update FPS every second
+    {
+        const Stats &s = statsget();
+        sprintf(buf, "%d FPS  KE %.3g  vmax %.3g", nbFrames, 0.5 * s.sum[3] / sim.n, sqrt(s.vmax[0]));
+        glfwSetWindowTitle(window, buf);
+        nbFrames = 0;
+        lastTime += 1.0;
+    }
+    TraceScope scope("frame");
+    keyholds(window);
+    inputapply();
+    step();
+    render();
+    transferfence();
+    TraceScope swap("swap");
+    glfwSwapBuffers(window); // swap the buffers
+}
+
+// Model-view-projection matrix the particles are drawn with
+void viewmatrix(float *mat)
+{
     float tmp[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}; // identity matrix
     if (!go)
         getmatrix(tmp);
+    if (opts.autoframe)
+        statsframe(tmp);
     float tmp2[16];
 
     // Use data() to get pointers for array contents
     mult(tmp, g_bufs.trans.data(), tmp2); // multiply the transformation matrix with the identity matrix
-    mult(tmp2, g_bufs.p.data(), tmp);     // multiply the projection matrix with the transformation matrix
+    mult(tmp2, g_bufs.p.data(), mat);     // multiply the projection matrix with the transformation matrix
+}
+
+// Draw the particles into the current framebuffer
+void render()
+{
+    TraceScope scope("render");
+    float tmp[16];
+    viewmatrix(tmp);
+    if (opts.density)
+    {
+        densityrender(tmp);
+        return;
+    }
 
     glUniformMatrix4fv(g_bufs.mat, 1, GL_FALSE, &tmp[0]); // set the matrix for the shader
-    glUniform1f(g_bufs.mx, mouse.x);                      // set the mouse x for the shader
-    glUniform1f(g_bufs.my, mouse.y);                      // set the mouse y for the shader
+    glUniform1f(g_bufs.mx, sim.mouse.x);                  // set the mouse x for the shader
+    glUniform1f(g_bufs.my, sim.mouse.y);                  // set the mouse y for the shader
     glUniform3f(g_bufs.hsv, hsv[0], hsv[1], hsv[2]);      // set the hue, saturation, value for the shader
+    quantuniforms(g_bufs.scale, g_bufs.offset);           // decode of quantized positions
 
     glClearColor(g_bufs.bl, g_bufs.bl, g_bufs.bl, 1.0f); // set the clear color for the shader
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);  // clear the screen
     glBindVertexArray(g_bufs.vao);                       // bind the vertex array
-    glDrawArrays(GL_TRIANGLES, 0, N);                    // draw the particles
+    if (opts.lod)
+        loddraw(lodcount(), true); // draw the level-of-detail subset
+    else if (opts.cull)
+        culldraw(tmp); // draw the particles in view
+    else
+        glDrawArrays(GL_POINTS, 0, sim.n); // draw the particles
     glBindVertexArray(g_bufs.vao);                       // bind the vertex array
-    glfwSwapBuffers(window);                             // swap the buffers
 }
 
 void signal_handler(int signum)
@@ -183,40 +388,402 @@ void signal_handler(int signum)
     exit(1);
 }
 
+void usage()
+{
+    printf(ORANGE);
+    printf("Usage: ./particle_system number of particles [-s] [options]\n");
+    printf("\t\t250 <= number of particles <= 5000000, 1000000000 with --chunk\n");
+    printf("\t--seed n\t\tseed the random number generator\n");
+    printf("\t--init shape\t\tcube, disk (same as -s), plummer or shells\n");
+    printf("\t--record file\t\trecord input events to file\n");
+    printf("\t--replay file\t\treplay recorded input without a window\n");
+    printf("\t--headless\t\trun without a window\n");
+    printf("\t--steps n\t\tnumber of steps to run without a window\n");
+    printf("\t--hashes file\t\twrite a hash of the particle state after every step\n");
+    printf("\t--verify file\t\tcheck the particle state against recorded hashes\n");
+    printf("\t--offscreen\t\trender without a window as fast as possible\n");
+    printf("\t--size WxH\t\tsize of the window or offscreen frames\n");
+    printf("\t--out pattern\t\twrite offscreen frames as images, e.g. frames/%%05d.ppm\n");
+    printf("\t--pipe command\t\tpipe raw RGB offscreen frames to an encoder\n");
+    printf("\t--cpu-render\t\trasterize on the CPU, frames go to --out (.ppm or .png)\n");
+    printf("\t--density\t\taccumulate particle density and tone map it\n");
+    printf("\t--exposure k\t\texposure of the density tone mapping\n");
+    printf("\t--lod ppp\t\tdraw at most ppp particles per pixel, a stable random subset\n");
+    printf("\t--lod-budget ms\t\tshrink the subset to keep drawing within ms\n");
+    printf("\t--backend cl|cpu\tsimulate with OpenCL or with native threads\n");
+    printf("\t--transfer interop|mapped\tshare the VBO with OpenCL or copy into a mapped VBO\n");
+    printf("\t--sph\t\t\tadd fluid pressure and viscosity between particles\n");
+    printf("\t--sph-stiffness k\tSPH pressure stiffness\n");
+    printf("\t--sph-viscosity mu\tSPH viscosity\n");
+    printf("\t--ensemble spec\t\trun every instance of an ensemble spec file in one launch per step\n");
+    printf("\t--block-steps L\t\tsubstep fast particles down to 1/2^L of the step\n");
+    printf("\t--quantize\t\tdraw 16-bit positions relative to the frame's bounding box\n");
+    printf("\t--cull\t\t\tdraw only the particles in view, listed and counted on the device\n");
+    printf("\t--autoframe\t\tkeep the camera on the particles\n");
+    printf("\t--chunk n\t\tkeep the particles on the host, stream n at a time through the device\n");
+    printf("\t--state file\t\tkeep out-of-core particles in a mapped file, continued if it fits\n");
+    printf("\t--shm name\t\tpublish every frame's positions in shared memory, see shmreader.hpp\n");
+    printf("\t--shm-velocities\tpublish the velocities too\n");
+    printf("\t--serve port\t\tstream frames to WebSocket or TCP clients on 127.0.0.1:port\n");
+    printf("\t--serve-sample n\tmost particles in a streamed frame\n");
+    printf("\t--ranks n\t\tsplit the particles into x slabs over n processes (cpu backend or --chunk)\n");
+    printf("\t--rank-transport shm|socket\thow the ranks trade particles\n");
+    printf("\t--trace file\t\twrite a Chrome trace of host scopes and device commands at exit\n");
+    printf("\t--boundary mode\t\tnone, periodic, reflect or recycle (back to the mouse) at the domain faces\n");
+    printf("\t--box L\t\t\thalf-width of the domain, 1.5 by default\n");
+    printf("\t--mixed-precision\tkeep 10 more bits of every coordinate, drifted exactly\n");
+    printf("\t--scenario file\t\tread settings from file and apply its changes while running\n");
+    printf("\t--selftest\t\tcheck every kernel against a double reference on 1000 and n particles, and time them\n");
+    exit(1);
+}
+
+// Whether snprintf can take an --out pattern with the frame number: %% for a percent sign and
+// at most one %d, with an optional zero-pad and width
+static bool outpattern(const string &pattern)
+{
+    int conversions = 0;
+    for (size_t i = 0; i < pattern.size(); i++)
+    {
+        if (pattern[i] != '%')
+            continue;
+        if (pattern[++i] == '%')
+            continue;
+        while (isdigit((unsigned char)pattern[i]))
+            i++;
+        if (pattern[i] != 'd' || ++conversions > 1)
+            return false;
+    }
+    return true;
+}
+
+void parseargs(int ac, char **av)
+{
+    bool count = false;      // the particle count was given
+    bool scenecount = false; // or set by the scenario
+    for (int i = 1; i < ac; i++)
+    {
+        std::string arg = av[i];
+        bool more = i + 1 < ac;
+        if (arg == "-s")
+            opts.shape = SH_DISK;
+        else if (arg == "--init" && more)
+        {
+            const char *shapes[] = {"cube", "disk", "plummer", "shells"};
+            std::string name = av[++i];
+            opts.shape = -1;
+            for (int s = 0; s < 4; s++)
+                if (name == shapes[s])
+                    opts.shape = s;
+            if (opts.shape < 0)
+                usage();
+        }
+        else if (arg == "--seed" && more)
+            opts.seed = strtoul(av[++i], nullptr, 10);
+        else if (arg == "--record" && more)
+            opts.record = av[++i];
+        else if (arg == "--replay" && more)
+            opts.replay = av[++i];
+        else if (arg == "--headless")
+            opts.headless = true;
+        else if (arg == "--steps" && more)
+            opts.steps = atol(av[++i]);
+        else if (arg == "--hashes" && more)
+            opts.hashes = av[++i];
+        else if (arg == "--verify" && more)
+            opts.verify = av[++i];
+        else if (arg == "--offscreen")
+            opts.offscreen = true;
+        else if (arg == "--size" && more)
+        {
+            if (sscanf(av[++i], "%ux%u", &W, &H) != 2)
+                usage();
+        }
+        else if (arg == "--out" && more)
+            opts.out = av[++i];
+        else if (arg == "--pipe" && more)
+            opts.pipe = av[++i];
+        else if (arg == "--cpu-render")
+            opts.cpurender = true;
+        else if (arg == "--density")
+            opts.density = true;
+        else if (arg == "--exposure" && more)
+            opts.exposure = atof(av[++i]);
+        else if (arg == "--lod" && more)
+        {
+            opts.lod = true;
+            opts.lodppp = atof(av[++i]);
+            if (!(opts.lodppp > 0))
+                usage();
+        }
+        else if (arg == "--lod-budget" && more)
+        {
+            opts.lod = true;
+            opts.lodbudget = atof(av[++i]);
+            if (!(opts.lodbudget >= 0))
+                usage();
+        }
+        else if (arg == "--sph")
+            opts.sph = true;
+        else if (arg == "--sph-stiffness" && more)
+        {
+            opts.sph = true;
+            opts.sphk = atof(av[++i]);
+        }
+        else if (arg == "--sph-viscosity" && more)
+        {
+            opts.sph = true;
+            opts.sphmu = atof(av[++i]);
+        }
+        else if (arg == "--ensemble" && more)
+            opts.ensemble = av[++i];
+        else if (arg == "--block-steps" && more)
+        {
+            opts.blocklevels = atoi(av[++i]);
+            if (opts.blocklevels < 0 || opts.blocklevels > 10)
+                usage();
+        }
+        else if (arg == "--chunk" && more)
+        {
+            opts.chunk = atoi(av[++i]);
+            if (opts.chunk < 1)
+                usage();
+        }
+        else if (arg == "--shm" && more)
+            opts.shm = av[++i];
+        else if (arg == "--shm-velocities")
+            opts.shmvel = true;
+        else if (arg == "--serve" && more)
+        {
+            opts.serve = atoi(av[++i]);
+            if (opts.serve < 1 || opts.serve > 65535)
+                usage();
+        }
+        else if (arg == "--trace" && more)
+            opts.trace = av[++i];
+        else if (arg == "--boundary" && more)
+        {
+            const char *modes[] = {"none", "periodic", "reflect", "recycle"};
+            std::string name = av[++i];
+            opts.boundary = -1;
+            for (int m = 0; m < 4; m++)
+                if (name == modes[m])
+                    opts.boundary = m;
+            if (opts.boundary < 0)
+                usage();
+        }
+        else if (arg == "--box" && more)
+        {
+            opts.box = atof(av[++i]);
+            if (!(opts.box > 0))
+                usage();
+        }
+        else if (arg == "--mixed-precision")
+            opts.mixed = true;
+        else if (arg == "--selftest")
+            opts.selftest = true;
+        else if (arg == "--scenario" && more)
+        {
+            opts.scenario = av[++i];
+            scenecount = scenarioload(opts.scenario) || scenecount;
+        }
+        else if (arg == "--ranks" && more)
+        {
+            opts.ranks = atoi(av[++i]);
+            if (opts.ranks < 2 || opts.ranks > 32)
+                usage();
+        }
+        else if (arg == "--rank-transport" && more)
+        {
+            std::string t = av[++i];
+            if (t != "shm" && t != "socket")
+                usage();
+            opts.ranksockets = t == "socket";
+        }
+        else if (arg == "--serve-sample" && more)
+        {
+            opts.servemax = atoi(av[++i]);
+            if (opts.servemax < 1)
+                usage();
+        }
+        else if (arg == "--state" && more)
+            opts.state = av[++i];
+        else if (arg == "--cull")
+            opts.cull = true;
+        else if (arg == "--autoframe")
+            opts.autoframe = true;
+        else if (arg == "--quantize")
+            opts.quantize = true;
+        else if (arg == "--backend" && more)
+        {
+            std::string b = av[++i];
+            if (b != "cl" && b != "cpu")
+                usage();
+            opts.backend = b == "cpu" ? BK_CPU : BK_CL;
+        }
+        else if (arg == "--transfer" && more)
+        {
+            std::string t = av[++i];
+            if (t != "interop" && t != "mapped")
+                usage();
+            opts.transfer = t == "mapped" ? TR_MAPPED : TR_INTEROP;
+        }
+        else if (!count && isdigit(arg[0]))
+        {
+            sim.n = atoi(av[i]);
+            count = true;
+        }
+        else
+            usage();
+    }
+
+    // The replay log carries the particle count, initial shape and seed of the recorded run
+    if (!opts.replay.empty())
+        replayload(opts.replay);
+    else if (!count && !scenecount && opts.ensemble.empty() && !opts.selftest)
+        usage();
+    if (!count && !scenecount && opts.selftest)
+        sim.n = 1 << 20;
+    if (sim.n < 250 || sim.n > (opts.chunk ? 1000000000 : 5000000) || W < 16 || H < 16)
+        usage();
+    if (!outpattern(opts.out))
+    {
+        cout << RED << "--out takes at most one %d for the frame number, as in frames/%05d.ppm: " << opts.out
+             << endl;
+        exit(1);
+    }
+
+    // Replays run without a window unless they are rendered offscreen
+    if ((!opts.replay.empty() && !opts.offscreen) || opts.cpurender)
+        opts.headless = true;
+    if (opts.offscreen && !opts.cpurender)
+        opts.headless = false;
+
+    // There is no GL buffer to share with the CPU backend
+    if (opts.transfer < 0)
+        opts.transfer = opts.backend == BK_CPU ? TR_MAPPED : TR_INTEROP;
+    if (opts.backend == BK_CPU && opts.transfer == TR_INTEROP)
+        usage();
+    // Block steps advance particles independently, SPH couples them
+    if (opts.blocklevels && opts.sph)
+        usage();
+    // Ensembles are an OpenCL sweep without a window
+    if (!opts.ensemble.empty() && opts.backend != BK_CL)
+        usage();
+    if (!opts.ensemble.empty())
+        opts.headless = true;
+    if (opts.shmvel && opts.shm.empty())
+        usage();
+    if ((opts.serve || opts.boundary || opts.mixed || !opts.scenario.empty()) && !opts.ensemble.empty())
+        usage();
+    // Out of core is an offline OpenCL mode of attractor gravity, there is no VBO for the set
+    if (!opts.state.empty() && !opts.chunk)
+        usage();
+    if (opts.chunk && (opts.backend != BK_CL || opts.sph || opts.blocklevels || opts.offscreen))
+        usage();
+    if (opts.chunk)
+        opts.headless = true;
+    // Ranks trade host-resident particles and only feel the attractors, rank 0 does the I/O
+    bool io = !opts.shm.empty() || opts.serve || !opts.hashes.empty() || !opts.verify.empty();
+    if (opts.ranks && ((opts.backend != BK_CPU && !opts.chunk) || opts.sph || !opts.state.empty() || io ||
+                       opts.offscreen || opts.cpurender || !opts.ensemble.empty()))
+        usage();
+    if (opts.ranks)
+        opts.headless = true;
+    // Quantization is an OpenCL pass into the shared VBO, and pointless without drawing
+    if (opts.quantize && (opts.backend != BK_CL || opts.transfer != TR_INTEROP))
+        usage();
+    // Culling lists particles into GL buffers written by OpenCL, for the plain point draw
+    if (opts.cull && (opts.backend != BK_CL || opts.transfer != TR_INTEROP || opts.lod || opts.density))
+        usage();
+    if (opts.headless)
+    {
+        opts.quantize = false;
+        opts.cull = false;
+    }
+}
+
 int main(int ac, char **av)
 {
     // Register signal handler
     signal(SIGSEGV, signal_handler);
 
     lastTime = glfwGetTime();
-    if (ac == 3 && !strcmp(av[2], "-s"))
-        circle = 1;
-    if (ac >= 2)
-        N = atoi(av[1]);
-    if (N < 250 || N > 5000000 || ac > 3 || ac == 1)
-    {
-        printf(ORANGE);
-        printf("Usage: ./particle_system number of particles [-s]\n");
-        printf("\t\t250 <= number of particles <= 5000000\n");
-        exit(1);
-    }
+    parseargs(ac, av);
+    if (!opts.trace.empty())
+        traceinit();
+    if (opts.selftest)
+        return selftest();
 
     // initialize the random number generator
-    srand(time(NULL));
+    if (!opts.seed)
+        opts.seed = time(NULL);
+    srand(opts.seed);
+    cout << YELLO << "Seed: " << opts.seed << endl;
+    if (opts.ranks)
+        domainfork();
+    if (!opts.record.empty())
+        recordopen(opts.record);
+
+    if (!opts.ensemble.empty())
+    {
+        ensembleload(opts.ensemble);
+        getcontext();
+        ensemblerun();
+        return (0);
+    }
+
+    if (opts.headless)
+    {
+        if (opts.backend == BK_CL)
+            getcontext();
+        try
+        {
+            siminit();
+        }
+        catch (const std::exception &e)
+        {
+            cout << RED << "OpenCL initialization failed: " << e.what() << endl;
+            exit(1);
+        }
+        if (opts.cpurender)
+            softrun();
+        else
+            replayrun();
+        simend();
+        return (0);
+    }
+
+    if (opts.offscreen)
+    {
+        eglinit();
+        try
+        {
+            siminit();
+        }
+        catch (const std::exception &e)
+        {
+            cout << RED << "OpenCL initialization failed: " << e.what() << endl;
+            eglend();
+            exit(1);
+        }
+        offscreenrun();
+        simend();
+        eglend();
+        return (0);
+    }
 
     // Initialize OpenGL first and ensure it's successful
     glinit();
-
     // Ensure GL context is current
     glfwMakeContextCurrent(window);
 
     // Force a sync point
     glFinish();
 
-    // Now initialize OpenCL
+    // Now initialize the simulation
     try
     {
-        clinit();
+        siminit();
     }
     catch (const std::exception &e)
     {
@@ -231,8 +798,8 @@ int main(int ac, char **av)
         glfwPollEvents();
     }
 
-    // end the OpenCL and OpenGL
-    clend();
+    // end the simulation and OpenGL
+    simend();
     glend();
     return (0);
 }
@@ -0,0 +1,300 @@
+// zlib first, zconf.h defines an empty FAR that would clash with the one in particle.hpp
+#include <zlib.h>
+#undef FAR
+
+#include "particle.hpp"
+#include <EGL/eglext.h>
+#include <chrono>
+using namespace std;
+
+EGLDisplay egldisplay = EGL_NO_DISPLAY; // EGL display for offscreen rendering
+EGLContext eglcontext = EGL_NO_CONTEXT; // EGL context for offscreen rendering
+
+static EGLSurface eglsurface = EGL_NO_SURFACE; // 1x1 pbuffer, we only ever draw into the FBO
+
+static const int NPBO = 3;  // frames in flight between render and readback
+static GLuint fbo;          // offscreen framebuffer
+static GLuint rbo[2];       // colour and depth renderbuffers
+static GLuint pbo[NPBO];    // pixel pack buffers the frames are read back into
+static GLsync fences[NPBO]; // signalled when the readback into a pbo is done
+static FILE *encoder;       // encoder process fed raw frames
+static long written = 0;    // frames handed to the encoder or written out
+
+// Write a bottom-up RGB frame as a binary PPM
+void writeppm(const std::string &path, int w, int h, const unsigned char *rgb)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        cout << RED << "Failed to open " << path << endl;
+        exit(1);
+    }
+    fprintf(file, "P6\n%d %d\n255\n", w, h);
+    for (int y = h - 1; y >= 0; y--)
+        fwrite(rgb + (size_t)y * w * 3, 1, (size_t)w * 3, file);
+    fclose(file);
+}
+
+static void pngchunk(FILE *file, const char *type, const unsigned char *data, uint32_t len)
+{
+    unsigned char be[4] = {(unsigned char)(len >> 24), (unsigned char)(len >> 16), (unsigned char)(len >> 8),
+                           (unsigned char)len};
+    fwrite(be, 1, 4, file);
+    fwrite(type, 1, 4, file);
+    uLong crc = crc32(0, (const Bytef *)type, 4);
+    if (len)
+    {
+        fwrite(data, 1, len, file);
+        crc = crc32(crc, data, len);
+    }
+    unsigned char becrc[4] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8),
+                              (unsigned char)crc};
+    fwrite(becrc, 1, 4, file);
+}
+
+// Write a bottom-up RGB frame as an 8-bit PNG
+void writepng(const std::string &path, int w, int h, const unsigned char *rgb)
+{
+    // Every scanline starts with filter type 0, rows go top-down
+    size_t stride = (size_t)w * 3;
+    std::vector<unsigned char> raw((stride + 1) * h);
+    for (int y = 0; y < h; y++)
+    {
+        raw[y * (stride + 1)] = 0;
+        memcpy(&raw[y * (stride + 1) + 1], rgb + (size_t)(h - 1 - y) * stride, stride);
+    }
+    uLongf zlen = compressBound(raw.size());
+    std::vector<unsigned char> z(zlen);
+    compress2(z.data(), &zlen, raw.data(), raw.size(), 6);
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        cout << RED << "Failed to open " << path << endl;
+        exit(1);
+    }
+    const unsigned char sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    unsigned char ihdr[13] = {(unsigned char)(w >> 24), (unsigned char)(w >> 16), (unsigned char)(w >> 8),
+                              (unsigned char)w,         (unsigned char)(h >> 24), (unsigned char)(h >> 16),
+                              (unsigned char)(h >> 8),  (unsigned char)h,         8,
+                              2,                        0,                        0,
+                              0};
+    fwrite(sig, 1, 8, file);
+    pngchunk(file, "IHDR", ihdr, 13);
+    pngchunk(file, "IDAT", z.data(), zlen);
+    pngchunk(file, "IEND", nullptr, 0);
+    fclose(file);
+}
+
+// Pick the format from the extension, PPM unless it ends in .png
+void writeimage(const std::string &path, int w, int h, const unsigned char *rgb)
+{
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".png") == 0)
+        writepng(path, w, h, rgb);
+    else
+        writeppm(path, w, h, rgb);
+}
+
+// Surfaceless Mesa display if there is one, the default display otherwise
+static EGLDisplay getdisplay()
+{
+    auto getplatformdisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getplatformdisplay)
+    {
+        EGLDisplay display = getplatformdisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr))
+            return display;
+    }
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr))
+    {
+        cout << RED << "Failed to initialize EGL" << endl;
+        exit(1);
+    }
+    return display;
+}
+
+void eglinit()
+{
+    egldisplay = getdisplay();
+    eglBindAPI(EGL_OPENGL_API);
+
+    // Pbuffer config if available, surfaceless displays may not offer any
+    EGLint attribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_RED_SIZE, 8,
+                        EGL_GREEN_SIZE,   8,               EGL_BLUE_SIZE,       8,              EGL_NONE};
+    EGLConfig config;
+    EGLint nconfig = 0;
+    eglChooseConfig(egldisplay, attribs, &config, 1, &nconfig);
+    if (!nconfig)
+    {
+        attribs[1] = 0;
+        eglChooseConfig(egldisplay, attribs, &config, 1, &nconfig);
+    }
+    if (!nconfig)
+    {
+        cout << RED << "No EGL config with OpenGL support" << endl;
+        exit(1);
+    }
+    if (attribs[1])
+    {
+        EGLint pbattribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        eglsurface = eglCreatePbufferSurface(egldisplay, config, pbattribs);
+    }
+
+    EGLint ctxattribs[] = {EGL_CONTEXT_MAJOR_VERSION,
+                           3,
+                           EGL_CONTEXT_MINOR_VERSION,
+                           3,
+                           EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                           EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                           EGL_NONE};
+    eglcontext = eglCreateContext(egldisplay, config, EGL_NO_CONTEXT, ctxattribs);
+    if (eglcontext == EGL_NO_CONTEXT || !eglMakeCurrent(egldisplay, eglsurface, eglsurface, eglcontext))
+    {
+        cout << RED << "Failed to create EGL context" << endl;
+        exit(1);
+    }
+
+    // Initialize GLEW
+    glewExperimental = GL_TRUE;
+    GLenum err = glewInit();
+    if (err != GLEW_OK)
+    {
+        cout << RED << "Failed to initialize GLEW: " << glewGetErrorString(err) << endl;
+        exit(1);
+    }
+    glGetError();
+
+    cout << YELLO << "OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    cout << YELLO << "OpenGL Renderer: " << glGetString(GL_RENDERER) << endl;
+
+    glbuffers();
+
+    // Framebuffer at the requested resolution
+    glGenRenderbuffers(2, rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, rbo[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, W, H);
+    glBindRenderbuffer(GL_RENDERBUFFER, rbo[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, W, H);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbo[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << RED << "Offscreen framebuffer is incomplete" << endl;
+        exit(1);
+    }
+    glViewport(0, 0, W, H);
+
+    // Ring of pack buffers so a frame is mapped only once its readback has finished
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGenBuffers(NPBO, pbo);
+    for (int i = 0; i < NPBO; i++)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)W * H * 3, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (!opts.pipe.empty())
+    {
+        encoder = popen(opts.pipe.c_str(), "w");
+        if (!encoder)
+        {
+            cout << RED << "Failed to start encoder: " << opts.pipe << endl;
+            exit(1);
+        }
+    }
+}
+
+// Wait for the readback in a pbo and hand the frame to the encoder or an image file
+static void emit(int slot)
+{
+    while (glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+        ;
+    glDeleteSync(fences[slot]);
+    fences[slot] = 0;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[slot]);
+    auto rgb = (const unsigned char *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (size_t)W * H * 3, GL_MAP_READ_BIT);
+    if (rgb && encoder)
+    {
+        for (int y = H - 1; y >= 0; y--)
+            fwrite(rgb + (size_t)y * W * 3, 1, (size_t)W * 3, encoder);
+    }
+    else if (rgb && !opts.out.empty())
+    {
+        char path[1024];
+        snprintf(path, sizeof(path), opts.out.c_str(), (int)written);
+        writeimage(path, W, H, rgb);
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    written++;
+}
+
+// Start the readback of the frame just drawn, and emit the oldest one still in flight
+static void capture(long frame)
+{
+    int slot = frame % NPBO;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[slot]);
+    glReadPixels(0, 0, W, H, GL_RGB, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    if (frame >= NPBO - 1)
+        emit((frame + 1) % NPBO);
+}
+
+// Render a fixed number of frames as fast as the hardware allows
+void offscreenrun()
+{
+    long frames = opts.steps ? opts.steps : replaylength();
+    if (!frames)
+        frames = 600;
+    bool output = encoder || !opts.out.empty();
+
+    auto start = chrono::steady_clock::now();
+    for (long frame = 0; frame < frames; frame++)
+    {
+        replayfeed();
+        inputapply();
+        step();
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        render();
+        transferfence();
+        if (output)
+            capture(frame);
+    }
+
+    // Drain the frames still in flight, oldest first
+    for (long frame = max(frames - NPBO + 1, 0L); output && frame < frames; frame++)
+        emit(frame % NPBO);
+    glFinish();
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << GREEN << frames << " frames at " << W << "x" << H << " in " << secs << " s (" << frames / secs
+         << " FPS)" << endl;
+}
+
+void eglend()
+{
+    if (encoder)
+        pclose(encoder);
+    transferend();
+    if (opts.density)
+        densityend();
+    if (opts.lod)
+        lodend();
+    glDeleteBuffers(NPBO, pbo);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(2, rbo);
+    glDeleteVertexArrays(1, &g_bufs.vao);
+    glDeleteBuffers(1, &g_bufs.vbo);
+    glDeleteProgram(g_bufs.shaders);
+    eglMakeCurrent(egldisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(egldisplay, eglcontext);
+    if (eglsurface != EGL_NO_SURFACE)
+        eglDestroySurface(egldisplay, eglsurface);
+    eglTerminate(egldisplay);
+}
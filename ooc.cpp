@@ -0,0 +1,255 @@
+#include "particle.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+static const int NRING = 3; // device chunk buffers, one uploading, one computing, one downloading
+
+static Particle *state = nullptr;         // every particle, in host memory or a mapped file
+static vector<Particle> owned;            // backing of state without a file
+static size_t mapped = 0;                 // bytes mapped from opts.state, 0 without a file
+static cl_command_queue upload, download; // transfer queues, the kernels stay on command_queue
+static cl_mem ring[NRING];                // device chunk buffers
+static cl_event downloaded[NRING];        // the last read out of each ring buffer
+
+// Initial shape on the host, rng_initpos gives the same positions as the init kernel
+static void oocfill()
+{
+    parallel(sim.n, [](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            rng_initpos(opts.shape, i, opts.seed, state[i].pos);
+            state[i].pos[3] = 0;
+            state[i].vel[0] = state[i].vel[1] = state[i].vel[2] = state[i].vel[3] = 0;
+        }
+    });
+}
+
+// Map the state file, returns whether it already held this many particles to continue from.
+// A new or empty file is sized for the run, one of another size is left alone.
+static bool oocmap()
+{
+    size_t size = (size_t)sim.n * sizeof(Particle);
+    int fd = open(opts.state.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        cout << RED << "Failed to open particle state file " << opts.state << endl;
+        exit(1);
+    }
+    bool resume = (size_t)st.st_size == size;
+    if (!resume && st.st_size)
+    {
+        cout << RED << opts.state << " holds " << st.st_size / sizeof(Particle) << " particles, not " << sim.n
+             << ": run with that many or remove the file" << endl;
+        exit(1);
+    }
+    if (!resume && ftruncate(fd, size))
+    {
+        cout << RED << "Failed to size " << opts.state << " for " << sim.n << " particles" << endl;
+        exit(1);
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        cout << RED << "Failed to map " << opts.state << endl;
+        exit(1);
+    }
+    state = (Particle *)p;
+    mapped = size;
+    return resume;
+}
+
+static cl_kernel oockernel(const char *name)
+{
+    cl_kernel k = clCreateKernel(program, name, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create " << name << " kernel: " << ret << endl;
+        exit(1);
+    }
+    return k;
+}
+
+void oocinit()
+{
+    // With --ranks, domaininit has already put this rank's slab in host memory
+    bool resume = false;
+    if (!opts.state.empty())
+        resume = oocmap();
+    else if (!opts.ranks)
+    {
+        owned.resize(sim.n);
+        state = owned.data();
+    }
+    if (resume)
+        cout << YELLO << "Continuing from the particles in " << opts.state << endl;
+    else if (!opts.ranks)
+        oocfill();
+
+    clprogram();
+    upload = clCreateCommandQueueWithProperties(context, device_id, traceprops(), &ret);
+    download = clCreateCommandQueueWithProperties(context, device_id, traceprops(), &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create transfer queues: " << ret << endl;
+        exit(1);
+    }
+    tracequeue(upload, "upload");
+    tracequeue(download, "download");
+    for (int k = 0; k < NRING; k++)
+    {
+        ring[k] = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)opts.chunk * sizeof(Particle), NULL, &ret);
+        if (ret != CL_SUCCESS)
+        {
+            cout << RED << "Failed to create chunk buffer: " << ret << endl;
+            exit(1);
+        }
+    }
+    sim.ker_acc = oockernel("accelerate");
+    sim.ker_move = oockernel("move");
+    sim.ker_gen = oockernel("gen");
+    cl_mem params = paramsbuffer();
+    clSetKernelArg(sim.ker_acc, 5, sizeof(cl_mem), &params);
+    clSetKernelArg(sim.ker_move, 5, sizeof(cl_mem), &params);
+    cout << YELLO << "Out of core: " << (sim.n + opts.chunk - 1) / opts.chunk << " chunks of " << opts.chunk
+         << " particles" << endl;
+}
+
+// One step over the chunks. A chunk goes up on the upload queue, is computed on the main
+// queue once it has arrived and comes back on the download queue, so with three ring
+// buffers the transfers of the neighbouring chunks overlap its compute. Particles only
+// feel the mouse and the attractors, so the chunks are independent within a step.
+void oocstep()
+{
+    TraceScope scope("chunks");
+    for (size_t first = 0, k = 0; first < (size_t)sim.n; first += opts.chunk, k++)
+    {
+        int slot = k % NRING;
+        size_t count = min((size_t)opts.chunk, sim.n - first);
+        size_t bytes = count * sizeof(Particle);
+        cl_event uploaded, computed;
+
+        // The buffer is free once its previous chunk has been read out
+        cl_uint wait = downloaded[slot] ? 1 : 0;
+        clEnqueueWriteBuffer(upload, ring[slot], CL_FALSE, 0, bytes, state + first, wait,
+                             wait ? &downloaded[slot] : NULL, &uploaded);
+        if (downloaded[slot])
+            clReleaseEvent(downloaded[slot]);
+        tracecl(uploaded, "upload");
+        clEnqueueBarrierWithWaitList(command_queue, 1, &uploaded, NULL);
+
+        if (newParticles)
+        {
+            // gen indexes the chunk, shift the emitting range to match
+            Mass m = sim.mouse;
+            m.nPart -= first;
+            cl_uint s = nstep;
+            cl_ulong seed = opts.seed;
+            clSetKernelArg(sim.ker_gen, 0, sizeof(cl_mem), &ring[slot]);
+            clSetKernelArg(sim.ker_gen, 1, sizeof(Mass), &m);
+            clSetKernelArg(sim.ker_gen, 2, sizeof(cl_uint), &s);
+            clSetKernelArg(sim.ker_gen, 3, sizeof(cl_ulong), &seed);
+            clEnqueueNDRangeKernel(command_queue, sim.ker_gen, 1, NULL, &count, NULL, 0, NULL, traceev("gen"));
+        }
+        if (!explode)
+        {
+            cl_int np = count;
+            clSetKernelArg(sim.ker_acc, 0, sizeof(cl_mem), &ring[slot]);
+            clSetKernelArg(sim.ker_acc, 4, sizeof(cl_int), &np);
+            attrlaunch(sim.ker_acc, 1, count);
+        }
+        cl_uint s = nstep;
+        cl_ulong seed = opts.seed;
+        cl_int mixed = opts.mixed;
+        clSetKernelArg(sim.ker_move, 0, sizeof(cl_mem), &ring[slot]);
+        clSetKernelArg(sim.ker_move, 1, sizeof(Mass), &sim.mouse);
+        clSetKernelArg(sim.ker_move, 2, sizeof(cl_uint), &s);
+        clSetKernelArg(sim.ker_move, 3, sizeof(cl_ulong), &seed);
+        clSetKernelArg(sim.ker_move, 4, sizeof(cl_int), &mixed);
+        clEnqueueNDRangeKernel(command_queue, sim.ker_move, 1, NULL, &count, NULL, 0, NULL, traceev("move"));
+        clEnqueueMarkerWithWaitList(command_queue, 0, NULL, &computed);
+
+        clEnqueueReadBuffer(download, ring[slot], CL_FALSE, 0, bytes, state + first, 1, &computed,
+                            &downloaded[slot]);
+        tracecl(downloaded[slot], "download");
+        clReleaseEvent(uploaded);
+        clReleaseEvent(computed);
+        clFlush(upload);
+        clFlush(command_queue);
+        clFlush(download);
+    }
+    // Every chunk is back in host memory, the downloads wait for everything else
+    ret = clFinish(download);
+}
+
+// Port of zoomout and zoomin, on the host copy
+void ooczoom(bool out)
+{
+    float f = out ? sim.params.zoomout : sim.params.zoomin;
+    parallel(sim.n, [f](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                state[i].pos[c] *= f;
+                state[i].vel[c] *= f;
+            }
+            state[i].pos[3] = 0;
+        }
+    });
+}
+
+void oocreset()
+{
+    oocfill();
+}
+
+void oocread(Particle *dst)
+{
+    memcpy(dst, state, (size_t)sim.n * sizeof(Particle));
+}
+
+Particle *oocdata()
+{
+    return state;
+}
+
+// Take over another set of particles in host memory, sim.n follows
+void oocassign(vector<Particle> &&ps)
+{
+    owned = move(ps);
+    state = owned.data();
+}
+
+// Keep the first n particles in host memory, or add room after them, sim.n follows
+Particle *oocresize(size_t n)
+{
+    owned.resize(n);
+    state = owned.data();
+    return state;
+}
+
+void oocend()
+{
+    clFinish(command_queue);
+    attrend();
+    for (int k = 0; k < NRING; k++)
+    {
+        if (downloaded[k])
+            clReleaseEvent(downloaded[k]);
+        clReleaseMemObject(ring[k]);
+    }
+    clReleaseKernel(sim.ker_acc);
+    clReleaseKernel(sim.ker_move);
+    clReleaseKernel(sim.ker_gen);
+    clReleaseCommandQueue(upload);
+    clReleaseCommandQueue(download);
+    clprogramend();
+    if (mapped)
+        munmap(state, mapped);
+    owned.clear();
+}
@@ -18,15 +18,21 @@
 #include <EGL/egl.h>
 
 // Standard headers
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <exception>
 #include <iostream>
 #include <math.h>
 #include <string>
+#include <thread>
 #include <time.h>
 #include <vector>
 
+#include "rng.h"
+#include "bounds.h"
+#include "drift.h"
+
 // Add at the top with other includes
 #define GLFW_EXPOSE_NATIVE_X11
 #define GLFW_EXPOSE_NATIVE_GLX
@@ -42,12 +48,13 @@
 #define FAR 50
 #define NEAR 0.1
 
-extern const unsigned int W;
-extern const unsigned int H;
-extern int N;
+extern unsigned int W;
+extern unsigned int H;
 typedef unsigned int t_uint;
 
 extern GLFWwindow *window;
+extern EGLDisplay egldisplay;
+extern EGLContext eglcontext;
 extern float hsv[3];
 
 // Ensure proper alignment and packing for OpenCL-OpenGL interop
@@ -57,14 +64,76 @@ struct alignas(32) Particle
     alignas(16) float vel[4]; // xyz + padding for alignment
 };
 
-// Mass for the mouse
+// Position as 16-bit fractions of the frame's bounding box, written by quantize in kernel.cl
+struct QParticle
+{
+    unsigned short pos[4]; // xyz + padding, 8 bytes per particle
+};
+
+// Whole-system diagnostics from the stats reduction, must match t_stats in kernel.cl
+struct alignas(16) Stats
+{
+    float lo[4];   // bounding box corner
+    float hi[4];   // opposite corner
+    float sum[4];  // summed positions, w the summed squared speed
+    float vmax[4]; // x the largest squared speed
+};
+
+// Mass for the mouse, must match t_mass in kernel.cl
 struct Mass
 {
-    float x{0}, y{0}, z{0};    // position
-    int n{0};                  // number of particles
-    std::array<float, 10> m{}; // masses
-    float att{0.05f};          // attraction
-    int nPart{0};              // number of particles
+    float x{0}, y{0}, z{0}; // position
+    int n{0};               // number of attractors
+    float att{0.05f};       // attraction
+    int nPart{0};           // number of particles
+    int boundary{BD_NONE};  // domain boundary, BD_* in bounds.h
+    float box{1.5f};        // half-width of the domain
+};
+
+// A gravity point, must match t_attr in kernel.cl
+struct Attractor
+{
+    float pos[3];      // position
+    float strength{1}; // multiplies the global attraction
+    float falloff{0};  // pull decays as 1 / r^falloff, 0 keeps the magnitude constant
+    float pad[3]{};    // 32 bytes per attractor
+};
+
+// One simulation of an ensemble, must match t_inst in kernel.cl
+struct Instance
+{
+    float x{0}, y{0}, z{0}; // mouse mass position
+    float att{0.05f};       // attraction
+    int first{0};           // first attractor in the packed attractor array
+    int count{0};           // number of attractors
+    int shape{SH_CUBE};     // initial distribution
+    int seed{0};            // seed of the initial distribution
+};
+
+// SPH constants, must match t_sph in kernel.cl
+struct SphParams
+{
+    float h;         // smoothing length
+    float h2;        // h squared
+    float mass;      // particle mass
+    float rho0;      // rest density
+    float stiffness; // pressure per unit of density above rest
+    float viscosity; // viscosity coefficient
+    float poly6;     // density kernel normalisation
+    float spiky;     // pressure gradient normalisation
+    float visclap;   // viscosity laplacian normalisation
+    float cell;      // grid cell edge, at least h
+    float lo;        // grid origin on every axis
+    int g;           // cells per axis
+};
+
+// Integrator constants read by the kernels from a constant buffer, must match t_params in kernel.cl
+struct SimParams
+{
+    float dt{0.2f};      // step
+    float zoomout{0.9f}; // scale of one zoom-out tick
+    float zoomin{1.1f};  // scale of one zoom-in tick
+    float pad{0};        // 16 bytes
 };
 
 // Buffers for the particles
@@ -78,6 +147,8 @@ struct Buffers
     GLuint mx;      // mouse x
     GLuint my;      // mouse y
     GLuint hsv;     // hue, saturation, value
+    GLuint scale;   // quantized position scale
+    GLuint offset;  // quantized position offset
     float bl{0.0f}; // brightness
     float pt{1.0f}; // point size
 
@@ -91,44 +162,334 @@ struct Buffers
                             0}; // projection
 };
 
+// Input events, keyed by the simulation step they apply before
+enum EventType
+{
+    EV_CURSOR, // x, y: cursor position in window pixels
+    EV_BUTTON, // key: mouse button, action: press or release
+    EV_SCROLL, // x, y: scroll offsets
+    EV_KEY,    // key, action: key press or release
+    EV_HOLD    // key: bitmask of the held keys polled every frame
+};
+
+struct Event
+{
+    long step{0}; // simulation step
+    int type{0};  // EventType
+    double x{0};  // cursor or scroll x
+    double y{0};  // cursor or scroll y
+    int key{0};   // key, button or hold mask
+    int action{0};
+};
+
+// Where the simulation runs
+enum Backend
+{
+    BK_CL, // OpenCL kernels in kernel.cl
+    BK_CPU // native threads in cpusim.cpp
+};
+
+// How the positions reach the VBO
+enum Transfer
+{
+    TR_INTEROP, // OpenCL works on the GL buffer itself
+    TR_MAPPED   // the backend writes into a persistently mapped, triple-buffered VBO
+};
+
+// Command-line options
+struct Options
+{
+    unsigned int seed{0}; // random seed, 0 picks one from the clock
+    bool headless{false}; // simulate without a window
+    long steps{0};        // steps to run headless, 0 runs to the end of the replay
+    std::string record;   // input log to write
+    std::string replay;   // input log to play back
+    std::string hashes;   // per-step state hashes to write
+    std::string verify;   // per-step state hashes to check against
+    bool offscreen{false}; // render into an FBO without a window
+    std::string out;       // image sequence pattern for offscreen frames
+    std::string pipe;      // encoder command fed raw RGB frames on stdin
+    bool cpurender{false}; // rasterize on the CPU instead of through OpenGL
+    bool density{false};   // accumulate density and tone map instead of drawing opaque points
+    float exposure{0.5f};  // density tone mapping exposure
+    bool lod{false};       // draw a stable subset when particles outnumber pixels
+    float lodppp{1.0f};    // most particles drawn per pixel
+    float lodbudget{0};    // draw time budget in ms, 0 for none
+    int backend{BK_CL};    // Backend
+    int transfer{-1};      // Transfer, picked from the backend when not given
+    bool sph{false};       // add SPH pressure and viscosity between particles
+    float sphk{0.5f};      // SPH stiffness
+    float sphmu{0.1f};     // SPH viscosity
+    int blocklevels{0};    // block timestep classes below the base step, 0 for one global step
+    std::string ensemble;  // ensemble spec to run instead of a single simulation
+    int shape{SH_CUBE};    // initial distribution, SH_* in rng.h
+    bool quantize{false};  // draw 16-bit positions relative to the frame's bounding box
+    bool autoframe{false}; // keep the camera on the particles
+    int chunk{0};          // particles per device chunk out of core, 0 keeps them all on the device
+    std::string state;     // file the out-of-core particles live in, host memory when empty
+    std::string shm;       // shared memory name to publish every frame under, none when empty
+    bool shmvel{false};    // publish velocities along with the positions
+    int serve{0};          // loopback port to stream frames on, 0 for none
+    int servemax{100000};  // most particles in a streamed frame
+    int ranks{0};          // processes splitting the particles into slabs along x, 0 for one
+    int rank{0};           // this process among them
+    bool ranksockets{false}; // ranks talk over sockets instead of shared memory
+    std::string trace;     // Chrome trace written at exit, none when empty
+    bool selftest{false};  // check the kernels against a double reference and exit
+    int boundary{BD_NONE}; // domain boundary, BD_* in bounds.h
+    float box{1.5f};       // half-width of the domain, beyond every initial distribution
+    bool mixed{false};     // positions keep 10 more bits each in the w padding, see drift.h
+    std::string scenario;  // scenario file applied at startup and watched while running, none when empty
+    bool cull{false};      // draw only the particles in view, listed on the device and drawn indirectly
+};
+
+// State owned by one simulation. The interactive run is sim, ensembles pack theirs separately
+struct SimulationContext
+{
+    int n{1000};                       // number of particles
+    Mass mouse;                        // mass following the mouse
+    SimParams params;                  // step and zoom factors, on the device in paramsbuffer()
+    std::vector<Attractor> attractors; // gravity points added with the mouse
+    cl_mem particles{nullptr};         // particle buffer, the VBO itself when shared with GL
+    size_t global{0};                  // global size of the per-particle kernels
+    cl_kernel ker_init{nullptr};       // initialize kernel
+    cl_kernel ker_acc{nullptr};        // accelerate kernel
+    cl_kernel ker_move{nullptr};       // move kernel
+    cl_kernel ker_gen{nullptr};        // generate kernel
+    cl_kernel ker_zoomout{nullptr};    // zoom out kernel
+    cl_kernel ker_zoomin{nullptr};     // zoom in kernel
+};
+
+extern SimulationContext sim;
 extern Buffers g_bufs;
-extern Mass mouse;
 extern bool freezehue;
 extern bool go;
 extern bool explode;
 extern bool newParticles;
 
-extern size_t global_item_size;
 extern size_t local_item_size;
 
 extern cl_program program;
-extern cl_kernel ker_init;
-extern cl_kernel ker_acc;
-extern cl_kernel ker_move;
-extern cl_kernel ker_gen;
-extern cl_kernel ker_zoomin;
-extern cl_kernel ker_zoomout;
 extern cl_command_queue command_queue;
 extern cl_device_id device_id;
 
-extern bool circle;
+extern Options opts;
+extern long nstep;
 
 // Add these external declarations
 extern cl_int ret;
-extern cl_mem memobj;
 extern cl_context context;
 
 void getcontext();
 void glinit();
+void glbuffers();
+void glprojection();
+GLuint getprogram(const std::string &vs, const std::string &fs);
 void glend();
 void loop();
+void step();
+void render();
+void viewmatrix(float *mat);
 void keyholds(GLFWwindow *window);
 std::string filetostr(const std::string &filename);
 void getcontext();
+void clprogram();
+void clprogramend();
 void clinit();
 void clReset();
 void clend();
 
+// Many small simulations packed into one buffer
+void ensembleload(const std::string &path);
+void ensemblerun();
+void clacquire(const char *where);
+void clrelease(const char *where);
+
+// Attractors, uploaded to the device only when they change
+void attradd(const Attractor &a);
+void attrclear();
+void attrscale(float f);
+void attrlaunch(cl_kernel k, cl_uint first, size_t n);
+void attraccelerate();
+void attrend();
+
+// Smoothed-particle hydrodynamics on a cell-sorted grid
+void sphinit();
+void sphstep();
+void sphcpu(Particle *ps);
+void sphend();
+
+// Hierarchical block timesteps
+void blockinit();
+void blockstep();
+void blockend();
+
+// Backend-independent simulation entry points
+void siminit();
+void simend();
+void simzoom(bool out, int ticks);
+void simreset();
+void simread(Particle *dst);
+void simpublish();
+
+// Out-of-core runs streaming chunks of a host-side particle set through the device
+void oocinit();
+void oocstep();
+void ooczoom(bool out);
+void oocreset();
+void oocread(Particle *dst);
+Particle *oocdata();
+void oocassign(std::vector<Particle> &&ps);
+Particle *oocresize(size_t n);
+void oocend();
+
+// Native CPU backend
+void cpuinit();
+void cpustep(Particle *out);
+void cpuzoom(bool out);
+void cpuread(Particle *dst);
+Particle *cpudata();
+void cpuassign(std::vector<Particle> &&ps);
+Particle *cpuresize(size_t n);
+void cpustats(Stats &s);
+
+// Bounds, centroid and energy reductions
+void statsinit();
+void statslaunch();
+const Stats &statsget();
+cl_mem statsbuffer();
+void statsframe(const float *rot);
+void statsend();
+
+// 16-bit render stream
+void quantinit();
+void quantpublish();
+void quantuniforms(GLint scale, GLint offset);
+void quantend();
+
+// Frames published in a shared-memory ring, read with shmreader.hpp
+void shminit();
+void shmpublish();
+void shmend();
+
+// Frames streamed to loopback clients, see streamproto.hpp
+void streaminit();
+void streampublish();
+void streamend();
+
+// Domain decomposition over several processes
+void domainfork();
+void domaininit();
+void domaininput(std::vector<Event> &batch);
+void domainstep();
+void domainend();
+
+// Scenario files, and the parameters they change while running
+bool scenarioload(const std::string &path);
+void scenariopoll();
+cl_mem paramsbuffer();
+void paramsupload();
+void paramsend();
+
+// Kernel checks against a double-precision reference on every backend, and their throughput
+int selftest();
+
+// Persistently mapped VBO transfers
+bool glshared();
+void transferinit();
+Particle *transferbegin();
+void transferfence();
+void transferend();
+
+// Input recording and replay
+bool inputpush(const Event &e);
+void inputapply();
+void input(const Event &e);
+void applyholds();
+void recordopen(const std::string &path);
+void replayload(const std::string &path);
+void replayfeed();
+long replaylength();
+void replayrun();
+void checkstate();
+
+// Offscreen rendering and frame export
+void eglinit();
+void eglend();
+void offscreenrun();
+void writeppm(const std::string &path, int w, int h, const unsigned char *rgb);
+void writepng(const std::string &path, int w, int h, const unsigned char *rgb);
+void writeimage(const std::string &path, int w, int h, const unsigned char *rgb);
+
+// Density accumulation renderer
+void densityinit();
+void densityrender(const float *mat);
+void densityend();
+
+// Level-of-detail subset drawing
+void lodinit();
+int lodcount();
+void loddraw(int k, bool opaque);
+void lodend();
+
+// Frustum culling into an indirect draw
+void cullinit();
+void culldraw(const float *mat);
+void cullend();
+
+// Software point rasterizer
+void softinit();
+void softframe(const Particle *ps, int n);
+void softrun();
+
+// Chrome trace of host scopes and device commands, see trace.cpp
+extern bool tracing;
+void traceinit();
+int64_t tracenow();
+void tracethread(const char *name);
+void tracehost(const char *name, int64_t begin, int64_t end);
+const cl_queue_properties *traceprops();
+void tracequeue(cl_command_queue q, const char *name);
+cl_event *traceev(const char *name);
+void tracecl(cl_event ev, const char *name);
+void tracecollect(bool wait);
+
+// Puts the enclosing block on the calling thread's trace track
+class TraceScope
+{
+  public:
+    explicit TraceScope(const char *name) : name(name), begin(tracing ? tracenow() : 0)
+    {
+    }
+    ~TraceScope()
+    {
+        if (tracing)
+            tracehost(name, begin, tracenow());
+    }
+
+  private:
+    const char *name;
+    int64_t begin;
+};
+
+// Threads parallel() runs on, the hardware threads shared out between the ranks
+inline size_t parallelthreads()
+{
+    return std::max(1u, std::thread::hardware_concurrency() / std::max(1, opts.ranks));
+}
+
+// Run f(thread, begin, end) over [0, n) split evenly across the hardware threads
+template <typename F>
+void parallel(size_t n, F f)
+{
+    size_t nthreads = parallelthreads();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nthreads; t++)
+        threads.emplace_back(f, t, n * t / nthreads, n * (t + 1) / nthreads);
+    for (auto &thread : threads)
+        thread.join();
+}
+
 // Add type alias for backward compatibility
 using t_bufs = Buffers;
 using t_mass = Mass;
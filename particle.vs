@@ -4,11 +4,14 @@ layout (location = 0) in vec3 aPos;
 uniform mat4 p;
 uniform float mx;
 uniform float my;
+uniform vec3 scale;  // decode of quantized positions, 1 for plain floats
+uniform vec3 offset; // 0 for plain floats
 
 out float d;
 
 void main()
 {
-    gl_Position = p * vec4(aPos, 1.0);
-    d = length(aPos - vec3(mx, my, 0.0));
+    vec3 pos = aPos * scale + offset;
+    gl_Position = p * vec4(pos, 1.0);
+    d = length(pos - vec3(mx, my, 0.0));
 }
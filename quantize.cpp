@@ -0,0 +1,78 @@
+#include "particle.hpp"
+using namespace std;
+
+static const size_t QUANT_LOCAL = 256; // work-group size of quantize
+
+static cl_kernel ker_quantize;
+static cl_mem qpos;                     // the GL buffer of 16-bit positions
+static float qlo[4] = {0, 0, 0, 0};     // decode offset, the box corner
+static float qextent[4] = {1, 1, 1, 0}; // decode scale, the box size
+
+static cl_kernel quantkernel(const char *name)
+{
+    cl_kernel k = clCreateKernel(program, name, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create " << name << " kernel: " << ret << endl;
+        exit(1);
+    }
+    return k;
+}
+
+// The VBO was allocated as QParticle by glbuffers, share it with OpenCL
+void quantinit()
+{
+    cl_int np = sim.n;
+    cl_mem stats = statsbuffer();
+    qpos = clCreateFromGLBuffer(context, CL_MEM_WRITE_ONLY, g_bufs.vbo, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to share the quantized buffer: " << ret << endl;
+        exit(1);
+    }
+
+    ker_quantize = quantkernel("quantize");
+    clSetKernelArg(ker_quantize, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_quantize, 1, sizeof(cl_int), &np);
+    clSetKernelArg(ker_quantize, 2, sizeof(cl_mem), &stats);
+    clSetKernelArg(ker_quantize, 3, sizeof(cl_mem), &qpos);
+}
+
+// Write the current positions into the VBO relative to the bounding box of the stats
+// passes, which statslaunch has just enqueued. The box comes back to the host for the
+// decode uniforms, the only wait in the stream.
+void quantpublish()
+{
+    size_t local = QUANT_LOCAL;
+    size_t global = (sim.n + QUANT_LOCAL - 1) / QUANT_LOCAL * QUANT_LOCAL;
+    float box[8];
+
+    glFinish();
+    ret = clEnqueueAcquireGLObjects(command_queue, 1, &qpos, 0, NULL, NULL);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to acquire the quantized buffer: " << ret << endl;
+        exit(1);
+    }
+    clEnqueueNDRangeKernel(command_queue, ker_quantize, 1, NULL, &global, &local, 0, NULL, traceev("quantize"));
+    clEnqueueReleaseGLObjects(command_queue, 1, &qpos, 0, NULL, NULL);
+    clEnqueueReadBuffer(command_queue, statsbuffer(), CL_TRUE, 0, sizeof(box), box, 0, NULL, NULL);
+    for (int c = 0; c < 3; c++)
+    {
+        qlo[c] = box[c];
+        qextent[c] = max(box[4 + c] - box[c], 1e-6f);
+    }
+}
+
+// Decode uniforms of particle.vs, identity unless the VBO holds quantized positions
+void quantuniforms(GLint scale, GLint offset)
+{
+    glUniform3f(scale, qextent[0], qextent[1], qextent[2]);
+    glUniform3f(offset, qlo[0], qlo[1], qlo[2]);
+}
+
+void quantend()
+{
+    clReleaseKernel(ker_quantize);
+    clReleaseMemObject(qpos);
+}
@@ -0,0 +1,111 @@
+// Counter-based random numbers and initial distributions, shared by kernel.cl (prepended to
+// the kernel source) and the host. Philox4x32-10: the same (counter, key) always gives the
+// same four numbers, so every particle draws its own independently, in any order. The numbers
+// are the same on the device and the host; the shapes built from them are bitwise the same only
+// for the cube, which is a subtraction and a multiply by a constant folded at compile time (an
+// OpenCL divide need not be correctly rounded), the others use the platform's sqrt, sin, cos,
+// log and pow and agree to within their precision.
+#ifndef RNG_H
+#define RNG_H
+
+#ifdef __OPENCL_VERSION__
+typedef uint rng_u32;
+typedef ulong rng_u64;
+#define RNG_INLINE inline
+#define rng_sqrt sqrt
+#define rng_sin sin
+#define rng_cos cos
+#define rng_log log
+#define rng_pow pow
+#else
+#include <math.h>
+#include <stdint.h>
+typedef uint32_t rng_u32;
+typedef uint64_t rng_u64;
+#define RNG_INLINE static inline
+#define rng_sqrt sqrtf
+#define rng_sin sinf
+#define rng_cos cosf
+#define rng_log logf
+#define rng_pow powf
+#endif
+
+// Initial distributions, the values of opts.shape and Instance::shape
+#define SH_CUBE 0    // uniform in a cube of half-width 1/3
+#define SH_DISK 1    // uniform over a disk of radius 1, thin in z
+#define SH_PLUMMER 2 // Plummer sphere of scale radius 0.1, truncated near 1.2
+#define SH_SHELLS 3  // three Gaussian shells of radius 0.25, 0.5 and 0.75
+
+#define RNG_PI 3.14159265f
+
+// Four uniform floats in [0, 1) for counter (index, stream, c2) and a 64-bit seed
+RNG_INLINE void rng_uniform(rng_u32 index, rng_u32 stream, rng_u32 c2, rng_u64 seed, float *u)
+{
+    rng_u32 c[4] = {index, stream, c2, 0};
+    rng_u32 k0 = (rng_u32)seed, k1 = (rng_u32)(seed >> 32);
+    for (int r = 0; r < 10; r++)
+    {
+        rng_u64 p0 = (rng_u64)0xD2511F53u * c[0];
+        rng_u64 p1 = (rng_u64)0xCD9E8D57u * c[2];
+        rng_u32 n0 = (rng_u32)(p1 >> 32) ^ c[1] ^ k0;
+        rng_u32 n2 = (rng_u32)(p0 >> 32) ^ c[3] ^ k1;
+        c[1] = (rng_u32)p1;
+        c[3] = (rng_u32)p0;
+        c[0] = n0;
+        c[2] = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    for (int j = 0; j < 4; j++)
+        u[j] = (c[j] >> 8) * (1.0f / 16777216.0f);
+}
+
+// Unit vector from two uniforms
+RNG_INLINE void rng_direction(float u0, float u1, float *d)
+{
+    float z = 2 * u0 - 1;
+    float s = rng_sqrt(1 - z * z);
+    d[0] = s * rng_cos(2 * RNG_PI * u1);
+    d[1] = s * rng_sin(2 * RNG_PI * u1);
+    d[2] = z;
+}
+
+// Initial position of particle i
+RNG_INLINE void rng_initpos(int shape, rng_u32 i, rng_u64 seed, float *pos)
+{
+    float u[4], v[4], d[3];
+    rng_uniform(i, 0, 0, seed, u);
+    if (shape == SH_DISK)
+    {
+        float r = rng_sqrt(u[0]);
+        pos[0] = r * rng_cos(2 * RNG_PI * u[1]);
+        pos[1] = r * rng_sin(2 * RNG_PI * u[1]);
+        pos[2] = (u[2] - 0.5f) * (2.0f / 3);
+    }
+    else if (shape == SH_PLUMMER)
+    {
+        // Inverse of the Plummer cumulative mass, the outermost 1% is cut off
+        float m = 0.0001f + u[0] * 0.9899f;
+        float r = 0.1f / rng_sqrt(rng_pow(m, -2.0f / 3) - 1);
+        rng_direction(u[1], u[2], d);
+        for (int c = 0; c < 3; c++)
+            pos[c] = r * d[c];
+    }
+    else if (shape == SH_SHELLS)
+    {
+        // Box-Muller for the radial spread
+        rng_uniform(i, 1, 0, seed, v);
+        float g = rng_sqrt(-2 * rng_log(1 - v[0])) * rng_cos(2 * RNG_PI * v[1]);
+        float r = 0.25f * (1 + (int)(u[0] * 3)) + 0.02f * g;
+        rng_direction(u[1], u[2], d);
+        for (int c = 0; c < 3; c++)
+            pos[c] = r * d[c];
+    }
+    else
+    {
+        for (int c = 0; c < 3; c++)
+            pos[c] = (u[c] - 0.5f) * (2.0f / 3);
+    }
+}
+
+#endif
@@ -0,0 +1,401 @@
+#include "particle.hpp"
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <sys/stat.h>
+using namespace std;
+
+// A scenario file holds one keyword and its values per line, '#' starts a comment:
+//
+//     particles 200000        startup: number of particles
+//     backend cl              startup: cl or cpu
+//     seed 42                 startup: seed of the initial distribution
+//     size 1280x720           startup: window or offscreen frame size
+//     render density          startup: points, density or quantize
+//     lod 2                   startup: draw at most this many particles per pixel
+//     init plummer            kernel: cube, disk, plummer or shells, used by the next reset
+//     workgroup 250           kernel: work-group size of init and the zooms
+//     blocksteps 3            kernel: block timestep levels, 0 for one global step
+//     sph 0.5 0.1             kernel: SPH stiffness and viscosity, or sph off
+//     dt 0.2                  step: base step
+//     zoom 0.9 1.1            step: scale of a zoom-out and a zoom-in tick
+//     att 0.05                step: attraction
+//     boundary periodic 1.5   step: none, periodic, reflect or recycle, and optionally the box half-width
+//     mixed on                step: mixed-precision positions, on or off
+//     view 90 0.1 50          step: field of view in degrees, near and far planes
+//     pointsize 2             step: point size in pixels
+//     exposure 0.5            step: density tone mapping exposure
+//     attractor x y z s f     step: one per line, position, strength and falloff
+//
+// Startup and kernel settings are read with the other arguments, later ones override earlier
+// ones. Step settings are applied before the first step. The file is then watched: when it
+// changes, startup settings only print that they need a restart, kernel settings rebuild the
+// module they belong to, and step settings apply before the next step, the step and zoom
+// factors by rewriting the constant buffer every kernel reads them from. A setting removed from
+// the file keeps its current value, except the attractors, which are replaced by the file's.
+// A file that does not parse is reported and ignored until it changes again.
+
+static const double POLL = 0.25; // seconds between looks at the file
+
+// When a keyword takes effect
+enum When
+{
+    AT_START,  // before anything is built, a change needs a restart
+    AT_KERNEL, // rebuilds the module it belongs to
+    AT_STEP    // before the next step
+};
+
+static const map<string, int> keywords = {
+    {"particles", AT_START}, {"backend", AT_START}, {"seed", AT_START}, {"size", AT_START}, {"render", AT_START},
+    {"lod", AT_START}, {"init", AT_KERNEL}, {"workgroup", AT_KERNEL}, {"blocksteps", AT_KERNEL}, {"sph", AT_KERNEL},
+    {"dt", AT_STEP}, {"zoom", AT_STEP}, {"att", AT_STEP}, {"boundary", AT_STEP}, {"mixed", AT_STEP},
+    {"view", AT_STEP}, {"pointsize", AT_STEP}, {"exposure", AT_STEP}, {"attractor", AT_STEP}};
+
+// The values of a keyword and the line they are on. Attractor lines are joined with newlines.
+struct Setting
+{
+    int line;
+    string words;
+};
+
+static string path;                               // the scenario file
+static map<string, Setting> scene;                // settings in effect
+static bool started = false;                      // the step settings have been applied
+static timespec mtime{};                          // modification time of the file when last read
+static chrono::steady_clock::time_point lastpoll; // when the file was last looked at
+static cl_mem paramsmem = nullptr;                // sim.params on the device
+
+// The parameters on the device, created in the current context on first use
+cl_mem paramsbuffer()
+{
+    if (!paramsmem)
+    {
+        paramsmem = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(SimParams), &sim.params,
+                                   &ret);
+        if (ret != CL_SUCCESS)
+        {
+            cout << RED << "Failed to create parameter buffer: " << ret << endl;
+            exit(1);
+        }
+    }
+    return paramsmem;
+}
+
+// Rewrite the parameters after sim.params changed, the kernels keep the same buffer
+void paramsupload()
+{
+    if (paramsmem)
+        clEnqueueWriteBuffer(command_queue, paramsmem, CL_TRUE, 0, sizeof(SimParams), &sim.params, 0, NULL, NULL);
+}
+
+void paramsend()
+{
+    if (paramsmem)
+        clReleaseMemObject(paramsmem);
+    paramsmem = nullptr;
+}
+
+// Parse the file into settings, reporting every line that does not
+static bool scenarioread(map<string, Setting> &out)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        cout << RED << "Failed to open scenario " << path << endl;
+        return false;
+    }
+    bool ok = true;
+    string line;
+    for (int lineno = 1; getline(file, line); lineno++)
+    {
+        istringstream words(line.substr(0, line.find('#')));
+        string key, word, rest;
+        if (!(words >> key))
+            continue;
+        if (!keywords.count(key))
+        {
+            cout << RED << path << ":" << lineno << ": unknown scenario keyword \"" << key << "\"" << endl;
+            ok = false;
+            continue;
+        }
+        while (words >> word)
+            rest += (rest.empty() ? "" : " ") + word;
+        Setting &s = out[key];
+        if (key == "attractor" && !s.words.empty())
+            s.words += "\n" + rest;
+        else
+            s = Setting{lineno, rest};
+    }
+    return ok;
+}
+
+// Index of name in names, -1 when it is none of them
+static int pick(const string &name, const vector<string> &names)
+{
+    for (size_t k = 0; k < names.size(); k++)
+        if (name == names[k])
+            return k;
+    return -1;
+}
+
+// Nothing left to read
+static bool end(istringstream &words)
+{
+    string extra;
+    return !(words >> extra);
+}
+
+// Parse one setting and apply it. Nothing changes when it does not parse or does not fit the
+// run. Kernel settings only set the options until running, after that they rebuild.
+static bool scenarioapply(const string &key, const Setting &s, bool running)
+{
+    istringstream words(s.words);
+    string word;
+    float a = 0, b = 0, c = 0;
+    int n = 0;
+    const char *why = "bad value";
+    bool ok = false;
+    if (key == "particles" && words >> n && end(words))
+    {
+        ok = true;
+        sim.n = n;
+    }
+    else if (key == "backend" && words >> word && pick(word, {"cl", "cpu"}) >= 0 && end(words))
+    {
+        ok = true;
+        opts.backend = word == "cpu" ? BK_CPU : BK_CL;
+    }
+    else if (key == "seed" && words >> opts.seed && end(words))
+        ok = true;
+    else if (key == "size" && words >> word && end(words))
+        ok = sscanf(word.c_str(), "%ux%u", &W, &H) == 2;
+    else if (key == "render" && words >> word && pick(word, {"points", "density", "quantize"}) >= 0 && end(words))
+    {
+        ok = true;
+        opts.density = word == "density";
+        opts.quantize = word == "quantize";
+    }
+    else if (key == "lod" && words >> a && a > 0 && end(words))
+    {
+        ok = true;
+        opts.lod = true;
+        opts.lodppp = a;
+    }
+    else if (key == "init" && words >> word && (n = pick(word, {"cube", "disk", "plummer", "shells"})) >= 0 &&
+             end(words))
+    {
+        ok = true;
+        opts.shape = n;
+        if (running && sim.ker_init)
+        {
+            cl_int shape = n;
+            clSetKernelArg(sim.ker_init, 1, sizeof(cl_int), &shape);
+        }
+    }
+    else if (key == "workgroup" && words >> n && n > 0 && end(words))
+    {
+        size_t most = n;
+        if (running && opts.backend == BK_CL && !opts.chunk)
+            clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(most), &most, NULL);
+        ok = (size_t)n <= most && (!running || sim.n % n == 0);
+        why = "work-group size has to divide the particles and fit the device";
+        if (ok)
+            local_item_size = n;
+    }
+    else if (key == "blocksteps" && words >> n && n >= 0 && n <= 10 && end(words))
+    {
+        // Block steps advance particles independently, SPH couples them
+        ok = !running || !n || (!opts.sph && !opts.chunk);
+        why = "block steps do not run with sph or --chunk";
+        if (ok && running && opts.blocklevels)
+            blockend();
+        if (ok)
+            opts.blocklevels = n;
+        if (ok && running && n)
+            blockinit();
+    }
+    else if (key == "sph" && s.words == "off")
+    {
+        ok = true;
+        if (running && opts.sph)
+            sphend();
+        opts.sph = false;
+    }
+    else if (key == "sph" && words >> a >> b && a >= 0 && b >= 0 && end(words))
+    {
+        ok = !running || (!opts.blocklevels && !opts.chunk && !opts.ranks);
+        why = "sph does not run with block steps, --chunk or --ranks";
+        if (ok && running && opts.sph)
+            sphend();
+        if (ok)
+        {
+            opts.sph = true;
+            opts.sphk = a;
+            opts.sphmu = b;
+        }
+        if (ok && running)
+            sphinit();
+    }
+    else if (key == "dt" && words >> a && a > 0 && end(words))
+    {
+        ok = true;
+        sim.params.dt = a;
+        paramsupload();
+    }
+    else if (key == "zoom" && words >> a >> b && a > 0 && b > 0 && end(words))
+    {
+        ok = true;
+        sim.params.zoomout = a;
+        sim.params.zoomin = b;
+        paramsupload();
+    }
+    else if (key == "att" && words >> a && end(words))
+    {
+        ok = true;
+        sim.mouse.att = a;
+    }
+    else if (key == "boundary" && words >> word && (n = pick(word, {"none", "periodic", "reflect", "recycle"})) >= 0)
+    {
+        // Without a half-width the box keeps its zoomed size
+        bool sized = !words.eof();
+        ok = !sized || (words >> a && a > 0 && end(words));
+        if (ok)
+            opts.boundary = sim.mouse.boundary = n;
+        if (ok && sized)
+            opts.box = sim.mouse.box = a;
+    }
+    else if (key == "mixed" && words >> word && pick(word, {"off", "on"}) >= 0 && end(words))
+    {
+        ok = true;
+        opts.mixed = word == "on";
+    }
+    else if (key == "view" && words >> a >> b >> c && a > 0 && a < 180 && b > 0 && c > b && end(words))
+    {
+        ok = true;
+        g_bufs.p[5] = 1.0 / tan(a / 2 * PI / 180);
+        g_bufs.p[0] = g_bufs.p[5] * H / W;
+        g_bufs.p[10] = -c / (c - b);
+        g_bufs.p[14] = -c * b / (c - b);
+    }
+    else if (key == "pointsize" && words >> a && a > 0 && end(words))
+    {
+        ok = true;
+        g_bufs.pt = a;
+        if (!opts.headless)
+            glPointSize(a);
+    }
+    else if (key == "exposure" && words >> a && a > 0 && end(words))
+    {
+        ok = true;
+        opts.exposure = a;
+    }
+    else if (key == "attractor")
+    {
+        // Every line has to parse before the current set is replaced
+        vector<Attractor> set;
+        string line;
+        ok = true;
+        while (ok && getline(words, line))
+        {
+            Attractor at{{0, 0, 0}};
+            istringstream one(line);
+            ok = one >> at.pos[0] >> at.pos[1] >> at.pos[2] >> at.strength >> at.falloff && end(one);
+            set.push_back(at);
+        }
+        if (ok)
+        {
+            attrclear();
+            for (const Attractor &at : set)
+                attradd(at);
+        }
+    }
+    if (!ok)
+        cout << RED << path << ":" << s.line << ": " << why << " for " << key << " \"" << s.words << "\"" << endl;
+    return ok;
+}
+
+// Read the scenario with the arguments and apply its startup and kernel settings. Returns
+// whether it sets the number of particles.
+bool scenarioload(const string &file)
+{
+    path = file;
+    scene.clear();
+    if (!scenarioread(scene))
+        exit(1);
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+        mtime = st.st_mtim;
+    for (auto &k : scene)
+        if (keywords.at(k.first) != AT_STEP && !scenarioapply(k.first, k.second, false))
+            exit(1);
+    lastpoll = chrono::steady_clock::now();
+    return scene.count("particles");
+}
+
+// Apply what changed since the settings in effect
+static void scenarioreload(const map<string, Setting> &next)
+{
+    TraceScope scope("scenario");
+    int applied = 0, failed = 0;
+    // Modules switched off go first, so that one they exclude can start in the same change
+    for (int pass = 0; pass < 2; pass++)
+        for (auto &k : keywords)
+        {
+            auto was = scene.find(k.first);
+            auto now = next.find(k.first);
+            if (now == next.end() && k.first != "attractor")
+                continue;
+            Setting s = now == next.end() ? Setting{0, ""} : now->second;
+            if (was != scene.end() && was->second.words == s.words)
+                continue;
+            if (was == scene.end() && s.words.empty())
+                continue;
+            if ((s.words == "off" || s.words == "0") != !pass)
+                continue;
+            if (k.second == AT_START)
+            {
+                cout << ORANGE << "Scenario: " << k.first << " " << s.words << " applies on restart" << endl;
+                scene[k.first] = s;
+            }
+            else if (scenarioapply(k.first, s, true))
+            {
+                scene[k.first] = s;
+                applied++;
+            }
+            else
+                failed++;
+        }
+    if (applied || failed)
+        cout << (failed ? ORANGE : YELLO) << "Scenario: applied " << applied << " changes from " << path
+             << (failed ? ", kept the old values of the rest" : "") << endl;
+}
+
+// Called before every step: the step settings the first time, then the changes to the file.
+// Replays, recordings and ranks only take the file as it was at startup, so every run sees the
+// same values and a --record log replays without the file's later edits.
+void scenariopoll()
+{
+    if (!started)
+    {
+        started = true;
+        for (auto &k : scene)
+            if (keywords.at(k.first) == AT_STEP && !scenarioapply(k.first, k.second, true))
+                exit(1);
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    if (!opts.replay.empty() || !opts.record.empty() || opts.ranks ||
+        chrono::duration<double>(now - lastpoll).count() < POLL)
+        return;
+    lastpoll = now;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || (st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec == mtime.tv_nsec))
+        return;
+    mtime = st.st_mtim;
+    map<string, Setting> next;
+    if (scenarioread(next))
+        scenarioreload(next);
+    else
+        cout << ORANGE << "Scenario: kept the current settings" << endl;
+}
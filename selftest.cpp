@@ -0,0 +1,578 @@
+#include "particle.hpp"
+#include <chrono>
+#include <iomanip>
+using namespace std;
+
+// Every kernel runs on the same inputs on every OpenCL device and on the native backend, and
+// is compared with a double-precision reference computed from the same float inputs. Errors
+// are normwise: the largest difference over the largest reference value of the quantity.
+static const double TOL_INIT = 1e-5;  // init, the device math library against the host's
+static const double TOL_FORCE = 1e-4; // a step, rsqrt and pow summed over the attractors
+static const double TOL_SUM = 1e-3;   // stats sums, float accumulation over every particle
+static const double TOL_CULL = 1e-5;  // cull, how near a frustum plane a particle may land either side
+static const int NATTR = 70;          // attractors, more than one local-memory tile
+static const int REPS = 10;           // timed repetitions
+static const unsigned SEED = 12345;   // the inputs are the same every run
+
+static int checks = 0, failures = 0;
+
+// A particle in double
+struct Ref
+{
+    double pos[3];
+    double vel[3];
+};
+
+static double elapsed(chrono::steady_clock::time_point since)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - since).count();
+}
+
+static void report(const string &backend, const string &test, size_t n, double err, double tol)
+{
+    bool ok = err <= tol;
+    checks++;
+    failures += !ok;
+    cout << (ok ? GREEN : RED) << "  " << left << setw(12) << backend << setw(16) << test << right << setw(9) << n
+         << (ok ? "  ok    " : "  FAIL  ") << scientific << setprecision(2) << err << " (tolerance " << tol << ")"
+         << defaultfloat << endl;
+}
+
+// Throughput of one pass over n particles moving bytes of memory each, against the measured copy bandwidth
+static void rate(const string &backend, const string &what, size_t n, double seconds, double bytes, double copy)
+{
+    double gbs = n * bytes / seconds / 1e9;
+    cout << YELLO << "  " << left << setw(12) << backend << setw(16) << what << right << fixed << setprecision(1)
+         << setw(9) << n / seconds / 1e6 << " Mparticles/s " << setw(7) << gbs << " GB/s, " << setprecision(0)
+         << 100 * gbs / copy << "% of copy" << defaultfloat << endl;
+}
+
+// Cube positions and small random velocities
+static vector<Particle> startstate(size_t n)
+{
+    vector<Particle> ps(n);
+    parallel(n, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            float u[4];
+            rng_initpos(SH_CUBE, i, SEED, ps[i].pos);
+            rng_uniform(i, 5, 0, SEED, u);
+            ps[i].pos[3] = 0;
+            for (int c = 0; c < 3; c++)
+                ps[i].vel[c] = (u[c] - 0.5f) * 0.02f;
+            ps[i].vel[3] = 0;
+        }
+    });
+    return ps;
+}
+
+// The mouse and NATTR attractors with falloffs from 0 to 1.5
+static void startattractors()
+{
+    attrclear();
+    sim.mouse.x = 0.1f;
+    sim.mouse.y = -0.2f;
+    sim.mouse.z = 0.05f;
+    sim.mouse.att = 0.05f;
+    for (int k = 0; k < NATTR; k++)
+    {
+        float u[4];
+        rng_uniform(k, 6, 0, SEED, u);
+        Attractor a;
+        for (int c = 0; c < 3; c++)
+            a.pos[c] = u[c] - 0.5f;
+        a.strength = 0.5f + u[3];
+        a.falloff = (k % 4) * 0.5f;
+        attradd(a);
+    }
+}
+
+static vector<Ref> reference(const vector<Particle> &ps)
+{
+    vector<Ref> ref(ps.size());
+    for (size_t i = 0; i < ps.size(); i++)
+        for (int c = 0; c < 3; c++)
+        {
+            ref[i].pos[c] = ps[i].pos[c];
+            ref[i].vel[c] = ps[i].vel[c];
+        }
+    return ref;
+}
+
+// accelerate: the pull of the mouse and the attractors, kicked by the step
+static void refaccelerate(vector<Ref> &ref)
+{
+    const double soft = 0.00001f;
+    const Mass m = sim.mouse;
+    parallel(ref.size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            Ref &p = ref[i];
+            double d[3] = {m.x - p.pos[0], m.y - p.pos[1], m.z - p.pos[2]};
+            double r2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2] + soft;
+            double a[3];
+            for (int c = 0; c < 3; c++)
+                a[c] = m.att * d[c] / sqrt(r2);
+            for (const Attractor &at : sim.attractors)
+            {
+                for (int c = 0; c < 3; c++)
+                    d[c] = at.pos[c] - p.pos[c];
+                r2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2] + soft;
+                double f = m.att * at.strength / sqrt(r2) * pow(r2, -0.5 * at.falloff);
+                for (int c = 0; c < 3; c++)
+                    a[c] += f * d[c];
+            }
+            for (int c = 0; c < 3; c++)
+                p.vel[c] += sim.params.dt * a[c];
+        }
+    });
+}
+
+static void refmove(vector<Ref> &ref)
+{
+    for (Ref &p : ref)
+        for (int c = 0; c < 3; c++)
+            p.pos[c] += sim.params.dt * p.vel[c];
+}
+
+static void refzoom(vector<Ref> &ref, double f)
+{
+    for (Ref &p : ref)
+        for (int c = 0; c < 3; c++)
+        {
+            p.pos[c] *= f;
+            p.vel[c] *= f;
+        }
+}
+
+// Normwise error of the positions and the velocities, whichever is worse, infinite when
+// anything is not finite
+static double error(const Particle *got, const vector<Ref> &ref)
+{
+    double diff[2] = {0, 0}, scale[2] = {1e-30, 1e-30};
+    for (size_t i = 0; i < ref.size(); i++)
+        for (int c = 0; c < 3; c++)
+        {
+            if (!isfinite(got[i].pos[c]) || !isfinite(got[i].vel[c]))
+                return INFINITY;
+            diff[0] = max(diff[0], fabs(got[i].pos[c] - ref[i].pos[c]));
+            diff[1] = max(diff[1], fabs(got[i].vel[c] - ref[i].vel[c]));
+            scale[0] = max(scale[0], fabs(ref[i].pos[c]));
+            scale[1] = max(scale[1], fabs(ref[i].vel[c]));
+        }
+    return max(diff[0] / scale[0], diff[1] / scale[1]);
+}
+
+// Column-major like viewmatrix: 1.5 back from the origin, with a field of view narrow enough
+// to leave part of the cube out
+static void cullview(float *m)
+{
+    float a = -FAR / (FAR - NEAR), b = -FAR * NEAR / (FAR - NEAR);
+    float v[16] = {4, 0, 0, 0, 0, 4, 0, 0, 0, 0, a, -1, 0, 0, b - 1.5f * a, 1.5f};
+    memcpy(m, v, sizeof(v));
+}
+
+// 1 when a particle is in view of m, -1 when it is not, 0 when it is too near a plane to tell
+static int cullside(const Particle &p, const float *m)
+{
+    double c[4];
+    for (int r = 0; r < 4; r++)
+        c[r] = (double)p.pos[0] * m[r] + (double)p.pos[1] * m[4 + r] + (double)p.pos[2] * m[8 + r] + m[12 + r];
+    double margin = TOL_CULL * (fabs(c[3]) + 1);
+    double inside = min(c[3], c[3] - max(max(fabs(c[0]), fabs(c[1])), fabs(c[2])));
+    return inside > margin ? 1 : inside < -margin ? -1 : 0;
+}
+
+// Copy bandwidth of the host in GB/s, counting the read and the write
+static double hostcopy(size_t bytes)
+{
+    vector<char> src(bytes, 1), dst(bytes);
+    double best = INFINITY;
+    for (int r = 0; r < REPS; r++)
+    {
+        auto start = chrono::steady_clock::now();
+        parallel(bytes, [&](size_t, size_t begin, size_t end) { memcpy(&dst[begin], &src[begin], end - begin); });
+        best = min(best, elapsed(start));
+    }
+    return 2 * bytes / best / 1e9;
+}
+
+// Native backend: the fused step, the zooms and the vectorized stats
+static void cpusuite(const vector<size_t> &sizes)
+{
+    opts.sph = false;
+    opts.blocklevels = 0;
+    newParticles = explode = false;
+    for (size_t n : sizes)
+    {
+        sim.n = n;
+        vector<Particle> ps = startstate(n);
+        vector<Ref> ref = reference(ps);
+        cpuassign(move(ps));
+
+        cpustep(nullptr);
+        refaccelerate(ref);
+        refmove(ref);
+        report("cpu", "step", n, error(cpudata(), ref), TOL_FORCE);
+
+        // The same step with mixed-precision positions, from the same start
+        cpuassign(startstate(n));
+        opts.mixed = true;
+        cpustep(nullptr);
+        opts.mixed = false;
+        report("cpu", "step mixed", n, error(cpudata(), ref), TOL_FORCE);
+
+        cpuzoom(true);
+        refzoom(ref, sim.params.zoomout);
+        cpuzoom(false);
+        refzoom(ref, sim.params.zoomin);
+        report("cpu", "zoom", n, error(cpudata(), ref), TOL_FORCE);
+
+        // Bounds and the largest speed are exact up to a rounding, the sums accumulate
+        Stats s;
+        cpustats(s);
+        double lo[3], hi[3], sum[4] = {0, 0, 0, 0}, vmax = 0;
+        for (int c = 0; c < 3; c++)
+            lo[c] = INFINITY, hi[c] = -INFINITY;
+        for (const Ref &p : ref)
+        {
+            double v2 = p.vel[0] * p.vel[0] + p.vel[1] * p.vel[1] + p.vel[2] * p.vel[2];
+            for (int c = 0; c < 3; c++)
+            {
+                lo[c] = min(lo[c], p.pos[c]);
+                hi[c] = max(hi[c], p.pos[c]);
+                sum[c] += p.pos[c];
+            }
+            sum[3] += v2;
+            vmax = max(vmax, v2);
+        }
+        double bounds = 0, sums = 0, extent = 0;
+        for (int c = 0; c < 3; c++)
+        {
+            bounds = max(bounds, max(fabs(s.lo[c] - lo[c]), fabs(s.hi[c] - hi[c])));
+            extent = max(extent, max(fabs(lo[c]), fabs(hi[c])));
+            sums = max(sums, fabs(s.sum[c] - sum[c]) / (n * extent));
+        }
+        sums = max(sums, fabs(s.sum[3] - sum[3]) / sum[3]);
+        report("cpu simd", "stats bounds", n, max(bounds / extent, fabs(s.vmax[0] - vmax) / vmax), TOL_FORCE);
+        report("cpu simd", "stats sums", n, sums, TOL_SUM);
+    }
+
+    size_t n = sizes.back();
+    double copy = hostcopy(n * sizeof(Particle));
+    cout << YELLO << "  cpu copy bandwidth " << fixed << setprecision(1) << copy << " GB/s" << defaultfloat << endl;
+    // The fused step reads and writes every particle once
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < REPS; r++)
+        cpustep(nullptr);
+    rate("cpu", "step", n, elapsed(start) / REPS, 2 * sizeof(Particle), copy);
+    Stats s;
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < REPS; r++)
+        cpustats(s);
+    rate("cpu simd", "stats", n, elapsed(start) / REPS, sizeof(Particle), copy);
+}
+
+static cl_kernel testkernel(const char *name)
+{
+    cl_kernel k = clCreateKernel(program, name, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create " << name << " kernel: " << ret << endl;
+        exit(1);
+    }
+    return k;
+}
+
+static void readback(cl_mem buf, vector<Particle> &dst)
+{
+    clEnqueueReadBuffer(command_queue, buf, CL_TRUE, 0, dst.size() * sizeof(Particle), dst.data(), 0, NULL, NULL);
+}
+
+// Enqueue a one-argument kernel over n particles
+static void launch(cl_kernel k, cl_mem buf, size_t n)
+{
+    clSetKernelArg(k, 0, sizeof(cl_mem), &buf);
+    clEnqueueNDRangeKernel(command_queue, k, 1, NULL, &n, NULL, 0, NULL, NULL);
+}
+
+// accelerate over n particles, padded like attraccelerate
+static void accelerate(cl_kernel k, cl_mem buf, size_t n)
+{
+    cl_int np = n;
+    clSetKernelArg(k, 0, sizeof(cl_mem), &buf);
+    clSetKernelArg(k, 4, sizeof(cl_int), &np);
+    attrlaunch(k, 1, n);
+}
+
+// The three cull passes over the particles in buf. The list has to be in particle order, as
+// long as the count of the draw arguments, and agree with the host away from the planes.
+static void checkcull(const string &device, cl_kernel count, cl_kernel scan, cl_kernel write, cl_mem buf, size_t n)
+{
+    size_t local = 64, global = (n + local - 1) / local * local;
+    cl_int np = n, ngroup = global / local;
+    float view[16];
+    cullview(view);
+    cl_float16 m;
+    memcpy(&m, view, sizeof(m));
+    cl_mem counts = clCreateBuffer(context, CL_MEM_READ_WRITE, ngroup * sizeof(int), NULL, &ret);
+    cl_mem starts = clCreateBuffer(context, CL_MEM_READ_WRITE, ngroup * sizeof(int), NULL, &ret);
+    cl_mem list = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_uint), NULL, &ret);
+    cl_mem args = clCreateBuffer(context, CL_MEM_READ_WRITE, 5 * sizeof(cl_uint), NULL, &ret);
+
+    clSetKernelArg(count, 0, sizeof(cl_mem), &buf);
+    clSetKernelArg(count, 1, sizeof(cl_int), &np);
+    clSetKernelArg(count, 2, sizeof(cl_float16), &m);
+    clSetKernelArg(count, 3, sizeof(cl_mem), &counts);
+    clSetKernelArg(scan, 0, sizeof(cl_mem), &counts);
+    clSetKernelArg(scan, 1, sizeof(cl_mem), &starts);
+    clSetKernelArg(scan, 2, sizeof(cl_int), &ngroup);
+    clSetKernelArg(scan, 3, sizeof(cl_mem), &args);
+    clSetKernelArg(scan, 4, local * sizeof(int), NULL);
+    clSetKernelArg(write, 0, sizeof(cl_mem), &buf);
+    clSetKernelArg(write, 1, sizeof(cl_int), &np);
+    clSetKernelArg(write, 2, sizeof(cl_float16), &m);
+    clSetKernelArg(write, 3, sizeof(cl_mem), &starts);
+    clSetKernelArg(write, 4, sizeof(cl_mem), &list);
+    clSetKernelArg(write, 5, local * sizeof(int), NULL);
+    clEnqueueNDRangeKernel(command_queue, count, 1, NULL, &global, &local, 0, NULL, NULL);
+    clEnqueueNDRangeKernel(command_queue, scan, 1, NULL, &local, &local, 0, NULL, NULL);
+    clEnqueueNDRangeKernel(command_queue, write, 1, NULL, &global, &local, 0, NULL, NULL);
+
+    cl_uint total = 0;
+    vector<cl_uint> got(n);
+    vector<Particle> ps(n);
+    clEnqueueReadBuffer(command_queue, args, CL_TRUE, 0, sizeof(total), &total, 0, NULL, NULL);
+    clEnqueueReadBuffer(command_queue, list, CL_TRUE, 0, n * sizeof(cl_uint), got.data(), 0, NULL, NULL);
+    readback(buf, ps);
+    size_t wrong = total > n;
+    vector<char> listed(n, 0);
+    for (size_t k = 0; k < min((size_t)total, n); k++)
+    {
+        wrong += got[k] >= n || (k && got[k] <= got[k - 1]);
+        if (got[k] < n)
+            listed[got[k]] = 1;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        int side = cullside(ps[i], view);
+        wrong += (side > 0 && !listed[i]) || (side < 0 && listed[i]);
+    }
+    report(device, "cull", n, wrong, 0);
+    for (cl_mem mem : {counts, starts, list, args})
+        clReleaseMemObject(mem);
+}
+
+// The struct layouts, then every kernel and the throughput of a step on the current device
+static void clsuite(const string &device, const vector<size_t> &sizes)
+{
+    cl_kernel ker_layout = testkernel("layout"), ker_init = testkernel("init"), ker_acc = testkernel("accelerate");
+    cl_kernel ker_move = testkernel("move"), ker_out = testkernel("zoomout"), ker_in = testkernel("zoomin");
+    cl_kernel ker_count = testkernel("cullcount"), ker_scan = testkernel("cullscan");
+    cl_kernel ker_write = testkernel("cullwrite");
+
+    // A stride mismatch shifts every particle after the first, so check the sizes outright
+    int sizes_cl[7] = {0};
+    int sizes_host[7] = {(int)sizeof(Particle),  (int)sizeof(Mass),     (int)sizeof(Attractor), (int)sizeof(Stats),
+                         (int)sizeof(SphParams), (int)sizeof(Instance), (int)sizeof(SimParams)};
+    cl_mem out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(sizes_cl), NULL, &ret);
+    clSetKernelArg(ker_layout, 0, sizeof(cl_mem), &out);
+    size_t one = 1;
+    clEnqueueNDRangeKernel(command_queue, ker_layout, 1, NULL, &one, NULL, 0, NULL, NULL);
+    clEnqueueReadBuffer(command_queue, out, CL_TRUE, 0, sizeof(sizes_cl), sizes_cl, 0, NULL, NULL);
+    clReleaseMemObject(out);
+    int mismatched = 0;
+    const char *names[7] = {"Particle", "Mass", "Attractor", "Stats", "SphParams", "Instance", "SimParams"};
+    for (int k = 0; k < 7; k++)
+        if (sizes_cl[k] != sizes_host[k])
+        {
+            cout << RED << "  " << names[k] << " is " << sizes_host[k] << " bytes on the host and " << sizes_cl[k]
+                 << " in kernel.cl" << endl;
+            mismatched++;
+        }
+    report(device, "struct layout", 7, mismatched, 0);
+
+    cl_mem params = paramsbuffer();
+    clSetKernelArg(ker_acc, 5, sizeof(cl_mem), &params);
+    clSetKernelArg(ker_move, 5, sizeof(cl_mem), &params);
+    clSetKernelArg(ker_out, 1, sizeof(cl_mem), &params);
+    clSetKernelArg(ker_in, 1, sizeof(cl_mem), &params);
+
+    cl_mem buf = nullptr;
+    for (size_t n : sizes)
+    {
+        vector<Particle> got(n);
+        if (buf)
+            clReleaseMemObject(buf);
+        buf = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(Particle), NULL, &ret);
+        if (ret != CL_SUCCESS)
+        {
+            cout << RED << "Failed to create test buffer: " << ret << endl;
+            exit(1);
+        }
+
+        // The host rng.h is the reference for the distributions
+        const char *shapes[] = {"init cube", "init disk", "init plummer", "init shells"};
+        for (cl_int shape = SH_CUBE; shape <= SH_SHELLS; shape++)
+        {
+            cl_ulong seed = SEED;
+            clSetKernelArg(ker_init, 1, sizeof(cl_int), &shape);
+            clSetKernelArg(ker_init, 2, sizeof(cl_ulong), &seed);
+            launch(ker_init, buf, n);
+            readback(buf, got);
+            vector<Ref> ref(n);
+            for (size_t i = 0; i < n; i++)
+            {
+                float pos[3];
+                rng_initpos(shape, i, SEED, pos);
+                for (int c = 0; c < 3; c++)
+                    ref[i].pos[c] = pos[c], ref[i].vel[c] = 0;
+            }
+            // The cube is the same to the bit, the other shapes go through the math library
+            report(device, shapes[shape], n, error(got.data(), ref), shape == SH_CUBE ? 0 : TOL_INIT);
+        }
+
+        vector<Particle> ps = startstate(n);
+        vector<Ref> ref = reference(ps);
+        clEnqueueWriteBuffer(command_queue, buf, CL_TRUE, 0, n * sizeof(Particle), ps.data(), 0, NULL, NULL);
+
+        accelerate(ker_acc, buf, n);
+        readback(buf, got);
+        refaccelerate(ref);
+        report(device, "accelerate", n, error(got.data(), ref), TOL_FORCE);
+
+        cl_uint step = 0;
+        cl_ulong seed = SEED;
+        cl_int mixed = 0;
+        clSetKernelArg(ker_move, 1, sizeof(Mass), &sim.mouse);
+        clSetKernelArg(ker_move, 2, sizeof(cl_uint), &step);
+        clSetKernelArg(ker_move, 3, sizeof(cl_ulong), &seed);
+        clSetKernelArg(ker_move, 4, sizeof(cl_int), &mixed);
+        launch(ker_move, buf, n);
+        readback(buf, got);
+        refmove(ref);
+        report(device, "move", n, error(got.data(), ref), TOL_FORCE);
+
+        launch(ker_out, buf, n);
+        readback(buf, got);
+        refzoom(ref, sim.params.zoomout);
+        report(device, "zoomout", n, error(got.data(), ref), TOL_FORCE);
+
+        launch(ker_in, buf, n);
+        readback(buf, got);
+        refzoom(ref, sim.params.zoomin);
+        report(device, "zoomin", n, error(got.data(), ref), TOL_FORCE);
+
+        // The mixed-precision drift has to give the host's bits exactly
+        mixed = 1;
+        clSetKernelArg(ker_move, 4, sizeof(cl_int), &mixed);
+        for (int r = 0; r < REPS; r++)
+        {
+            launch(ker_move, buf, n);
+            for (Particle &p : got)
+            {
+                rng_u32 w;
+                memcpy(&w, &p.pos[3], sizeof(w));
+                for (int c = 0; c < 3; c++)
+                    p.pos[c] = dr_drift(p.pos[c], sim.params.dt * p.vel[c], &w, c);
+                memcpy(&p.pos[3], &w, sizeof(w));
+            }
+        }
+        vector<Particle> mine = got;
+        readback(buf, got);
+        size_t differ = 0;
+        for (size_t i = 0; i < n; i++)
+            differ += memcmp(&got[i], &mine[i], sizeof(Particle)) != 0;
+        report(device, "move mixed", n, differ, 0);
+        mixed = 0;
+        clSetKernelArg(ker_move, 4, sizeof(cl_int), &mixed);
+
+        checkcull(device, ker_count, ker_scan, ker_write, buf, n);
+    }
+
+    // Device copy bandwidth against a step, accelerate and move each read a particle and write a row
+    size_t n = sizes.back(), bytes = n * sizeof(Particle);
+    cl_mem copy = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &ret);
+    double best = INFINITY;
+    for (int r = 0; r < REPS; r++)
+    {
+        auto start = chrono::steady_clock::now();
+        clEnqueueCopyBuffer(command_queue, buf, copy, 0, 0, bytes, 0, NULL, NULL);
+        clFinish(command_queue);
+        best = min(best, elapsed(start));
+    }
+    double gbs = 2 * bytes / best / 1e9;
+    cout << YELLO << "  " << device << " copy bandwidth " << fixed << setprecision(1) << gbs << " GB/s"
+         << defaultfloat << endl;
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < REPS; r++)
+    {
+        accelerate(ker_acc, buf, n);
+        launch(ker_move, buf, n);
+    }
+    clFinish(command_queue);
+    rate(device, "step", n, elapsed(start) / REPS, 3 * sizeof(Particle), gbs);
+
+    clReleaseMemObject(copy);
+    clReleaseMemObject(buf);
+    for (cl_kernel k : {ker_layout, ker_init, ker_acc, ker_move, ker_out, ker_in, ker_count, ker_scan, ker_write})
+        clReleaseKernel(k);
+}
+
+// Every device of every platform in turn, a GPU-less box has its CPU runtime if any
+static void cldevices(const vector<size_t> &sizes)
+{
+    cl_uint nplatforms = 0;
+    if (clGetPlatformIDs(0, NULL, &nplatforms) != CL_SUCCESS || !nplatforms)
+    {
+        cout << ORANGE << "  No OpenCL platform, skipping the OpenCL kernels" << endl;
+        return;
+    }
+    vector<cl_platform_id> platforms(nplatforms);
+    clGetPlatformIDs(nplatforms, platforms.data(), NULL);
+    int index = 0;
+    for (cl_platform_id platform : platforms)
+    {
+        cl_uint count = 0;
+        if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &count) != CL_SUCCESS || !count)
+            continue;
+        vector<cl_device_id> devices(count);
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, count, devices.data(), NULL);
+        for (cl_device_id device : devices)
+        {
+            char name[256];
+            clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+            cout << WHITE << "OpenCL device " << index << ": " << name << endl;
+            device_id = device;
+            cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0};
+            context = clCreateContext(properties, 1, &device, NULL, NULL, &ret);
+            if (ret != CL_SUCCESS)
+            {
+                cout << RED << "Failed to create OpenCL context: " << ret << endl;
+                exit(1);
+            }
+            clprogram();
+            clsuite("cl " + to_string(index++), sizes);
+            attrend();
+            clprogramend();
+        }
+    }
+}
+
+// Check every kernel on a small input and on n particles, then time them. Returns the exit status.
+int selftest()
+{
+    vector<size_t> sizes = {1000};
+    if (sim.n > 1000)
+        sizes.push_back(sim.n);
+    opts.headless = true;
+    startattractors();
+
+    cout << WHITE << "Native CPU backend, " << max(1u, thread::hardware_concurrency()) << " threads" << endl;
+    cpusuite(sizes);
+    cldevices(sizes);
+
+    attrclear();
+    cout << (failures ? RED : GREEN) << checks - failures << " of " << checks << " checks passed" << endl;
+    return failures ? 1 : 0;
+}
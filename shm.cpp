@@ -0,0 +1,125 @@
+#include "particle.hpp"
+#include "shmreader.hpp"
+using namespace std;
+
+static ShmHeader *header = nullptr; // the mapped ring
+static char *frames = nullptr;      // first frame of the ring
+static size_t size = 0;             // bytes mapped
+static string path;                 // shm_open name
+static uint64_t written = 0;        // frames started
+static long dropped = 0;            // frames skipped because their slot was still being written
+static atomic<int> pending{0};      // device writes whose callback has not run yet
+
+// Create the ring and fill in the header, magic last so readers never see half of it
+void shminit()
+{
+    uint32_t stride = opts.shmvel ? sizeof(Particle) : sizeof(Particle::pos);
+    path = opts.shm[0] == '/' ? opts.shm : "/" + opts.shm;
+    size = shmsize(sim.n, stride);
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size))
+    {
+        cout << RED << "Failed to create shared memory " << path << endl;
+        exit(1);
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        cout << RED << "Failed to map shared memory " << path << endl;
+        exit(1);
+    }
+    header = new (p) ShmHeader();
+    header->n = sim.n;
+    header->stride = stride;
+    header->nslot = SHM_NSLOT;
+    header->dataoffset = shmsize(0, 0);
+    frames = (char *)p + header->dataoffset;
+    atomic_thread_fence(memory_order_release);
+    header->magic = SHM_MAGIC;
+    cout << YELLO << "Publishing frames in shared memory " << path << endl;
+}
+
+// Close the slot of frame f and advance the frame count past it, unless a later frame
+// finished first
+static void shmcommit(uint64_t f, long step)
+{
+    ShmSlot &slot = header->slots[f % SHM_NSLOT];
+    slot.step = step;
+    slot.seq.fetch_add(1, memory_order_release);
+    uint64_t done = header->frames.load(memory_order_relaxed);
+    while (done < f + 1 && !header->frames.compare_exchange_weak(done, f + 1, memory_order_release))
+        ;
+}
+
+struct ShmWrite
+{
+    uint64_t frame;
+    long step;
+};
+
+// Runs on a driver thread once the device has written the slot
+static void CL_CALLBACK shmdone(cl_event, cl_int, void *data)
+{
+    ShmWrite *w = (ShmWrite *)data;
+    shmcommit(w->frame, w->step);
+    delete w;
+    pending--;
+}
+
+// Publish the state after a step. On OpenCL the device writes straight into the slot and
+// a callback closes it, so the frame loop never waits. If the slot of this frame is still
+// being written from SHM_NSLOT frames ago the frame is dropped instead.
+void shmpublish()
+{
+    TraceScope scope("shm");
+    uint64_t f = written;
+    ShmSlot &slot = header->slots[f % SHM_NSLOT];
+    if (slot.seq.load(memory_order_acquire) & 1)
+    {
+        dropped++;
+        return;
+    }
+    written++;
+    slot.seq.fetch_add(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    char *dst = frames + (f % SHM_NSLOT) * header->n * header->stride;
+    if (opts.backend == BK_CL && !opts.chunk)
+    {
+        // Positions only is a strided copy, 16 of every 32 bytes
+        size_t origin[3] = {0, 0, 0};
+        size_t region[3] = {header->stride, (size_t)sim.n, 1};
+        cl_event read;
+        clacquire("shm");
+        clEnqueueReadBufferRect(command_queue, sim.particles, CL_FALSE, origin, origin, region, sizeof(Particle), 0,
+                                header->stride, 0, dst, 0, NULL, &read);
+        clrelease("shm");
+        pending++;
+        clSetEventCallback(read, CL_COMPLETE, shmdone, new ShmWrite{f, nstep});
+        clReleaseEvent(read);
+        clFlush(command_queue);
+        return;
+    }
+
+    const Particle *src = opts.chunk ? oocdata() : cpudata();
+    size_t stride = header->stride;
+    parallel(sim.n, [=](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            memcpy(dst + i * stride, &src[i], stride);
+    });
+    shmcommit(f, nstep);
+}
+
+void shmend()
+{
+    // The callbacks may run after clFinish returns, they still write to the header
+    if (opts.backend == BK_CL && !opts.chunk)
+        clFinish(command_queue);
+    while (pending)
+        this_thread::yield();
+    if (dropped)
+        cout << YELLO << dropped << " frames were not published, the device was still writing their slot" << endl;
+    munmap(header, size);
+    shm_unlink(path.c_str());
+}
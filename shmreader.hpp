@@ -0,0 +1,164 @@
+// Reader for the particle frames published with --shm. Header only, needs nothing from the
+// rest of the simulation: include it in a tool and link with -lrt on older glibc.
+//
+//     ShmReader reader;
+//     if (reader.open("particles"))
+//     {
+//         ShmFrame f;
+//         if (const float *p = reader.newest(f))
+//         {
+//             ... reader.particles() records of reader.floats() floats each, xyzw [+ velocity] ...
+//             ... w is padding, or the extra position bits of --mixed-precision, see drift.h ...
+//             if (!reader.still(f))
+//                 ... the writer came round to this slot meanwhile, read again ...
+//         }
+//     }
+#ifndef SHMREADER_HPP
+#define SHMREADER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x314d5350 // "PSM1"
+#define SHM_NSLOT 4          // frames kept in the ring
+#define SHM_RETRIES 64       // passes newest() makes over the ring before giving up
+
+// One frame of the ring. seq is odd while the slot is being written, the seqlock readers
+// check it before and after reading.
+struct ShmSlot
+{
+    std::atomic<uint64_t> seq; // bumped before and after every write
+    uint64_t step;             // simulation step of the frame
+};
+
+// Start of the shared memory, the frames follow at dataoffset
+struct ShmHeader
+{
+    uint32_t magic;               // SHM_MAGIC once the writer has set up the header
+    uint32_t n;                   // particles per frame
+    uint32_t stride;              // bytes per particle: 16 for xyzw, 32 with the velocity
+    uint32_t nslot;               // frames in the ring
+    uint64_t dataoffset;          // bytes from the start to the first frame
+    std::atomic<uint64_t> frames; // frames completed, the newest is in slot (frames - 1) % nslot
+    ShmSlot slots[SHM_NSLOT];
+};
+
+// Bytes of a ring for n particles of stride bytes
+inline size_t shmsize(uint32_t n, uint32_t stride)
+{
+    return (sizeof(ShmHeader) + 63) / 64 * 64 + (size_t)SHM_NSLOT * n * stride;
+}
+
+// What newest() handed out, to check it with still()
+struct ShmFrame
+{
+    uint32_t slot{0};
+    uint64_t seq{0};
+    uint64_t step{0};
+};
+
+class ShmReader
+{
+  public:
+    ShmReader() = default;
+    ShmReader(const ShmReader &) = delete;
+    ShmReader &operator=(const ShmReader &) = delete;
+    ~ShmReader()
+    {
+        close();
+    }
+
+    // Attach to the ring published under name, false if there is none yet
+    bool open(const std::string &name)
+    {
+        close();
+        std::string path = name[0] == '/' ? name : "/" + name;
+        int fd = shm_open(path.c_str(), O_RDONLY, 0);
+        struct stat st;
+        if (fd < 0)
+            return false;
+        if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ShmHeader))
+        {
+            ::close(fd);
+            return false;
+        }
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        base = (const char *)p;
+        size = st.st_size;
+        if (header()->magic != SHM_MAGIC || shmsize(header()->n, header()->stride) > size)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (base)
+            munmap((void *)base, size);
+        base = nullptr;
+        size = 0;
+    }
+
+    uint32_t particles() const
+    {
+        return header()->n;
+    }
+
+    // Floats per particle, 4 or 8
+    uint32_t floats() const
+    {
+        return header()->stride / sizeof(float);
+    }
+
+    // Newest complete frame, read in place, or nullptr before the first one. A slot the writer
+    // is in makes it take the frame before, and it gives up with nullptr after SHM_RETRIES
+    // passes that found every slot being written.
+    const float *newest(ShmFrame &f) const
+    {
+        const ShmHeader *h = header();
+        for (int pass = 0; pass < SHM_RETRIES; pass++)
+        {
+            uint64_t k = h->frames.load(std::memory_order_acquire);
+            if (!k)
+                return nullptr;
+            for (uint64_t back = 0; back < k && back < h->nslot; back++)
+            {
+                f.slot = (k - 1 - back) % h->nslot;
+                f.seq = h->slots[f.slot].seq.load(std::memory_order_acquire);
+                if (f.seq & 1)
+                    continue;
+                f.step = h->slots[f.slot].step;
+                return (const float *)(base + h->dataoffset + (size_t)f.slot * h->n * h->stride);
+            }
+        }
+        return nullptr;
+    }
+
+    // Whether the frame from newest() was left alone while it was being read
+    bool still(const ShmFrame &f) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return header()->slots[f.slot].seq.load(std::memory_order_relaxed) == f.seq;
+    }
+
+  private:
+    const ShmHeader *header() const
+    {
+        return (const ShmHeader *)base;
+    }
+
+    const char *base{nullptr};
+    size_t size{0};
+};
+
+#endif
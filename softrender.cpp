@@ -0,0 +1,198 @@
+#include "particle.hpp"
+#include <atomic>
+#include <chrono>
+using namespace std;
+
+static const int TILE = 32; // tile edge in pixels, one thread owns a tile while accumulating it
+
+// A projected point, in pixels with the origin bottom-left like the GL framebuffer
+struct Splat
+{
+    float x, y;
+    float r, g, b;
+};
+
+static int tx, ty;                    // tiles across and down
+static vector<Splat> splats;          // projected particles, x < 0 when clipped
+static vector<uint32_t> order;        // particle indices binned by tile
+static vector<uint32_t> counts;       // per thread per tile counts, then offsets
+static vector<float> fb;              // float RGB accumulation buffer
+static vector<unsigned char> pixels;  // 8-bit RGB output
+static vector<Particle> state;        // particles read back from the device
+static size_t nthreads;
+
+// Same as hsv2rgb in particle.fs
+static void hsv2rgb(float h, float s, float v, float *rgb)
+{
+    const float k[4] = {1.0f, 2.0f / 3.0f, 1.0f / 3.0f, 3.0f};
+    for (int c = 0; c < 3; c++)
+    {
+        float f = h + k[c];
+        float p = fabsf((f - floorf(f)) * 6.0f - k[3]);
+        p = min(max(p - k[0], 0.0f), 1.0f);
+        rgb[c] = v * (k[0] + (p - k[0]) * s);
+    }
+}
+
+// Pixel range a point of size pt covers along one axis, following the GL point rule
+static void covered(float c, int size, int &lo, int &hi)
+{
+    lo = max((int)ceilf(c - g_bufs.pt / 2 - 0.5f), 0);
+    hi = min((int)ceilf(c + g_bufs.pt / 2 - 0.5f) - 1, size - 1);
+}
+
+void softinit()
+{
+    nthreads = parallelthreads();
+    tx = (W + TILE - 1) / TILE;
+    ty = (H + TILE - 1) / TILE;
+    counts.resize(nthreads * tx * ty);
+    fb.resize((size_t)W * H * 3);
+    pixels.resize((size_t)W * H * 3);
+    // Headless runs never reach glbuffers
+    glprojection();
+}
+
+// Project, bin by tile and additively splat the particles into the framebuffer
+void softframe(const Particle *ps, int n)
+{
+    float m[16];
+    viewmatrix(m);
+    splats.resize(n);
+    fill(counts.begin(), counts.end(), 0);
+    size_t ntiles = (size_t)tx * ty;
+
+    // Project and colour every particle, counting how many land in each tile
+    parallel(n, [&](size_t t, size_t begin, size_t end) {
+        uint32_t *count = &counts[t * ntiles];
+        for (size_t i = begin; i < end; i++)
+        {
+            const float *p = ps[i].pos;
+            float clip[4];
+            for (int r = 0; r < 4; r++)
+                clip[r] = p[0] * m[r] + p[1] * m[4 + r] + p[2] * m[8 + r] + m[12 + r];
+            Splat &s = splats[i];
+            s.x = -1;
+            if (clip[3] <= 0 || fabsf(clip[0]) > clip[3] || fabsf(clip[1]) > clip[3] || fabsf(clip[2]) > clip[3])
+                continue;
+            s.x = (clip[0] / clip[3] * 0.5f + 0.5f) * W;
+            s.y = (clip[1] / clip[3] * 0.5f + 0.5f) * H;
+
+            float dx = p[0] - sim.mouse.x, dy = p[1] - sim.mouse.y, dz = p[2];
+            float d = sqrtf(dx * dx + dy * dy + dz * dz);
+            float rgb[3];
+            hsv2rgb(hsv[0] - d / 7, hsv[1], hsv[2], rgb);
+            s.r = rgb[0];
+            s.g = rgb[1];
+            s.b = rgb[2];
+
+            int x0, x1, y0, y1;
+            covered(s.x, W, x0, x1);
+            covered(s.y, H, y0, y1);
+            for (int y = y0 / TILE; y <= y1 / TILE && x0 <= x1; y++)
+                for (int x = x0 / TILE; x <= x1 / TILE && y0 <= y1; x++)
+                    count[y * tx + x]++;
+        }
+    });
+
+    // Offsets ordered by tile then thread, so each tile's particles are contiguous
+    uint32_t total = 0;
+    for (size_t tile = 0; tile < ntiles; tile++)
+        for (size_t t = 0; t < nthreads; t++)
+        {
+            uint32_t c = counts[t * ntiles + tile];
+            counts[t * ntiles + tile] = total;
+            total += c;
+        }
+    order.resize(total);
+    vector<uint32_t> tilestart(ntiles + 1);
+    for (size_t tile = 0; tile < ntiles; tile++)
+        tilestart[tile] = counts[tile];
+    tilestart[ntiles] = total;
+
+    // Scatter particle indices into their tiles, same split as the counting pass
+    parallel(n, [&](size_t t, size_t begin, size_t end) {
+        uint32_t *offset = &counts[t * ntiles];
+        for (size_t i = begin; i < end; i++)
+        {
+            const Splat &s = splats[i];
+            if (s.x < 0)
+                continue;
+            int x0, x1, y0, y1;
+            covered(s.x, W, x0, x1);
+            covered(s.y, H, y0, y1);
+            for (int y = y0 / TILE; y <= y1 / TILE && x0 <= x1; y++)
+                for (int x = x0 / TILE; x <= x1 / TILE && y0 <= y1; x++)
+                    order[offset[y * tx + x]++] = i;
+        }
+    });
+
+    // Accumulate tile by tile, a tile belongs to one thread so no atomics are needed
+    atomic<size_t> next(0);
+    parallel(nthreads, [&](size_t, size_t, size_t) {
+        for (size_t tile; (tile = next++) < ntiles;)
+        {
+            int tx0 = tile % tx * TILE, ty0 = tile / tx * TILE;
+            int tx1 = min(tx0 + TILE, (int)W) - 1, ty1 = min(ty0 + TILE, (int)H) - 1;
+            for (int y = ty0; y <= ty1; y++)
+                for (int x = tx0; x <= tx1; x++)
+                {
+                    float *px = &fb[((size_t)y * W + x) * 3];
+                    px[0] = px[1] = px[2] = g_bufs.bl;
+                }
+            for (uint32_t k = tilestart[tile]; k < tilestart[tile + 1]; k++)
+            {
+                const Splat &s = splats[order[k]];
+                int x0, x1, y0, y1;
+                covered(s.x, W, x0, x1);
+                covered(s.y, H, y0, y1);
+                for (int y = max(y0, ty0); y <= min(y1, ty1); y++)
+                    for (int x = max(x0, tx0); x <= min(x1, tx1); x++)
+                    {
+                        float *px = &fb[((size_t)y * W + x) * 3];
+                        px[0] += s.r;
+                        px[1] += s.g;
+                        px[2] += s.b;
+                    }
+            }
+            for (int y = ty0; y <= ty1; y++)
+                for (int x = tx0; x <= tx1; x++)
+                    for (int c = 0; c < 3; c++)
+                    {
+                        size_t idx = ((size_t)y * W + x) * 3 + c;
+                        pixels[idx] = (unsigned char)(min(fb[idx], 1.0f) * 255.0f + 0.5f);
+                    }
+        }
+    });
+}
+
+// Simulate without a GPU context and rasterize frames on the CPU
+void softrun()
+{
+    long frames = opts.steps ? opts.steps : replaylength();
+    if (!frames)
+        frames = 600;
+    // A pattern with a frame number writes every frame, a plain name only the last one
+    bool sequence = opts.out.find('%') != string::npos;
+
+    softinit();
+    state.resize(sim.n);
+    auto start = chrono::steady_clock::now();
+    for (long frame = 0; frame < frames; frame++)
+    {
+        replayfeed();
+        inputapply();
+        step();
+        if (opts.out.empty() || (!sequence && frame != frames - 1))
+            continue;
+
+        simread(state.data());
+        softframe(state.data(), sim.n);
+        char path[1024];
+        snprintf(path, sizeof(path), opts.out.c_str(), (int)frame);
+        writeimage(path, W, H, pixels.data());
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << GREEN << frames << " frames at " << W << "x" << H << " in " << secs << " s (" << frames / secs
+         << " FPS)" << endl;
+}
@@ -0,0 +1,259 @@
+#include "particle.hpp"
+using namespace std;
+
+static const size_t SPH_LOCAL = 64;   // work-group size of the neighbour passes
+static const size_t SCAN_LOCAL = 256; // work-group size of the single-group cell scan
+static const int GMAX = 128;          // most grid cells per axis
+static const float NEIGHBOURS = 32;   // particles within h at rest density
+static const float EXTENT = 1.0f;     // the grid covers [-EXTENT, EXTENT] on every axis
+
+static SphParams sph;
+static int ncell;
+
+static cl_kernel ker_count, ker_scan, ker_scatter, ker_density, ker_force;
+static cl_mem cellof, cellcount, start, cursor, occupied, noccupied, sorted, perm, density;
+
+static vector<int> hcellof, hcount, hstart, hcursor, hperm; // CPU versions of the same buffers
+static vector<Particle> hsorted;
+static vector<float> hdensity;
+
+// Smoothing length from the particle count so that every particle has about NEIGHBOURS
+// neighbours in the initial cloud. Stiffness and viscosity are scaled by h so the
+// options give the same behaviour at any particle count.
+static void sphparams()
+{
+    const float pi = 3.1415926f;
+    const float volumes[] = {8.0f / 27, pi * 2 / 3, 0.5f, 2.0f}; // roughly, per SH_* shape
+    float volume = volumes[opts.shape];
+    float h = cbrtf(3 * volume * NEIGHBOURS / (4 * pi * sim.n));
+    sph.h = h;
+    sph.h2 = h * h;
+    sph.mass = 1.0f / sim.n;
+    sph.rho0 = 1 / volume;
+    sph.stiffness = opts.sphk * h;
+    sph.viscosity = opts.sphmu * h * h;
+    sph.poly6 = 315 / (64 * pi * powf(h, 9));
+    sph.spiky = 45 / (pi * powf(h, 6));
+    sph.visclap = 45 / (pi * powf(h, 6));
+    sph.cell = max(h, 2 * EXTENT / GMAX);
+    sph.lo = -EXTENT;
+    sph.g = min((int)ceilf(2 * EXTENT / sph.cell), GMAX);
+    ncell = sph.g * sph.g * sph.g;
+    cout << YELLO << "SPH: h " << h << ", " << sph.g << "^3 cells" << endl;
+}
+
+static cl_mem sphbuffer(size_t size)
+{
+    cl_mem mem = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create SPH buffer: " << ret << endl;
+        exit(1);
+    }
+    return mem;
+}
+
+static cl_kernel sphkernel(const char *name)
+{
+    cl_kernel k = clCreateKernel(program, name, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create " << name << " kernel: " << ret << endl;
+        exit(1);
+    }
+    return k;
+}
+
+void sphinit()
+{
+    sphparams();
+    if (opts.backend == BK_CPU)
+    {
+        hcellof.resize(sim.n);
+        hperm.resize(sim.n);
+        hsorted.resize(sim.n);
+        hdensity.resize(sim.n);
+        hcount.resize(ncell);
+        hstart.resize(ncell);
+        hcursor.resize(ncell);
+        return;
+    }
+
+    cellof = sphbuffer(sim.n * sizeof(int));
+    cellcount = sphbuffer(ncell * sizeof(int));
+    start = sphbuffer(ncell * sizeof(int));
+    cursor = sphbuffer(ncell * sizeof(int));
+    occupied = sphbuffer(ncell * sizeof(int));
+    noccupied = sphbuffer(sizeof(int));
+    sorted = sphbuffer(sim.n * sizeof(Particle));
+    perm = sphbuffer(sim.n * sizeof(int));
+    density = sphbuffer(sim.n * sizeof(float));
+
+    ker_count = sphkernel("sphcount");
+    ker_scan = sphkernel("sphscan");
+    ker_scatter = sphkernel("sphscatter");
+    ker_density = sphkernel("sphdensity");
+    ker_force = sphkernel("sphforce");
+
+    clSetKernelArg(ker_count, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_count, 1, sizeof(cl_mem), &cellof);
+    clSetKernelArg(ker_count, 2, sizeof(cl_mem), &cellcount);
+    clSetKernelArg(ker_count, 3, sizeof(SphParams), &sph);
+
+    clSetKernelArg(ker_scan, 0, sizeof(cl_mem), &cellcount);
+    clSetKernelArg(ker_scan, 1, sizeof(cl_mem), &start);
+    clSetKernelArg(ker_scan, 2, sizeof(cl_mem), &cursor);
+    clSetKernelArg(ker_scan, 3, sizeof(cl_mem), &occupied);
+    clSetKernelArg(ker_scan, 4, sizeof(cl_mem), &noccupied);
+    clSetKernelArg(ker_scan, 5, sizeof(int), &ncell);
+    clSetKernelArg(ker_scan, 6, SCAN_LOCAL * sizeof(int), NULL);
+    clSetKernelArg(ker_scan, 7, SCAN_LOCAL * sizeof(int), NULL);
+
+    clSetKernelArg(ker_scatter, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_scatter, 1, sizeof(cl_mem), &cellof);
+    clSetKernelArg(ker_scatter, 2, sizeof(cl_mem), &cursor);
+    clSetKernelArg(ker_scatter, 3, sizeof(cl_mem), &sorted);
+    clSetKernelArg(ker_scatter, 4, sizeof(cl_mem), &perm);
+
+    clSetKernelArg(ker_density, 0, sizeof(cl_mem), &sorted);
+    clSetKernelArg(ker_density, 1, sizeof(cl_mem), &start);
+    clSetKernelArg(ker_density, 2, sizeof(cl_mem), &cellcount);
+    clSetKernelArg(ker_density, 3, sizeof(cl_mem), &occupied);
+    clSetKernelArg(ker_density, 4, sizeof(cl_mem), &density);
+    clSetKernelArg(ker_density, 5, sizeof(SphParams), &sph);
+    clSetKernelArg(ker_density, 6, SPH_LOCAL * sizeof(cl_float4), NULL);
+
+    clSetKernelArg(ker_force, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_force, 1, sizeof(cl_mem), &sorted);
+    clSetKernelArg(ker_force, 2, sizeof(cl_mem), &start);
+    clSetKernelArg(ker_force, 3, sizeof(cl_mem), &cellcount);
+    clSetKernelArg(ker_force, 4, sizeof(cl_mem), &occupied);
+    clSetKernelArg(ker_force, 5, sizeof(cl_mem), &perm);
+    clSetKernelArg(ker_force, 6, sizeof(cl_mem), &density);
+    clSetKernelArg(ker_force, 7, sizeof(SphParams), &sph);
+    clSetKernelArg(ker_force, 8, SPH_LOCAL * sizeof(cl_float4), NULL);
+    clSetKernelArg(ker_force, 9, SPH_LOCAL * sizeof(cl_float4), NULL);
+    cl_mem params = paramsbuffer();
+    clSetKernelArg(ker_force, 10, sizeof(cl_mem), &params);
+}
+
+// Enqueue one SPH step on the shared particle buffer: bin into cells, sort, then the
+// density and force passes over the occupied cells. Only the occupied cell count is read back.
+void sphstep()
+{
+    size_t n = sim.n, scan = SCAN_LOCAL, local = SPH_LOCAL;
+    int zero = 0, nocc = 0;
+    clEnqueueFillBuffer(command_queue, cellcount, &zero, sizeof(int), 0, ncell * sizeof(int), 0, NULL, NULL);
+    clEnqueueNDRangeKernel(command_queue, ker_count, 1, NULL, &n, NULL, 0, NULL, NULL);
+    clEnqueueNDRangeKernel(command_queue, ker_scan, 1, NULL, &scan, &scan, 0, NULL, NULL);
+    clEnqueueNDRangeKernel(command_queue, ker_scatter, 1, NULL, &n, NULL, 0, NULL, traceev("sph grid"));
+    clEnqueueReadBuffer(command_queue, noccupied, CL_TRUE, 0, sizeof(int), &nocc, 0, NULL, NULL);
+
+    size_t groups = nocc * SPH_LOCAL;
+    clEnqueueNDRangeKernel(command_queue, ker_density, 1, NULL, &groups, &local, 0, NULL, traceev("sph density"));
+    ret = clEnqueueNDRangeKernel(command_queue, ker_force, 1, NULL, &groups, &local, 0, NULL, traceev("sph force"));
+}
+
+void sphend()
+{
+    if (opts.backend == BK_CPU)
+        return;
+    clReleaseKernel(ker_count);
+    clReleaseKernel(ker_scan);
+    clReleaseKernel(ker_scatter);
+    clReleaseKernel(ker_density);
+    clReleaseKernel(ker_force);
+    for (cl_mem mem : {cellof, cellcount, start, cursor, occupied, noccupied, sorted, perm, density})
+        clReleaseMemObject(mem);
+}
+
+// Same as sphcellof in kernel.cl
+static int cellcoord(float x)
+{
+    return min(max((int)floorf((x - sph.lo) / sph.cell), 0), sph.g - 1);
+}
+
+// Call f(q) for every sorted particle q in the cells around sorted particle k
+template <typename F>
+static void neighbours(size_t k, F f)
+{
+    int cell = hcellof[hperm[k]];
+    int cx = cell % sph.g, cy = cell / sph.g % sph.g, cz = cell / (sph.g * sph.g);
+    for (int z = max(cz - 1, 0); z <= min(cz + 1, sph.g - 1); z++)
+        for (int y = max(cy - 1, 0); y <= min(cy + 1, sph.g - 1); y++)
+            for (int x = max(cx - 1, 0); x <= min(cx + 1, sph.g - 1); x++)
+            {
+                int nc = (z * sph.g + y) * sph.g + x;
+                for (int q = hstart[nc]; q < hstart[nc] + hcount[nc]; q++)
+                    f(q);
+            }
+}
+
+// The SPH step of the CPU backend, the same passes as the kernels. The sort is a serial
+// counting sort, which keeps the order within a cell and so the results reproducible.
+void sphcpu(Particle *ps)
+{
+    parallel(sim.n, [ps](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            const float *p = ps[i].pos;
+            hcellof[i] = (cellcoord(p[2]) * sph.g + cellcoord(p[1])) * sph.g + cellcoord(p[0]);
+        }
+    });
+    fill(hcount.begin(), hcount.end(), 0);
+    for (int i = 0; i < sim.n; i++)
+        hcount[hcellof[i]]++;
+    for (int c = 0, s = 0; c < ncell; c++)
+    {
+        hstart[c] = hcursor[c] = s;
+        s += hcount[c];
+    }
+    for (int i = 0; i < sim.n; i++)
+    {
+        int k = hcursor[hcellof[i]]++;
+        hsorted[k] = ps[i];
+        hperm[k] = i;
+    }
+
+    parallel(sim.n, [](size_t, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++)
+        {
+            const float *p = hsorted[k].pos;
+            float rho = 0;
+            neighbours(k, [&](int q) {
+                const float *o = hsorted[q].pos;
+                float rx = p[0] - o[0], ry = p[1] - o[1], rz = p[2] - o[2];
+                float d = sph.h2 - (rx * rx + ry * ry + rz * rz);
+                if (d > 0)
+                    rho += d * d * d;
+            });
+            hdensity[k] = sph.mass * sph.poly6 * rho;
+        }
+    });
+
+    parallel(sim.n, [ps](size_t, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++)
+        {
+            const float *p = hsorted[k].pos, *v = hsorted[k].vel;
+            float pi = max(sph.stiffness * (hdensity[k] - sph.rho0), 0.0f) / (hdensity[k] * hdensity[k]);
+            float a[3] = {0, 0, 0};
+            neighbours(k, [&](int q) {
+                const float *o = hsorted[q].pos, *ov = hsorted[q].vel;
+                float r3[3] = {p[0] - o[0], p[1] - o[1], p[2] - o[2]};
+                float r2 = r3[0] * r3[0] + r3[1] * r3[1] + r3[2] * r3[2];
+                if (r2 >= sph.h2 || r2 < 1e-12f)
+                    return;
+                float r = sqrtf(r2);
+                float rhoj = hdensity[q];
+                float pj = max(sph.stiffness * (rhoj - sph.rho0), 0.0f) / (rhoj * rhoj);
+                float fp = sph.mass * (pi + pj) * sph.spiky * (sph.h - r) * (sph.h - r) / r;
+                float fv = sph.viscosity * sph.mass * sph.visclap * (sph.h - r) / rhoj;
+                for (int c = 0; c < 3; c++)
+                    a[c] += fp * r3[c] + fv * (ov[c] - v[c]);
+            });
+            Particle &out = ps[hperm[k]];
+            for (int c = 0; c < 3; c++)
+                out.vel[c] += sim.params.dt * a[c];
+        }
+    });
+}
@@ -0,0 +1,148 @@
+#include "particle.hpp"
+using namespace std;
+
+static const size_t STATS_LOCAL = 256; // work-group size of both passes
+static const size_t STATS_GROUPS = 64; // partial results of the first pass
+
+static cl_kernel ker_stats, ker_final;
+static cl_mem partial, result;       // per-group partials, the merged result
+static cl_event reading = nullptr;   // the asynchronous read of result in flight
+static Stats incoming;               // its destination
+static Stats latest;                 // newest result that has arrived
+static bool warned = false;          // the state was reported as not finite
+
+static cl_kernel statskernel(const char *name)
+{
+    cl_kernel k = clCreateKernel(program, name, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create " << name << " kernel: " << ret << endl;
+        exit(1);
+    }
+    return k;
+}
+
+void statsinit()
+{
+    if (opts.backend == BK_CPU)
+        return;
+    cl_int np = sim.n, ngroups = STATS_GROUPS;
+    partial = clCreateBuffer(context, CL_MEM_READ_WRITE, STATS_GROUPS * sizeof(Stats), NULL, &ret);
+    result = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Stats), NULL, &ret);
+    if (ret != CL_SUCCESS)
+    {
+        cout << RED << "Failed to create stats buffers: " << ret << endl;
+        exit(1);
+    }
+
+    ker_stats = statskernel("stats");
+    ker_final = statskernel("statsfinal");
+
+    clSetKernelArg(ker_stats, 0, sizeof(cl_mem), &sim.particles);
+    clSetKernelArg(ker_stats, 1, sizeof(cl_int), &np);
+    clSetKernelArg(ker_stats, 2, sizeof(cl_mem), &partial);
+    clSetKernelArg(ker_stats, 3, STATS_LOCAL * sizeof(Stats), NULL);
+
+    clSetKernelArg(ker_final, 0, sizeof(cl_mem), &partial);
+    clSetKernelArg(ker_final, 1, sizeof(cl_int), &ngroups);
+    clSetKernelArg(ker_final, 2, sizeof(cl_mem), &result);
+    clSetKernelArg(ker_final, 3, STATS_LOCAL * sizeof(Stats), NULL);
+}
+
+// Report once when the particles have blown up
+static void statscheck(const Stats &s)
+{
+    bool finite = true;
+    for (int c = 0; c < 4; c++)
+        finite = finite && isfinite(s.lo[c]) && isfinite(s.hi[c]) && isfinite(s.sum[c]);
+    if (!finite && !warned)
+        cout << RED << "Particle state is no longer finite at step " << nstep << endl;
+    warned = warned || !finite;
+}
+
+// Take the result of the read in flight if it has arrived
+static void statspoll()
+{
+    cl_int status;
+    if (!reading)
+        return;
+    clGetEventInfo(reading, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+    if (status != CL_COMPLETE)
+        return;
+    clReleaseEvent(reading);
+    reading = nullptr;
+    latest = incoming;
+    statscheck(latest);
+}
+
+// Enqueue both passes on the current state and read the 64-byte result back without
+// waiting. The passes always run, so statsbuffer() is current for later kernels in the
+// queue, but a read only starts once the previous one has arrived.
+void statslaunch()
+{
+    if (opts.backend == BK_CPU)
+    {
+        cpustats(latest);
+        statscheck(latest);
+        return;
+    }
+    size_t local = STATS_LOCAL, global = STATS_GROUPS * STATS_LOCAL;
+    statspoll();
+    clacquire("stats");
+    clEnqueueNDRangeKernel(command_queue, ker_stats, 1, NULL, &global, &local, 0, NULL, traceev("stats"));
+    clEnqueueNDRangeKernel(command_queue, ker_final, 1, NULL, &local, &local, 0, NULL, traceev("stats final"));
+    clrelease("stats");
+    if (!reading)
+        clEnqueueReadBuffer(command_queue, result, CL_FALSE, 0, sizeof(Stats), &incoming, 0, NULL, &reading);
+    clFlush(command_queue);
+}
+
+// Newest diagnostics, at most a frame old
+const Stats &statsget()
+{
+    if (opts.backend == BK_CL)
+        statspoll();
+    return latest;
+}
+
+// Device copy of the newest result, written by the passes of the last statslaunch
+cl_mem statsbuffer()
+{
+    return result;
+}
+
+// Ease the camera towards the centroid, and back far enough that the bounding box fits the
+// 90 degree view. rot is the rotation the particles are drawn with, applied before trans.
+void statsframe(const float *rot)
+{
+    const Stats &s = statsget();
+    if (s.lo[0] > s.hi[0] || !isfinite(s.sum[0] + s.sum[1] + s.sum[2]))
+        return;
+    float c[3], r[3], radius = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        c[k] = s.sum[k] / sim.n;
+        radius += (s.hi[k] - s.lo[k]) * (s.hi[k] - s.lo[k]) / 4;
+    }
+    for (int j = 0; j < 3; j++)
+        r[j] = c[0] * rot[j] + c[1] * rot[4 + j] + c[2] * rot[8 + j] + rot[12 + j];
+    float target[3] = {-r[0], -r[1], -r[2] - 1.5f * sqrtf(radius)};
+    for (int k = 0; k < 3; k++)
+        g_bufs.trans[12 + k] += (target[k] - g_bufs.trans[12 + k]) * 0.05f;
+}
+
+void statsend()
+{
+    if (opts.backend == BK_CPU)
+        return;
+    if (reading)
+    {
+        clWaitForEvents(1, &reading);
+        clReleaseEvent(reading);
+        reading = nullptr;
+    }
+    clReleaseKernel(ker_stats);
+    clReleaseKernel(ker_final);
+    clReleaseMemObject(partial);
+    clReleaseMemObject(result);
+}
@@ -0,0 +1,497 @@
+#include "particle.hpp"
+#include "streamproto.hpp"
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+typedef shared_ptr<const string> Frame;
+
+// A connection, owned by the server thread
+struct Client
+{
+    enum Mode
+    {
+        HELLO, // protocol not known yet
+        RAW,   // length-prefixed frames, text line commands
+        WS,    // WebSocket messages
+        BYE    // close once out is sent
+    };
+    int fd;
+    Mode mode{HELLO};
+    string in;     // received, not parsed yet
+    string out;    // being sent
+    size_t sent{0}; // bytes of out already sent
+    Frame waiting;  // newest frame not started yet, replaced when a newer one comes
+};
+
+static int listenfd = -1;
+static int wake[2] = {-1, -1};        // the frame loop writes a byte here when there is a new frame
+static thread server;                 // runs serve()
+static atomic<bool> stopping{false};  // set by streamend
+static atomic<int> watching{0};       // clients that take frames, nothing is sampled without them
+static mutex guarded;                 // guards latest
+static Frame latest;                  // newest frame from streampublish
+static atomic<long> dropped{0};       // frames replaced before a client could start on them
+
+// The viewer page served for a plain GET
+static const char *page = R"(<!doctype html>
+<title>Particles</title>
+<body style="margin:0;background:#000;overflow:hidden">
+<canvas id="c"></canvas>
+<script>
+const c = document.getElementById('c'), g = c.getContext('2d');
+c.width = innerWidth; c.height = innerHeight;
+const ws = new WebSocket('ws://' + location.host + '/');
+ws.binaryType = 'arraybuffer';
+let w = 1, h = 1;
+const send = s => ws.readyState == 1 && ws.send(s);
+ws.onmessage = e => {
+    const v = new DataView(e.data), n = v.getUint32(8, true), s = Math.min(c.width, c.height) / 3;
+    const lo = [0, 1].map(i => v.getFloat32(16 + 4 * i, true)), ex = [0, 1].map(i => v.getFloat32(28 + 4 * i, true));
+    w = v.getUint16(60, true); h = v.getUint16(62, true);
+    const img = g.createImageData(c.width, c.height), d = img.data;
+    for (let i = 0; i < n; i++) {
+        const x = lo[0] + v.getUint16(64 + 6 * i, true) / 65535 * ex[0];
+        const y = lo[1] + v.getUint16(66 + 6 * i, true) / 65535 * ex[1];
+        const px = Math.round(c.width / 2 + x * s), py = Math.round(c.height / 2 - y * s);
+        if (px >= 0 && py >= 0 && px < c.width && py < c.height)
+            d.fill(255, 4 * (py * c.width + px), 4 * (py * c.width + px) + 4);
+    }
+    g.putImageData(img, 0, 0);
+};
+c.onmousemove = e => send('cursor ' + e.clientX * w / c.width + ' ' + e.clientY * h / c.height);
+c.onmousedown = e => send('button ' + e.button + ' 1');
+c.onmouseup = e => send('button ' + e.button + ' 0');
+c.onwheel = e => send('scroll 0 ' + (e.deltaY < 0 ? 1 : -1));
+addEventListener('keydown', e => send('key ' + (e.key.length == 1 ? e.key.toUpperCase() : e.key.toLowerCase())));
+</script>
+)";
+
+static uint32_t rol(uint32_t x, int k)
+{
+    return x << k | x >> (32 - k);
+}
+
+// SHA-1 digest, only for the WebSocket handshake
+static string sha1(const string &msg)
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    string m = msg + '\x80';
+    while (m.size() % 64 != 56)
+        m += '\0';
+    uint64_t bits = (uint64_t)msg.size() * 8;
+    for (int i = 7; i >= 0; i--)
+        m += (char)(bits >> (8 * i));
+    for (size_t off = 0; off < m.size(); off += 64)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+        {
+            const unsigned char *b = (const unsigned char *)&m[off + 4 * i];
+            w[i] = (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+        }
+        for (int i = 16; i < 80; i++)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5A827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ED9EBA1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = b ^ c ^ d, k = 0xCA62C1D6;
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    string digest;
+    for (int i = 0; i < 20; i++)
+        digest += (char)(h[i / 4] >> (24 - 8 * (i % 4)));
+    return digest;
+}
+
+static string base64(const string &s)
+{
+    static const char *digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string out;
+    for (size_t i = 0; i < s.size(); i += 3)
+    {
+        uint32_t v = (unsigned char)s[i] << 16;
+        if (i + 1 < s.size())
+            v |= (unsigned char)s[i + 1] << 8;
+        if (i + 2 < s.size())
+            v |= (unsigned char)s[i + 2];
+        out += digits[v >> 18 & 63];
+        out += digits[v >> 12 & 63];
+        out += i + 1 < s.size() ? digits[v >> 6 & 63] : '=';
+        out += i + 2 < s.size() ? digits[v & 63] : '=';
+    }
+    return out;
+}
+
+// Answer the HTTP request in c.in: a WebSocket upgrade, or the viewer page
+static void handshake(Client &c)
+{
+    istringstream request(c.in.substr(0, c.in.find("\r\n\r\n")));
+    string line, key;
+    while (getline(request, line))
+        if (line.compare(0, 18, "Sec-WebSocket-Key:") == 0)
+        {
+            key = line.substr(18);
+            key.erase(0, key.find_first_not_of(" \t"));
+            key.erase(key.find_last_not_of(" \t\r") + 1);
+        }
+    c.in.erase(0, c.in.find("\r\n\r\n") + 4);
+    if (key.empty())
+    {
+        c.out = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nConnection: close\r\nContent-Length: " +
+                to_string(strlen(page)) + "\r\n\r\n" + page;
+        c.mode = Client::BYE;
+        return;
+    }
+    string accept = base64(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+    c.out = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: " + accept + "\r\n\r\n";
+    c.mode = Client::WS;
+}
+
+// Queue a client's command line like the window callbacks queue their events
+static void command(const string &line)
+{
+    istringstream in(line);
+    string word, key;
+    Event e; // stamped with its step when it is applied
+    if (!(in >> word))
+        return;
+    if (word == "cursor" && in >> e.x >> e.y)
+        e.type = EV_CURSOR;
+    else if (word == "button" && in >> e.key >> e.action)
+        e.type = EV_BUTTON;
+    else if (word == "scroll" && in >> e.x >> e.y)
+        e.type = EV_SCROLL;
+    else if (word == "key" && in >> key)
+    {
+        e.type = EV_KEY;
+        if (!(in >> e.action))
+            e.action = GLFW_PRESS;
+        if (key == "enter")
+            e.key = GLFW_KEY_ENTER;
+        else if (key == "escape")
+            e.key = GLFW_KEY_ESCAPE;
+        else if (key.size() == 1)
+            e.key = toupper(key[0]);
+        else
+            e.key = atoi(key.c_str());
+    }
+    else
+    {
+        cout << ORANGE << "Ignoring stream command: " << line << endl;
+        return;
+    }
+    inputpush(e);
+}
+
+// Take the commands out of c.in, false when the client is done
+static bool parse(Client &c)
+{
+    if (c.mode == Client::HELLO)
+    {
+        if (c.in.compare(0, 4, "GET ") == 0 && c.in.find("\r\n\r\n") != string::npos)
+            handshake(c);
+        else if (c.in.compare(0, 8, "PSTREAM\n") == 0)
+        {
+            c.in.erase(0, 8);
+            c.mode = Client::RAW;
+        }
+        else if (c.in.size() >= 8 && c.in.compare(0, 4, "GET ") != 0)
+            return false;
+    }
+    if (c.mode == Client::RAW)
+    {
+        size_t end;
+        while ((end = c.in.find('\n')) != string::npos)
+        {
+            command(c.in.substr(0, end));
+            c.in.erase(0, end + 1);
+        }
+    }
+    while (c.mode == Client::WS && c.in.size() >= 2)
+    {
+        // Client messages are always masked
+        const unsigned char *b = (const unsigned char *)c.in.data();
+        int opcode = b[0] & 15;
+        uint64_t len = b[1] & 127;
+        size_t head = 2;
+        if (len == 126)
+            head = 4;
+        else if (len == 127)
+            head = 10;
+        if (c.in.size() < head + 4)
+            break;
+        if (len >= 126)
+        {
+            len = 0;
+            for (size_t i = 2; i < head; i++)
+                len = len << 8 | b[i];
+        }
+        if (c.in.size() < head + 4 + len)
+            break;
+        string payload = c.in.substr(head + 4, len);
+        for (size_t i = 0; i < len; i++)
+            payload[i] ^= b[head + i % 4];
+        c.in.erase(0, head + 4 + len);
+        if (opcode == 8)
+            return false;
+        istringstream lines(payload);
+        string line;
+        while (opcode == 1 && getline(lines, line))
+            command(line);
+    }
+    return true;
+}
+
+// The frame as this client's protocol sends it
+static void encode(Client &c, const string &frame)
+{
+    uint64_t n = frame.size();
+    string head;
+    if (c.mode == Client::RAW)
+        for (int i = 0; i < 4; i++)
+            head += (char)(n >> (8 * i));
+    else
+    {
+        head += (char)0x82;
+        int bytes = n < 126 ? 0 : n < 65536 ? 2 : 8;
+        head += (char)(n < 126 ? n : bytes == 2 ? 126 : 127);
+        for (int i = bytes - 1; i >= 0; i--)
+            head += (char)(n >> (8 * i));
+    }
+    c.out = head + frame;
+    c.sent = 0;
+}
+
+// Send what the socket takes without blocking, false when the client has gone
+static bool flush(Client &c)
+{
+    while (true)
+    {
+        if (c.sent == c.out.size())
+        {
+            if (c.mode == Client::BYE && !c.out.empty())
+                return false;
+            if (!c.waiting || (c.mode != Client::RAW && c.mode != Client::WS))
+                return true;
+            encode(c, *c.waiting);
+            c.waiting.reset();
+        }
+        ssize_t k = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+        if (k < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        c.sent += k;
+    }
+}
+
+// Server thread: accepts clients, reads their commands and hands every client the newest
+// frame once it has finished sending the previous one. A client that cannot keep up
+// only ever skips frames, nothing here waits on the frame loop or the other way round.
+static void serve()
+{
+    vector<Client> clients;
+    tracethread("stream server");
+    while (!stopping)
+    {
+        vector<pollfd> fds = {{listenfd, POLLIN, 0}, {wake[0], POLLIN, 0}};
+        for (Client &c : clients)
+            fds.push_back({c.fd, (short)(POLLIN | (c.sent < c.out.size() || c.waiting ? POLLOUT : 0)), 0});
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+            break;
+
+        if (fds[1].revents & POLLIN)
+        {
+            char buf[64];
+            while (read(wake[0], buf, sizeof(buf)) > 0)
+                ;
+            Frame frame;
+            {
+                lock_guard<mutex> guard(guarded);
+                frame = latest;
+            }
+            for (Client &c : clients)
+                if (frame && (c.mode == Client::RAW || c.mode == Client::WS))
+                {
+                    if (c.waiting)
+                        dropped++;
+                    c.waiting = frame;
+                }
+        }
+
+        int taking = 0;
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            Client &c = clients[i];
+            bool alive = true;
+            if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                char buf[4096];
+                ssize_t k = recv(c.fd, buf, sizeof(buf), 0);
+                if (k > 0)
+                    c.in.append(buf, k);
+                alive = (k > 0 || (k < 0 && errno == EAGAIN)) && c.in.size() < 65536 && parse(c);
+            }
+            alive = alive && flush(c);
+            if (!alive)
+            {
+                close(c.fd);
+                c.fd = -1;
+            }
+            taking += c.fd >= 0 && (c.mode == Client::RAW || c.mode == Client::WS);
+        }
+        clients.erase(remove_if(clients.begin(), clients.end(), [](const Client &c) { return c.fd < 0; }),
+                      clients.end());
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listenfd, NULL, NULL);
+            if (fd >= 0)
+            {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                clients.push_back(Client{fd});
+            }
+        }
+        watching = taking;
+    }
+    for (Client &c : clients)
+        close(c.fd);
+}
+
+// Listen on loopback and start the server thread
+void streaminit()
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.serve);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int yes = 1;
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (listenfd < 0 || bind(listenfd, (sockaddr *)&addr, sizeof(addr)) || listen(listenfd, 8) || pipe(wake))
+    {
+        cout << RED << "Failed to serve frames on port " << opts.serve << endl;
+        exit(1);
+    }
+    fcntl(listenfd, F_SETFL, O_NONBLOCK);
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    server = thread(serve);
+    cout << YELLO << "Serving frames on http://127.0.0.1:" << opts.serve << "/" << endl;
+}
+
+// Sample every k-th particle's position, at most opts.servemax of them
+static vector<float> streamsample(uint32_t &count)
+{
+    size_t k = (sim.n + opts.servemax - 1) / opts.servemax;
+    count = (sim.n + k - 1) / k;
+    vector<float> pos(4 * count);
+    if (opts.backend == BK_CL && !opts.chunk)
+    {
+        // A strided read, 16 bytes out of every k particles
+        size_t origin[3] = {0, 0, 0};
+        size_t region[3] = {4 * sizeof(float), count, 1};
+        clacquire("stream");
+        clEnqueueReadBufferRect(command_queue, sim.particles, CL_TRUE, origin, origin, region, k * sizeof(Particle),
+                                0, 4 * sizeof(float), 0, pos.data(), 0, NULL, NULL);
+        clrelease("stream");
+        return pos;
+    }
+    const Particle *src = opts.chunk ? oocdata() : cpudata();
+    for (size_t i = 0; i < count; i++)
+        memcpy(&pos[4 * i], src[i * k].pos, 4 * sizeof(float));
+    return pos;
+}
+
+// Hand the server a frame of the current state, skipped while nobody is watching
+void streampublish()
+{
+    if (!watching)
+        return;
+    TraceScope scope("stream");
+    StreamHeader h{};
+    vector<float> pos = streamsample(h.count);
+    h.magic = STREAM_MAGIC;
+    h.step = nstep;
+    h.total = sim.n;
+    for (int c = 0; c < 3; c++)
+    {
+        float lo = INFINITY, hi = -INFINITY;
+        for (uint32_t i = 0; i < h.count; i++)
+        {
+            lo = min(lo, pos[4 * i + c]);
+            hi = max(hi, pos[4 * i + c]);
+        }
+        h.lo[c] = lo;
+        h.extent[c] = max(hi - lo, 1e-6f);
+    }
+    h.mouse[0] = sim.mouse.x;
+    h.mouse[1] = sim.mouse.y;
+    h.mouse[2] = sim.mouse.z;
+    h.att = sim.mouse.att;
+    h.nattr = sim.attractors.size();
+    h.width = W;
+    h.height = H;
+
+    string frame((const char *)&h, sizeof(h));
+    frame.resize(sizeof(h) + streampositions(h.count) + h.nattr * sizeof(StreamAttr));
+    uint16_t *q = (uint16_t *)&frame[sizeof(h)];
+    for (uint32_t i = 0; i < h.count; i++)
+        for (int c = 0; c < 3; c++)
+            q[3 * i + c] = (uint16_t)lrintf(min(max((pos[4 * i + c] - h.lo[c]) / h.extent[c], 0.0f), 1.0f) * 65535);
+    StreamAttr *a = (StreamAttr *)&frame[sizeof(h) + streampositions(h.count)];
+    for (uint32_t i = 0; i < h.nattr; i++)
+    {
+        const Attractor &src = sim.attractors[i];
+        a[i] = StreamAttr{{src.pos[0], src.pos[1], src.pos[2]}, src.strength};
+    }
+
+    {
+        lock_guard<mutex> guard(guarded);
+        latest = make_shared<const string>(move(frame));
+    }
+    char byte = 0;
+    (void)!write(wake[1], &byte, 1);
+}
+
+void streamend()
+{
+    stopping = true;
+    char byte = 0;
+    (void)!write(wake[1], &byte, 1);
+    server.join();
+    close(listenfd);
+    close(wake[0]);
+    close(wake[1]);
+    if (dropped)
+        cout << YELLO << dropped << " frames were skipped for slow stream clients" << endl;
+}
@@ -0,0 +1,51 @@
+// Wire format of the frame stream served with --serve. Shared by stream.cpp and the clients,
+// needs nothing else from the tree.
+//
+// A client either speaks WebSocket (an HTTP upgrade request; frames arrive as binary
+// messages, commands go out as text messages) or raw TCP: it sends the line "PSTREAM",
+// then every frame arrives as a 4-byte little-endian length followed by the frame, and
+// commands go out as text lines. A plain HTTP GET is answered with a small viewer page.
+//
+// A frame is a StreamHeader, then count positions of three uint16 each, padded to 4 bytes,
+// then nattr attractors of StreamAttr. Position c of a particle is lo[c] + q / 65535 * extent[c].
+//
+// Commands, the same events the window callbacks record:
+//     cursor x y       cursor position in window pixels
+//     button b action  mouse button b pressed (1) or released (0)
+//     scroll x y       scroll offsets: x changes the pull, y zooms
+//     key k [action]   GLFW key code, a single character, "enter" or "escape", pressed unless action is 0
+#ifndef STREAMPROTO_HPP
+#define STREAMPROTO_HPP
+
+#include <cstdint>
+
+#define STREAM_MAGIC 0x31465350 // "PSF1"
+
+struct StreamHeader
+{
+    uint32_t magic;    // STREAM_MAGIC
+    uint32_t step;     // simulation step of the frame
+    uint32_t count;    // positions in this frame
+    uint32_t total;    // particles in the simulation, count of them are sampled evenly
+    float lo[3];       // quantization box corner
+    float extent[3];   // quantization box size
+    float mouse[3];    // position of the mouse mass
+    float att;         // global attraction
+    uint32_t nattr;    // attractors after the positions
+    uint16_t width;    // window size the cursor commands are in
+    uint16_t height;   // 64 bytes
+};
+
+struct StreamAttr
+{
+    float pos[3];   // position
+    float strength; // multiplies the global attraction
+};
+
+// Bytes of the positions block, padded so the attractors stay aligned
+inline uint32_t streampositions(uint32_t count)
+{
+    return (count * 6 + 3) / 4 * 4;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#version 400 core
+
+out vec4 Color;
+
+uniform sampler2D density;
+uniform vec3 hsv;
+uniform float bl;
+uniform float exposure;
+
+vec3 hsv2rgb(vec3 c)
+{
+    vec4 K = vec4(1.0, 2.0 / 3.0, 1.0 / 3.0, 3.0);
+    vec3 p = abs(fract(c.xxx + K.xyz) * 6.0 - K.www);
+    return c.z * mix(K.xxx, clamp(p - K.xxx, 0.0, 1.0), c.y);
+}
+
+void main()
+{
+	vec2 acc = texelFetch(density, ivec2(gl_FragCoord.xy), 0).xy;
+	float d = acc.y / max(acc.x, 1.0);
+	float k = 1.0 - exp(-exposure * acc.x);
+	Color = vec4(mix(vec3(bl), hsv2rgb(vec3(hsv.x - d / 7, hsv.y, hsv.z)), k), 1.0);
+}
@@ -0,0 +1,89 @@
+// Test client for --serve: connects over raw TCP, sends the commands given on the command
+// line and checks the frames that come back against streamproto.hpp.
+//
+//     streamclient port [frames] [command...]
+//     streamclient 8080 20 "cursor 400 300" "button 0 1" "key e"
+#include "../streamproto.hpp"
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+static bool readall(int fd, void *dst, size_t n)
+{
+    char *p = (char *)dst;
+    while (n)
+    {
+        ssize_t k = recv(fd, p, n, 0);
+        if (k <= 0)
+            return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+static int fail(const char *what)
+{
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+int main(int ac, char **av)
+{
+    if (ac < 2)
+    {
+        printf("Usage: %s port [frames] [command...]\n", av[0]);
+        return 1;
+    }
+    int frames = ac > 2 ? atoi(av[2]) : 10;
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(av[1]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)))
+        return fail("cannot connect");
+
+    std::string hello = "PSTREAM\n";
+    for (int i = 3; i < ac; i++)
+        hello += std::string(av[i]) + "\n";
+    if (send(fd, hello.data(), hello.size(), 0) != (ssize_t)hello.size())
+        return fail("cannot send");
+
+    uint32_t last = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        unsigned char len[4];
+        if (!readall(fd, len, 4))
+            return fail("connection closed");
+        uint32_t size = len[0] | len[1] << 8 | len[2] << 16 | (uint32_t)len[3] << 24;
+        std::vector<char> frame(size);
+        if (size < sizeof(StreamHeader) || !readall(fd, frame.data(), size))
+            return fail("short frame");
+
+        StreamHeader h;
+        memcpy(&h, frame.data(), sizeof(h));
+        if (h.magic != STREAM_MAGIC)
+            return fail("bad magic");
+        if (size != sizeof(h) + streampositions(h.count) + h.nattr * sizeof(StreamAttr))
+            return fail("frame size does not match its header");
+        if (h.count > h.total || (h.total && !h.count))
+            return fail("bad sample count");
+        if (f && h.step <= last)
+            return fail("steps out of order");
+        last = h.step;
+        printf("step %u: %u of %u particles, box (%g %g %g) + (%g %g %g), mouse (%g %g %g) att %g, %u attractors\n",
+               h.step, h.count, h.total, h.lo[0], h.lo[1], h.lo[2], h.extent[0], h.extent[1], h.extent[2],
+               h.mouse[0], h.mouse[1], h.mouse[2], h.att, h.nattr);
+    }
+    close(fd);
+    printf("OK: %d frames\n", frames);
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include "particle.hpp"
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+using namespace std;
+
+bool tracing = false; // --trace was given
+
+static const size_t TRACE_MAX = 1 << 22; // records kept per track, later ones are only counted
+
+// A span on the trace clock, ns since traceinit
+struct Record
+{
+    const char *name;
+    int64_t begin;
+    int64_t end;
+};
+
+// One thread's spans. Only that thread appends, they are read at exit once the threads are done.
+struct ThreadTrace
+{
+    int tid;
+    string name;
+    vector<Record> records;
+    long dropped{0};
+};
+
+// A command whose profiling times are not known yet
+struct Pending
+{
+    const char *name;
+    cl_event ev;
+};
+
+// A device queue shown as its own track
+struct QueueTrace
+{
+    cl_command_queue queue;
+    string name;
+    vector<Record> records;
+    long dropped{0};
+};
+
+static chrono::steady_clock::time_point epoch;    // trace clock zero
+static mutex registry;                            // guards threads, taken once per thread
+static vector<ThreadTrace *> threads;             // every thread that recorded
+static thread_local ThreadTrace *mine = nullptr;  // this thread's spans
+static deque<Pending> pending;                    // device commands in flight, frame loop only
+static vector<QueueTrace> queues;                 // device tracks
+static int64_t offset = 0;                        // host minus device clock
+static bool calibrated = false;                   // offset has been measured
+
+int64_t tracenow()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+}
+
+static ThreadTrace *self()
+{
+    if (!mine)
+    {
+        lock_guard<mutex> guard(registry);
+        mine = new ThreadTrace{(int)threads.size(), "thread " + to_string(threads.size())};
+        threads.push_back(mine);
+    }
+    return mine;
+}
+
+// Name the calling thread's track
+void tracethread(const char *name)
+{
+    if (tracing)
+        self()->name = name;
+}
+
+void tracehost(const char *name, int64_t begin, int64_t end)
+{
+    ThreadTrace *t = self();
+    if (t->records.size() < TRACE_MAX)
+        t->records.push_back(Record{name, begin, end});
+    else
+        t->dropped++;
+}
+
+// Queues are created with profiling on while tracing
+const cl_queue_properties *traceprops()
+{
+    static const cl_queue_properties props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    return tracing ? props : nullptr;
+}
+
+void tracequeue(cl_command_queue q, const char *name)
+{
+    if (tracing)
+        queues.push_back(QueueTrace{q, name});
+}
+
+// Where an enqueue call should put its event: traced once it completes, or NULL when not
+// tracing. The slot stays valid until the enqueue has filled it in.
+cl_event *traceev(const char *name)
+{
+    if (!tracing)
+        return nullptr;
+    pending.push_back(Pending{name, nullptr});
+    return &pending.back().ev;
+}
+
+// Trace an event the caller keeps using
+void tracecl(cl_event ev, const char *name)
+{
+    if (!tracing || !ev)
+        return;
+    clRetainEvent(ev);
+    pending.push_back(Pending{name, ev});
+}
+
+// The device clock against the trace clock, from a marker waited on by the host. The host
+// sees the marker end a little late, so device spans may show slightly early.
+static void calibrate(cl_command_queue q)
+{
+    cl_event marker;
+    cl_ulong end = 0;
+    clEnqueueMarkerWithWaitList(q, 0, NULL, &marker);
+    clWaitForEvents(1, &marker);
+    int64_t host = tracenow();
+    clGetEventProfilingInfo(marker, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    clReleaseEvent(marker);
+    offset = host - (int64_t)end;
+    calibrated = true;
+}
+
+// Move the finished commands onto their queue tracks, in order up to the first that is still
+// running. Called every step, and with wait at the end to drain everything.
+void tracecollect(bool wait)
+{
+    while (!pending.empty())
+    {
+        Pending p = pending.front();
+        cl_int status = CL_COMPLETE;
+        if (p.ev && wait)
+            clWaitForEvents(1, &p.ev);
+        if (p.ev)
+            clGetEventInfo(p.ev, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        if (status > CL_COMPLETE)
+            break;
+        pending.pop_front();
+        if (!p.ev)
+            continue;
+
+        cl_command_queue q;
+        cl_ulong start = 0, end = 0;
+        clGetEventInfo(p.ev, CL_EVENT_COMMAND_QUEUE, sizeof(q), &q, NULL);
+        clGetEventProfilingInfo(p.ev, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        clGetEventProfilingInfo(p.ev, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+        clReleaseEvent(p.ev);
+        if (status != CL_COMPLETE)
+            continue;
+        if (!calibrated)
+            calibrate(q);
+        size_t k = 0;
+        while (k < queues.size() && queues[k].queue != q)
+            k++;
+        if (k == queues.size())
+            queues.push_back(QueueTrace{q, "queue " + to_string(k)});
+        if (queues[k].records.size() < TRACE_MAX)
+            queues[k].records.push_back(Record{p.name, (int64_t)start + offset, (int64_t)end + offset});
+        else
+            queues[k].dropped++;
+    }
+}
+
+static void tracewrite()
+{
+    if (!tracing)
+        return;
+    ofstream out(opts.trace);
+    if (!out.is_open())
+    {
+        cout << RED << "Failed to write trace: " << opts.trace << endl;
+        return;
+    }
+    out << fixed << setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"host\"}},\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": {\"name\": \"device\"}}";
+    long count = 0, dropped = 0;
+    auto track = [&](int pid, int tid, const string &name, const vector<Record> &records) {
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"tid\": " << tid
+            << ", \"args\": {\"name\": \"" << name << "\"}}";
+        for (const Record &r : records)
+            out << ",\n{\"name\": \"" << r.name << "\", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << tid
+                << ", \"ts\": " << r.begin / 1000.0 << ", \"dur\": " << (r.end - r.begin) / 1000.0 << "}";
+        count += records.size();
+    };
+    for (ThreadTrace *t : threads)
+    {
+        track(1, t->tid, t->name, t->records);
+        dropped += t->dropped;
+    }
+    for (size_t k = 0; k < queues.size(); k++)
+    {
+        track(2, k, queues[k].name, queues[k].records);
+        dropped += queues[k].dropped;
+    }
+    out << "\n]}\n";
+    cout << YELLO << "Wrote " << count << " trace events to " << opts.trace << endl;
+    if (dropped)
+        cout << ORANGE << dropped << " trace events did not fit" << endl;
+}
+
+// Start the trace clock, the file is written when the process exits
+void traceinit()
+{
+    tracing = true;
+    epoch = chrono::steady_clock::now();
+    tracethread("main");
+    atexit(tracewrite);
+}
@@ -0,0 +1,77 @@
+#include "particle.hpp"
+using namespace std;
+
+static const int NREGION = 3;     // regions of the mapped VBO, one drawn while others are written
+static Particle *mapped;          // persistently mapped VBO, NREGION regions of N particles
+static GLsync fences[NREGION];    // signalled when the GPU is done drawing from a region
+static int region = 0;            // region holding the newest particles
+
+// Whether OpenCL works directly on the GL buffer. A quantized VBO only receives copies,
+// the simulation then keeps its own device buffer.
+bool glshared()
+{
+    return !opts.headless && opts.backend == BK_CL && opts.transfer == TR_INTEROP && !opts.quantize;
+}
+
+// Allocate the VBO as immutable storage mapped once for the whole run
+void transferinit()
+{
+    if (!GLEW_ARB_buffer_storage)
+    {
+        cout << RED << "Mapped transfers need GL_ARB_buffer_storage (OpenGL 4.4)" << endl;
+        exit(1);
+    }
+    const size_t size = NREGION * sim.n * sizeof(Particle);
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    std::vector<Particle> zeros(NREGION * sim.n);
+    glBufferStorage(GL_ARRAY_BUFFER, size, zeros.data(), flags);
+    mapped = (Particle *)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    if (!mapped)
+    {
+        cout << RED << "Failed to map the particle buffer" << endl;
+        exit(1);
+    }
+}
+
+// Next region to write, once the GPU has finished drawing from it
+Particle *transferbegin()
+{
+    region = (region + 1) % NREGION;
+    if (fences[region])
+    {
+        while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(fences[region]);
+        fences[region] = 0;
+    }
+
+    // Point the vertex attribute at the region, the writes are visible through the coherent mapping
+    glBindVertexArray(g_bufs.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, g_bufs.vbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Particle), (void *)(region * sim.n * sizeof(Particle)));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    return mapped + (size_t)region * sim.n;
+}
+
+// Fence the draw that used the newest region, call after render()
+void transferfence()
+{
+    if (opts.transfer != TR_MAPPED)
+        return;
+    if (fences[region])
+        glDeleteSync(fences[region]);
+    fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void transferend()
+{
+    if (opts.transfer != TR_MAPPED)
+        return;
+    for (int i = 0; i < NREGION; i++)
+        if (fences[i])
+            glDeleteSync(fences[i]);
+    glBindBuffer(GL_ARRAY_BUFFER, g_bufs.vbo);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}